@@ -3,7 +3,13 @@
 #include "jtk/concurrency.h"
 #include "jtk/qbvh.h"
 
+#include "cpu.h"
 #include "matcap.h"
+#include "wbvh.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
 
 extern "C"
   {
@@ -11,6 +17,7 @@ extern "C"
   }
   
 #define USE_THREAD_POOL
+#define USE_RAY_PACKETS
 
 using namespace jtk;
 
@@ -79,31 +86,41 @@ namespace
 
   void copy(jtk::image<uint32_t>& dest, const jtk::image<uint32_t>& src)
     {
+    const simd_kernels& k = get_simd_kernels();
     const uint32_t h = src.height();
-    const uint32_t w = src.width() >> 2;
+    const uint32_t w = src.width();
     for (uint32_t y = 0; y < h; ++y)
-      {
-      uint32_t* p_dest = dest.row(y);
-      const uint32_t* p_src = src.row(y);
+      k.copy_row(dest.row(y), src.row(y), w);
+    }
 
-      for (uint32_t x = 0; x < w; ++x, p_dest += 4, p_src += 4)
-        {
-        __m128 buffer = _mm_load_ps((float*)p_src);
-        _mm_store_ps((float*)p_dest, buffer);
-        }
+  // points per batch of the point splatting, small enough to balance the workers on clouds of a few batches
+  const uint32_t splat_batch_size = 1 << 16;
 
-      }
+  simd_matcap make_simd_matcap(const matcap& _matcap)
+    {
+    simd_matcap m;
+    m.pixels = _matcap.im.data();
+    m.width = _matcap.im.width();
+    m.height = _matcap.im.height();
+    m.stride = _matcap.im.stride();
+    return m;
     }
   }
 
-canvas::canvas()
+canvas::canvas() : _mesh_im_valid(false), _point_layer_valid(false), _has_meshes(false), _previous_scene_version(0), _previous_canvas_valid(false), _camera_moved(false), _reprojected(false),
+  _reprojection_frame(0), _refinement_step(16), _fill_untraced(false), _last_full_trace_time_in_s(0.0), _nr_of_traced_pixels(0), _nr_of_splatted_points(0),
+  _resolution_scale(1.f), _upscaled(false), _last_frame_traced(false), _dirty_stages(RENDER_STAGE_ALL), _rendered_pointclouds_version(0),
+  _rendered_matcap_pixels(nullptr), _rendered_matcap_type(matcap_type::MATCAP_TYPE_INTERNAL_REDWAX), _ambient_occlusion_samples(0), _antialiasing_samples(1), _jitter_x(0.f), _jitter_y(0.f), _nr_of_clip_planes(0), _visible_bvh_version((uint64_t)-1), _visible_depth_min(0.f), _visible_depth_max(0.f), _cancel(false)
   {
   _tp.init();
+  _canvas = _free_g_buffer();
+  _previous_canvas = _free_g_buffer();
+  for (int i = 0; i < 3; ++i)
+    _frames.buffers()[i].pixels = _canvas;
   }
 
-canvas::canvas(uint32_t w, uint32_t h)
+canvas::canvas(uint32_t w, uint32_t h) : canvas()
   {
-  _tp.init();
   resize(w, h);
   }
 
@@ -118,59 +135,90 @@ void canvas::resize(uint32_t w, uint32_t h)
   {
   im = jtk::image<uint32_t>(w,h);
   background = jtk::image<uint32_t>(w,h);
-  _canvas = jtk::image<pixel>(w, h);
-  _u = jtk::image<float>(w, h);
-  _v = jtk::image<float>(w, h);
-  buffer = jtk::image<jtk::float4>(w, h);
-  for (auto& p : _canvas)
+  _mesh_im = jtk::image<uint32_t>(w, h);
+  _mesh_im_valid = false;
+  _point_im = jtk::image<uint32_t>(w, h);
+  _point_layer_valid = false;
+  _visible_pixels.reset();
+  _g_buffers.clear();
+  _canvas = _free_g_buffer();
+  _previous_canvas = _free_g_buffer();
+  for (int i = 0; i < 3; ++i)
     {
-    p.db_id = 0;
-    p.object_id = (uint32_t)-1;
+    canvas_frame& f = _frames.buffers()[i];
+    f.im = jtk::image<uint32_t>(w, h);
+    f.pixels = _canvas;
+    f.coordinate_system = get_identity();
+    f.nr_of_traced_pixels = 0;
+    f.nr_of_splatted_points = 0;
+    f.resolution_scale = 1.f;
+    f.tiles = tile_statistics();
     }
+  _previous_canvas_valid = false;
+  _dirty_stages = RENDER_STAGE_ALL;
+  _reprojection_keys.reset(new std::atomic<uint64_t>[(size_t)w * h]);
+  _trace_mask.resize((size_t)w * h);
+  _ambient_occlusion.resize((size_t)w * h);
+  _ambient_occlusion_samples = 0;
+  _splatter.release();
   _camera = make_default_camera();
   projection_matrix = make_projection_matrix(_camera, w, h);
   projection_matrix_inv = invert_projection_matrix(projection_matrix);
   //fill_background(background);
   }
 
+void canvas::clear_frames()
+  {
+  std::shared_ptr<const g_buffer> empty = std::make_shared<const g_buffer>(im.width(), im.height());
+  for (int i = 0; i < 3; ++i)
+    {
+    canvas_frame& f = _frames.buffers()[i];
+    f.pixels = empty;
+    f.nr_of_splatted_points = 0;
+    }
+  }
+
 void canvas::set_background_color(uint32_t clr_top, uint32_t clr_bottom)
   {
   fill_background(background, clr_top, clr_bottom);
+  invalidate(RENDER_STAGE_SHADING);
   }
 
 void canvas::get_pixel(pixel& p, const mouse_data& data, float mouse_offset_x, float mouse_offset_y)
   {
-  uint32_t X = (uint32_t)(data.mouse_x - mouse_offset_x);
-  uint32_t Y = (uint32_t)(data.mouse_y - mouse_offset_y);
-  p = _canvas(X, Y);
+  get_pixel(p, data.mouse_x, data.mouse_y, mouse_offset_x, mouse_offset_y);
   }
 
 void canvas::get_pixel(pixel& p, float pos_x, float pos_y, float mouse_offset_x, float mouse_offset_y)
   {
+  const g_buffer& pixels = *_frames.front().pixels;
   uint32_t X = (uint32_t)(pos_x - mouse_offset_x);
   uint32_t Y = (uint32_t)(pos_y - mouse_offset_y);
-  p = _canvas(X, Y);
+  p = (X < pixels.width() && Y < pixels.height()) ? pixels(X, Y) : pixel();
   }
 
-void canvas::do_mouse(bool& refresh, mouse_data& data, scene& s, float mouse_offset_x, float mouse_offset_y)
+void canvas::do_mouse(bool& refresh, mouse_data& data, scene_camera& s, float mouse_offset_x, float mouse_offset_y)
   {
   if (data.left_button_down || data.right_button_down || data.wheel_down)
     {
-    uint32_t X = (uint32_t)(data.mouse_x - mouse_offset_x);
-    uint32_t Y = (uint32_t)(data.mouse_y - mouse_offset_y);
-    auto f = _canvas(X, Y);
+    // the pivot is picked in the frame on screen, with the camera of that frame
+    const canvas_frame& frame = _frames.front();
+    pixel f;
+    get_pixel(f, data, mouse_offset_x, mouse_offset_y);
     //if (f.object_id != (uint32_t)-1)
     if (f.db_id)
       {
-      const uint32_t w = im.width();
-      const uint32_t h = im.height();
+      uint32_t X = (uint32_t)(data.mouse_x - mouse_offset_x);
+      uint32_t Y = (uint32_t)(data.mouse_y - mouse_offset_y);
+      const uint32_t w = frame.pixels->width();
+      const uint32_t h = frame.pixels->height();
 
       float4 screen_pos((2.f * ((X + 0.5f) / w) - 1.f), (2.f * ((Y + 0.5f) / h) - 1.f), _camera.nearClippingPlane, 1.f);
       float4 dir = matrix_vector_multiply(projection_matrix_inv, screen_pos);
       dir[3] = 0.f;
-      dir = matrix_vector_multiply(s.coordinate_system, dir);
+      dir = matrix_vector_multiply(frame.coordinate_system, dir);
       float4 origin(0.f, 0.f, 0.f, 1.f);
-      origin = matrix_vector_multiply(s.coordinate_system, origin);
+      origin = matrix_vector_multiply(frame.coordinate_system, origin);
       float4 pt = origin + f.depth * dir;
       s.pivot[0] = pt[0];
       s.pivot[1] = pt[1];
@@ -284,34 +332,81 @@ void canvas::do_mouse(bool& refresh, mouse_data& data, scene& s, float mouse_off
     }
   }
 
-float canvas::compute_convex_cos_angle(float x1, float y1, float u1, float v1, float depth1, float x2, float y2, float u2, float v2, float depth2)
+namespace
   {
-  float4 screen_pos1((2.f * ((x1 + 0.5f) / _canvas.width()) - 1.f), (2.f * ((y1 + 0.5f) / _canvas.height()) - 1.f), _camera.nearClippingPlane, 1.f);
-  float4 dir1 = matrix_vector_multiply(projection_matrix_inv, screen_pos1);
-  dir1[3] = 0.f;
 
-  float4 pt1 = depth1 * dir1;
+  inline float4 view_direction(const float4x4& projection_matrix_inv, float screen_x, float screen_y, float near_clipping_plane)
+    {
+    float4 screen_pos(screen_x, screen_y, near_clipping_plane, 1.f);
+    float4 dir = matrix_vector_multiply(projection_matrix_inv, screen_pos);
+    dir[3] = 0.f;
+    return dir;
+    }
+
+  float convex_cos_angle(const float4& dir1, float u1, float v1, float depth1, const float4& dir2, float u2, float v2, float depth2)
+    {
+    float4 pt1 = depth1 * dir1;
+    float4 pt2 = depth2 * dir2;
+
+    float4 n1(u1, v1, std::sqrt(1.f - u1 * u1 - v1 * v1), 0.f);
+    float4 n2(u2, v2, std::sqrt(1.f - u2 * u2 - v2 * v2), 0.f);
 
-  float4 screen_pos2((2.f * ((x2 + 0.5f) / _canvas.width()) - 1.f), (2.f * ((y2 + 0.5f) / _canvas.height()) - 1.f), _camera.nearClippingPlane, 1.f);
-  float4 dir2 = matrix_vector_multiply(projection_matrix_inv, screen_pos2);
-  dir2[3] = 0.f;
+    float angle;
 
-  float4 pt2 = depth2 * dir2;
+    if (std::abs(dot(n1, n2) - 1.f) > 0.0001)
+      {
+      auto pt = pt2 - pt1;
+      pt = pt / std::sqrt(dot(pt, pt));
+      angle = dot(pt, n1);
+      }
+    else
+      angle = 0.f;
+    return angle;
+    }
 
-  float4 n1(u1, v1, std::sqrt(1.f - u1 * u1 - v1 * v1), 0.f);
-  float4 n2(u2, v2, std::sqrt(1.f - u2 * u2 - v2 * v2), 0.f);
+  /*
+  Screen space x coordinate of the view ray through each pixel column, and y coordinate through each pixel row.
+  screen_y has an extra entry in front for row -1, so that screen_y[y] is the row above row y.
+  These are the exact expressions of compute_convex_cos_angle, so that the edge pass stays bit identical.
+  */
+  void make_screen_coordinates(std::vector<float>& screen_x, std::vector<float>& screen_y, uint32_t w, uint32_t h)
+    {
+    screen_x.resize(w + 1);
+    screen_y.resize(h + 1);
+    for (uint32_t x = 0; x <= w; ++x)
+      screen_x[x] = 2.f * (((float)x + 0.5f) / w) - 1.f;
+    for (uint32_t y = 0; y <= h; ++y)
+      screen_y[y] = 2.f * ((((float)y - 1.f) + 0.5f) / h) - 1.f;
+    }
 
-  float angle;
+  const uint32_t post_process_block_height = 16;
 
-  if (std::abs(dot(n1, n2) - 1.f) > 0.0001)
+  // Calls fun(y0, y1) for blocks of rows [y0, y1) that together cover [0, h).
+  template <class TFunctor>
+  void parallel_for_row_blocks(uint32_t h, TFunctor fun, jtk::thread_pool& tp)
     {
-    auto pt = pt2 - pt1;
-    pt = pt / std::sqrt(dot(pt, pt));
-    angle = dot(pt, n1);
+    const uint32_t nr_of_blocks = (h + post_process_block_height - 1) / post_process_block_height;
+    auto block = [&](uint32_t b)
+      {
+      const uint32_t y0 = b * post_process_block_height;
+      const uint32_t y1 = std::min(y0 + post_process_block_height, h);
+      fun(y0, y1);
+      };
+#if defined(USE_THREAD_POOL)
+    pooled_parallel_for(uint32_t(0), nr_of_blocks, block, tp);
+#else
+    (void)tp;
+    parallel_for(uint32_t(0), nr_of_blocks, block);
+#endif
     }
-  else
-    angle = 0.f;
-  return angle;
+
+  }
+
+float canvas::compute_convex_cos_angle(float x1, float y1, float u1, float v1, float depth1, float x2, float y2, float u2, float v2, float depth2)
+  {
+  const float4 dir1 = view_direction(projection_matrix_inv, (2.f * ((x1 + 0.5f) / _canvas->width()) - 1.f), (2.f * ((y1 + 0.5f) / _canvas->height()) - 1.f), _camera.nearClippingPlane);
+  const float4 dir2 = view_direction(projection_matrix_inv, (2.f * ((x2 + 0.5f) / _canvas->width()) - 1.f), (2.f * ((y2 + 0.5f) / _canvas->height()) - 1.f), _camera.nearClippingPlane);
+  return convex_cos_angle(dir1, u1, v1, depth1, dir2, u2, v2, depth2);
   }
 
 namespace
@@ -393,7 +488,7 @@ namespace
 
 void canvas::canvas_to_image(const matcap& _matcap)
   {
-  canvas_to_image(_canvas, _matcap);
+  canvas_to_image(*_canvas, _matcap);
   }
 
 
@@ -446,56 +541,42 @@ uint32_t canvas::_get_color(const pixel* p, const matcap& _matcap) const
   }
 
 
-void canvas::_render_wireframe(const jtk::image<pixel>& canvas, const matcap& _matcap)
+void canvas::_render_wireframe(const g_buffer& canvas, const matcap& _matcap)
   {
   const uint32_t w = im.width();
   const uint32_t h = im.height();
 
-  const pixel* p_up_canvas = canvas.row(0);
+  const simd_kernels& k = get_simd_kernels();
+  const simd_matcap mc = make_simd_matcap(_matcap);
 
-  for (uint32_t y = 0; y < h; ++y)
+  parallel_for_row_blocks(h, [&](uint32_t y0, uint32_t y1)
     {
-    uint32_t* p_im_line = im.row(y);
-    const pixel* p_canvas = canvas.row(y);
-    const pixel* p_right_canvas = p_canvas + 1;
-
-    for (uint32_t x = 0; x < w - 1; ++x)
+    std::vector<uint8_t> flags(w);
+    for (uint32_t y = y0; y < y1; ++y)
       {
-      if (p_canvas->object_id != (uint32_t)(-1))
-        {
+      uint32_t* p_im_line = im.row(y);
+      const uint32_t row = canvas.index(0, y);
 
-        if ((p_right_canvas->object_id != (uint32_t)(-1)) && (p_right_canvas->object_id != p_canvas->object_id))
-          {
-          const float scale = (p_canvas->u*p_canvas->u + p_canvas->v*p_canvas->v)*0.5f;
-          const auto wire_color = make_color((unsigned char)(255 * scale), (unsigned char)(255 * scale), (unsigned char)(255 * scale));
-          *p_im_line = wire_color;
-          }
-        else if ((p_up_canvas->object_id != (uint32_t)(-1)) && (p_up_canvas->object_id != p_canvas->object_id))
-          {
-          const float scale = (p_canvas->u*p_canvas->u + p_canvas->v*p_canvas->v)*0.5f;
-          const auto wire_color = make_color((unsigned char)(255 * scale), (unsigned char)(255 * scale), (unsigned char)(255 * scale));
-          *p_im_line = wire_color;
-          }
-        else
+      k.shade_row(p_im_line, canvas.span(row), w, mc, _settings.shading ? 1 : 0);
+
+      if (w < 2)
+        continue;
+      k.edge_row(flags.data(), canvas.span(row), canvas.span(canvas.index(0, y ? y - 1 : 0)), w - 1, 0.001f);
+      for (uint32_t x = 0; x < w - 1; ++x)
+        {
+        if (flags[x] & (SIMD_EDGE_OBJECT_RIGHT | SIMD_EDGE_OBJECT_UP))
           {
-          *p_im_line = _get_color(p_canvas, _matcap);
+          const float u = canvas.normal_u(row + x);
+          const float v = canvas.normal_v(row + x);
+          const float scale = (u*u + v*v)*0.5f;
+          p_im_line[x] = make_color((unsigned char)(255 * scale), (unsigned char)(255 * scale), (unsigned char)(255 * scale));
           }
-
         }
-      ++p_im_line;
-      ++p_canvas;
-      ++p_up_canvas;
-      ++p_right_canvas;
-      }
-    if (p_canvas->object_id != (uint32_t)(-1))
-      {
-      *p_im_line = _get_color(p_canvas, _matcap);
       }
-    p_up_canvas = canvas.row(y);
-    }
+    }, _tp);
   }
 
-void canvas::_canvas_to_one_bit_image(const jtk::image<pixel>& _combined_canvas, const matcap& _matcap)
+void canvas::_canvas_to_one_bit_image(const g_buffer& _combined_canvas, const matcap& _matcap)
   {
   const uint32_t black = 0xff000000;
   const uint32_t white = 0xffffffff;
@@ -504,46 +585,43 @@ void canvas::_canvas_to_one_bit_image(const jtk::image<pixel>& _combined_canvas,
   const uint32_t h = im.height();
 
   const float threshold = 0.001f;
-  const pixel* p_up_combined_canvas = _combined_canvas.row(0);
 
-  for (uint32_t y = 0; y < h; ++y)
-    {
-    uint32_t* p_im_line = im.row(y);
-    const pixel* p_combined_canvas = _combined_canvas.row(y);
-    const pixel* p_right_combined_canvas = p_combined_canvas + 1;
+  const simd_kernels& k = get_simd_kernels();
 
-    for (uint32_t x = 0; x < w - 1; ++x)
+  parallel_for_row_blocks(h, [&](uint32_t y0, uint32_t y1)
+    {
+    std::vector<uint8_t> flags(w);
+    for (uint32_t y = y0; y < y1; ++y)
       {
-      if (p_combined_canvas->object_id != (uint32_t)(-1))
-        {
-        float angle = 1.f;
-        if ((p_right_combined_canvas->object_id != (uint32_t)(-1)) && ((fabs(p_combined_canvas->u - p_right_combined_canvas->u) > threshold) || (fabs(p_combined_canvas->v - p_right_combined_canvas->v) > threshold)))
-          {
-          float u1 = p_combined_canvas->u;
-          float v1 = p_combined_canvas->v;
-          float u2 = p_right_combined_canvas->u;
-          float v2 = p_right_combined_canvas->v;
+      uint32_t* p_im_line = im.row(y);
+      const uint32_t row = _combined_canvas.index(0, y);
+      const uint32_t up_row = _combined_canvas.index(0, y ? y - 1 : 0);
 
-          float w1 = std::sqrt(1.f - u1 * u1 - v1 * v1);
-          float w2 = std::sqrt(1.f - u2 * u2 - v2 * v2);
+      if (w > 1)
+        k.edge_row(flags.data(), _combined_canvas.span(row), _combined_canvas.span(up_row), w - 1, threshold);
 
-          angle = u1 * u2 + v1 * v2 + w1 * w2;
-          }
-        else if ((p_up_combined_canvas->object_id != (uint32_t)(-1)) && ((fabs(p_combined_canvas->u - p_up_combined_canvas->u) > threshold) || (fabs(p_combined_canvas->v - p_up_combined_canvas->v) > threshold)))
+      for (uint32_t x = 0; x + 1 < w; ++x)
+        {
+        const uint32_t i = row + x;
+        if (_combined_canvas.object_id[i] == (uint32_t)(-1))
+          continue;
+        const float u1 = _combined_canvas.normal_u(i);
+        const float v1 = _combined_canvas.normal_v(i);
+        float angle = 1.f;
+        if (flags[x] & (SIMD_EDGE_NORMAL_RIGHT | SIMD_EDGE_NORMAL_UP))
           {
-          float u1 = p_combined_canvas->u;
-          float v1 = p_combined_canvas->v;
-          float u2 = p_up_combined_canvas->u;
-          float v2 = p_up_combined_canvas->v;
+          const uint32_t other = (flags[x] & SIMD_EDGE_NORMAL_RIGHT) ? i + 1 : up_row + x;
+          float u2 = _combined_canvas.normal_u(other);
+          float v2 = _combined_canvas.normal_v(other);
 
           float w1 = std::sqrt(1.f - u1 * u1 - v1 * v1);
           float w2 = std::sqrt(1.f - u2 * u2 - v2 * v2);
 
           angle = u1 * u2 + v1 * v2 + w1 * w2;
           }
-        int U = get_U(p_combined_canvas->u, _matcap);
-        int V = get_V(p_combined_canvas->v, _matcap);
-        auto clr = get_color(_matcap, U, V, p_combined_canvas->mark);
+        int U = get_U(u1, _matcap);
+        int V = get_V(v1, _matcap);
+        auto clr = get_color(_matcap, U, V, _combined_canvas.mark(i));
         int res = (((clr & 0xff0000) >> 16) + ((clr & 0xff00) >> 8) + (clr & 0xff)) >> 7;
         ++res;
         bool clr_black = (((x % res == 0) && (y % res == 0)));
@@ -554,32 +632,30 @@ void canvas::_canvas_to_one_bit_image(const jtk::image<pixel>& _combined_canvas,
           else
             clr_black = true;
           }
-        *p_im_line = clr_black ? black : white;
+        p_im_line[x] = clr_black ? black : white;
+        }
+      if (w > 0 && _combined_canvas.object_id[row + w - 1] != (uint32_t)(-1))
+        {
+        int U = get_U(_combined_canvas.normal_u(row + w - 1), _matcap);
+        int V = get_V(_combined_canvas.normal_v(row + w - 1), _matcap);
+
+        auto clr = get_color(_matcap, U, V, _combined_canvas.mark(row + w - 1));
+        int res = (((clr & 0xff0000) >> 16) + ((clr & 0xff00) >> 8) + (clr & 0xff)) >> 7;
+        ++res;
+        if ((((w - 1) % res == 0) && (y % res == 0)))
+          p_im_line[w - 1] = black;
+        else
+          p_im_line[w - 1] = white;
         }
-      ++p_im_line;
-      ++p_combined_canvas;
-      ++p_up_combined_canvas;
-      ++p_right_combined_canvas;
-      }
-    if (p_combined_canvas->object_id != (uint32_t)(-1))
-      {
-      int U = get_U(p_combined_canvas->u, _matcap);
-      int V = get_V(p_combined_canvas->v, _matcap);
-
-      auto clr = get_color(_matcap, U, V, p_combined_canvas->mark);
-      int res = (((clr & 0xff0000) >> 16) + ((clr & 0xff00) >> 8) + (clr & 0xff)) >> 7;
-      ++res;
-      if ((((w - 1) % res == 0) && (y % res == 0)))
-        *p_im_line = black;
-      else
-        *p_im_line = white;
       }
-    p_up_combined_canvas = _combined_canvas.row(y);
-    }
+    }, _tp);
   }
 
-
-void canvas::canvas_to_image(const jtk::image<pixel>& _combined_canvas, const matcap& _matcap)
+/*
+The post processing passes run in blocks of rows on _tp. The neighbour tests for the edges, the wireframe and
+the one bit image are done by simd_kernels::edge_row, so the scalar code only runs for the pixels on an edge.
+*/
+void canvas::canvas_to_image(const g_buffer& _combined_canvas, const matcap& _matcap)
   {
   if (_settings.one_bit)
     {
@@ -593,91 +669,196 @@ void canvas::canvas_to_image(const jtk::image<pixel>& _combined_canvas, const ma
     const uint32_t h = im.height();
 
     const float threshold = 0.001f;
-    const pixel* p_up_combined_canvas = _combined_canvas.row(0);
 
-    for (uint32_t y = 0; y < h; ++y)
-      {
-      uint32_t* p_im_line = im.row(y);
-      const pixel* p_combined_canvas = _combined_canvas.row(y);
-      const pixel* p_right_combined_canvas = p_combined_canvas + 1;
+    const simd_kernels& k = get_simd_kernels();
+    const simd_matcap mc = make_simd_matcap(_matcap);
 
-      for (uint32_t x = 0; x < w - 1; ++x)
+    std::vector<float> screen_x, screen_y;
+    make_screen_coordinates(screen_x, screen_y, _canvas->width(), _canvas->height());
+    const float near_clipping_plane = _camera.nearClippingPlane;
+
+    parallel_for_row_blocks(h, [&](uint32_t y0, uint32_t y1)
+      {
+      std::vector<uint8_t> flags(w);
+      for (uint32_t y = y0; y < y1; ++y)
         {
-        if (p_combined_canvas->object_id != (uint32_t)(-1))
-          {
+        uint32_t* p_im_line = im.row(y);
+        const uint32_t row = _combined_canvas.index(0, y);
+        const uint32_t up_row = _combined_canvas.index(0, y ? y - 1 : 0);
 
-          if ((p_right_combined_canvas->object_id != (uint32_t)(-1)) && ((fabs(p_combined_canvas->u - p_right_combined_canvas->u) > threshold) || (fabs(p_combined_canvas->v - p_right_combined_canvas->v) > threshold)))
-            {
-            float u1 = p_combined_canvas->u;
-            float v1 = p_combined_canvas->v;
-            float u2 = p_right_combined_canvas->u;
-            float v2 = p_right_combined_canvas->v;
+        k.shade_row(p_im_line, _combined_canvas.span(row), w, mc, _settings.shading ? 1 : 0);
 
-            float angle = compute_convex_cos_angle((float)x, (float)y, u1, v1, p_combined_canvas->depth, (float)x + 1.f, (float)y, u2, v2, p_right_combined_canvas->depth);
+        if (w < 2)
+          continue;
+        k.edge_row(flags.data(), _combined_canvas.span(row), _combined_canvas.span(up_row), w - 1, threshold);
 
-            auto clr = get_angle_color(angle, _matcap, u1, v1, p_combined_canvas->mark);
-            *p_im_line = clr;
-            }
-          else if ((p_up_combined_canvas->object_id != (uint32_t)(-1)) && ((fabs(p_combined_canvas->u - p_up_combined_canvas->u) > threshold) || (fabs(p_combined_canvas->v - p_up_combined_canvas->v) > threshold)))
+        for (uint32_t x = 0; x < w - 1; ++x)
+          {
+          if (!(flags[x] & (SIMD_EDGE_NORMAL_RIGHT | SIMD_EDGE_NORMAL_UP)))
+            continue;
+          const uint32_t i = row + x;
+          const float u = _combined_canvas.normal_u(i);
+          const float v = _combined_canvas.normal_v(i);
+          const float4 dir = view_direction(projection_matrix_inv, screen_x[x], screen_y[y + 1], near_clipping_plane);
+          float angle;
+          if (flags[x] & SIMD_EDGE_NORMAL_RIGHT)
             {
-            float u1 = p_combined_canvas->u;
-            float v1 = p_combined_canvas->v;
-            float u2 = p_up_combined_canvas->u;
-            float v2 = p_up_combined_canvas->v;
-
-            float angle = compute_convex_cos_angle((float)x, (float)y, u1, v1, p_combined_canvas->depth, (float)x, (float)y - 1.f, u2, v2, p_up_combined_canvas->depth);
-            auto clr = get_angle_color(angle, _matcap, u1, v1, p_combined_canvas->mark);
-            *p_im_line = clr;
+            const uint32_t right = i + 1;
+            const float4 right_dir = view_direction(projection_matrix_inv, screen_x[x + 1], screen_y[y + 1], near_clipping_plane);
+            angle = convex_cos_angle(dir, u, v, _combined_canvas.depth[i], right_dir, _combined_canvas.normal_u(right), _combined_canvas.normal_v(right), _combined_canvas.depth[right]);
             }
           else
             {
-            *p_im_line = _get_color(p_combined_canvas, _matcap);
+            const uint32_t up = up_row + x;
+            const float4 up_dir = view_direction(projection_matrix_inv, screen_x[x], screen_y[y], near_clipping_plane);
+            angle = convex_cos_angle(dir, u, v, _combined_canvas.depth[i], up_dir, _combined_canvas.normal_u(up), _combined_canvas.normal_v(up), _combined_canvas.depth[up]);
             }
-
+          p_im_line[x] = get_angle_color(angle, _matcap, u, v, _combined_canvas.mark(i));
           }
-        ++p_im_line;
-        ++p_combined_canvas;
-        ++p_up_combined_canvas;
-        ++p_right_combined_canvas;
-        }
-      if (p_combined_canvas->object_id != (uint32_t)(-1))
-        {
-        *p_im_line = _get_color(p_combined_canvas, _matcap);
         }
-      p_up_combined_canvas = _combined_canvas.row(y);
-      }
+      }, _tp);
     } // if edges
   else
     {
     const uint32_t w = im.width();
     const uint32_t h = im.height();
 
-    for (uint32_t y = 0; y < h; ++y)
+    const simd_kernels& k = get_simd_kernels();
+    const simd_matcap mc = make_simd_matcap(_matcap);
+
+    parallel_for_row_blocks(h, [&](uint32_t y0, uint32_t y1)
       {
-      uint32_t* p_im_line = im.row(y);
-      const pixel* p_combined_canvas = _combined_canvas.row(y);
-      for (uint32_t x = 0; x < w; ++x)
-        {
-        if (p_combined_canvas->object_id != (uint32_t)(-1))
-          {
-          *p_im_line = _get_color(p_combined_canvas, _matcap);
-          }
-        ++p_im_line;
-        ++p_combined_canvas;
-        }
-      }
+      for (uint32_t y = y0; y < y1; ++y)
+        k.shade_row(im.row(y), _combined_canvas.span(_combined_canvas.index(0, y)), w, mc, _settings.shading ? 1 : 0);
+      }, _tp);
     }
   }
 
 void canvas::update_canvas(int x0, int y0, int x1, int y1, const scene& s)
   {
-  update_canvas(_canvas, x0, y0, x1, y1, s);
+  _visible_pixels.reset();
+  _make_canvas_writable(true);
+  update_canvas(*_canvas, x0, y0, x1, y1, s);
   }
 
-void canvas::update_canvas(jtk::image<pixel>& out, int x0, int y0, int x1, int y1, const scene& s)
+void canvas::update_canvas(g_buffer& out, int x0, int y0, int x1, int y1, const scene& s)
   {
-  const uint32_t w = im.width();
-  const uint32_t h = im.height();
+  _update_clip_planes();
+  _update_canvas(out, x0, y0, x1, y1, s, nullptr);
+  }
+
+namespace
+  {
+
+  // Positive if the point or direction x lies on the clipped side of plane p = (normal, -offset).
+  inline float plane_side(const float4& p, const float4& x)
+    {
+    return p[0] * x[0] + p[1] * x[1] + p[2] * x[2] + p[3] * x[3];
+    }
+
+  /*
+  Shortens [r.t_near, r.t_far] to the part of the ray that is not clipped away. The part that is kept by all planes is convex,
+  so it is a single interval. Returns false if the interval is empty. The bvh traversal then skips every node and rejects
+  every triangle outside the interval, so the clipped parts of a mesh cost nothing.
+  */
+  bool clip_ray(ray& r, const float4* planes, uint32_t nr_of_planes)
+    {
+    for (uint32_t i = 0; i < nr_of_planes; ++i)
+      {
+      const float a = plane_side(planes[i], r.orig);
+      const float b = plane_side(planes[i], r.dir);
+      if (b > 0.f)
+        r.t_far = std::min(r.t_far, -a / b);
+      else if (b < 0.f)
+        r.t_near = std::max(r.t_near, -a / b);
+      else if (a > 0.f)
+        r.t_far = -std::numeric_limits<float>::max();
+      }
+    return r.t_near <= r.t_far;
+    }
+
+  }
+
+void canvas::_update_clip_planes()
+  {
+  _nr_of_clip_planes = 0;
+  for (uint32_t i = 0; i < max_clipping_planes; ++i)
+    {
+    const clipping_plane& p = _settings.clipping_planes[i];
+    if (p.enabled && (p.normal[0] != 0.f || p.normal[1] != 0.f || p.normal[2] != 0.f))
+      _clip_planes[_nr_of_clip_planes++] = float4(p.normal[0], p.normal[1], p.normal[2], -p.offset);
+    }
+  }
+
+/*
+Tests the bounding box of every object against the view frustum in clip space: an object is culled if all 8 corners
+lie outside the same side plane, behind the camera, or on the clipped side of the same clipping plane. The top level bvh over the remaining objects is only rebuilt
+when that set changes, so a still camera or a camera that orbits inside the scene reuses it.
+The view depth range of the remaining boxes bounds the t interval of the camera rays.
+Only the camera rays use the culled bvh: shadow and occlusion rays can hit objects outside the view.
+*/
+const wbvh_two_level_with_transformations* canvas::_cull(const scene& s)
+  {
+  const scene_render_cache& cache = get_render_cache(s);
+  const uint32_t nr_of_objects = (uint32_t)cache.bvhs.size();
+  const float margin = 1.01f; // the camera rays of anti-aliasing are jittered up to half a pixel
+  std::vector<uint32_t> visible;
+  visible.reserve(nr_of_objects);
+  float depth_min = std::numeric_limits<float>::max();
+  float depth_max = 0.f;
+  for (uint32_t i = 0; i < nr_of_objects; ++i)
+    {
+    const vec3<float>& lo = cache.bvhs[i]->min_bb();
+    const vec3<float>& hi = cache.bvhs[i]->max_bb();
+    int outside[5 + max_clipping_planes] = {};
+    float box_depth_min = std::numeric_limits<float>::max();
+    float box_depth_max = -std::numeric_limits<float>::max();
+    for (int c = 0; c < 8; ++c)
+      {
+      float4 corner((c & 1) ? hi[0] : lo[0], (c & 2) ? hi[1] : lo[1], (c & 4) ? hi[2] : lo[2], 1.f);
+      corner = matrix_vector_multiply(cache.object_cs[i], corner);
+      for (uint32_t j = 0; j < _nr_of_clip_planes; ++j)
+        outside[5 + j] += plane_side(_clip_planes[j], corner) > 0.f ? 1 : 0;
+      corner = matrix_vector_multiply(s.coordinate_system_inv, corner);
+      const float depth = -corner[2];
+      box_depth_min = std::min(box_depth_min, depth);
+      box_depth_max = std::max(box_depth_max, depth);
+      const float4 clip = matrix_vector_multiply(projection_matrix, corner);
+      const float w = clip[3] * margin;
+      outside[0] += clip[0] > w ? 1 : 0;
+      outside[1] += clip[0] < -w ? 1 : 0;
+      outside[2] += clip[1] > w ? 1 : 0;
+      outside[3] += clip[1] < -w ? 1 : 0;
+      outside[4] += depth <= 0.f ? 1 : 0;
+      }
+    if (std::find(outside, outside + 5 + _nr_of_clip_planes, 8) != outside + 5 + _nr_of_clip_planes)
+      continue;
+    visible.push_back(i);
+    depth_min = std::min(depth_min, box_depth_min);
+    depth_max = std::max(depth_max, box_depth_max);
+    }
+  _visible_depth_min = std::max(depth_min, 0.f);
+  _visible_depth_max = depth_max;
+
+  if (cache.version != _visible_bvh_version || visible != _visible_objects)
+    {
+    _visible_bvh_version = cache.version;
+    _visible_objects.swap(visible);
+    if (_visible_objects.empty() || _visible_objects.size() == nr_of_objects)
+      _visible_bvh.reset();
+    else
+      _visible_bvh.reset(new wbvh_two_level_with_transformations(cache.bvhs.data(), cache.object_cs.data(), _visible_objects.data(), (uint32_t)_visible_objects.size()));
+    }
+  if (_visible_objects.empty())
+    return nullptr;
+  return _visible_bvh ? _visible_bvh.get() : cache.bvh.get();
+  }
+
+void canvas::_update_canvas(g_buffer& out, int x0, int y0, int x1, int y1, const scene& s, const uint8_t* trace_mask)
+  {
+  // camera rays are generated for the resolution of out, which can be lower than the resolution of the canvas
+  const uint32_t w = out.width();
+  const uint32_t h = out.height();
 
   if (x0 < 0)
     x0 = 0;
@@ -700,331 +881,1432 @@ void canvas::update_canvas(jtk::image<pixel>& out, int x0, int y0, int x1, int y
   float4 origin(0.f, 0.f, 0.f, 1.f);
   origin = matrix_vector_multiply(s.coordinate_system, origin);
 
-  float4 light(s.pivot[0] + s.diagonal*3.f, s.pivot[1] + s.diagonal*3.f, s.pivot[2] + s.diagonal*3.f, 1.f);
-
-  light = matrix_vector_multiply(s.coordinate_system, light);
-
-  std::vector<const qbvh*> bvhs;
-  aligned_vector<float4x4> object_cs;
-  aligned_vector<float4x4> inverted_object_cs;
-  std::vector<const vec3<uint32_t>*> triangles;
-  std::vector<const vec3<float>*> vertices;
-  std::vector<const vec3<float>*> triangle_normals;
-  std::vector<const vec3<float>*> vertex_colors;
-  std::vector<const vec3<vec2<float>>*> uv_coordinates;
-  std::vector<const image<uint32_t>*> textures;
-  std::vector<uint32_t> db_ids;
-  const uint32_t max_submodels = (uint32_t)s.objects.size();
-  bvhs.reserve(max_submodels);
-  object_cs.reserve(max_submodels);
-  inverted_object_cs.reserve(max_submodels);
-  triangles.reserve(max_submodels);
-  vertices.reserve(max_submodels);
-  db_ids.reserve(max_submodels);
-  triangle_normals.reserve(max_submodels);
-  vertex_colors.reserve(max_submodels);
-  uv_coordinates.reserve(max_submodels);
-  textures.reserve(max_submodels);
-  for (const auto& obj : s.objects)
-    {
-    if (!obj.bvh.get())
-      continue;
-    bvhs.push_back(obj.bvh.get());
-    object_cs.push_back(obj.cs);
-    inverted_object_cs.push_back(invert_orthonormal(obj.cs));
-    triangles.push_back(obj.p_triangles->data());
-    vertices.push_back(obj.p_vertices->data());
-    triangle_normals.push_back(obj.triangle_normals.data());
-    vertex_colors.push_back(obj.p_vertex_colors ? obj.p_vertex_colors->data() : nullptr);
-    uv_coordinates.push_back(obj.p_uv_coordinates ? obj.p_uv_coordinates->data() : nullptr);
-    textures.push_back(obj.p_texture);
-    db_ids.push_back(obj.db_id);
-    }
-
-  if (bvhs.empty())
+  const scene_render_cache& cache = get_render_cache(s);
+  const auto& bvhs = cache.bvhs;
+  const auto& object_cs = cache.object_cs;
+  const auto& inverted_object_cs = cache.inverted_object_cs;
+  const auto& triangles = cache.triangles;
+  const auto& vertices = cache.vertices;
+  const auto& triangle_normals = cache.triangle_normals;
+  const auto& vertex_colors = cache.vertex_colors;
+  const auto& uv_coordinates = cache.uv_coordinates;
+  const auto& textures = cache.textures;
+  const auto& db_ids = cache.db_ids;
+
+  const wbvh_two_level_with_transformations* visible_bvh = bvhs.empty() ? nullptr : _cull(s);
+  if (!visible_bvh)
     {
     parallel_for(uint32_t(y0), uint32_t(y1 + 1), [&](uint32_t y)
       {
-      pixel* p_canvas_line = out.row(y) + x0;
       for (int x = x0; x <= x1; ++x)
-        {
-        p_canvas_line->db_id = 0;
-        p_canvas_line->object_id = (uint32_t)-1;
-        p_canvas_line->u = 0.f;
-        p_canvas_line->v = 0.f;
-        p_canvas_line->depth = std::numeric_limits<float>::max();
-        ++p_canvas_line;
-        }
+        out.clear(out.index(x, y));
       });
     return;
     }
 
-  qbvh_two_level_with_transformations bvh(bvhs.data(), object_cs.data(), (uint32_t)bvhs.size());
+  const wbvh_two_level_with_transformations& bvh = *visible_bvh;
 
-#if defined(USE_THREAD_POOL)
-  pooled_parallel_for(uint32_t(y0), uint32_t(y1 + 1), [&](uint32_t y)
-#else
-  parallel_for(uint32_t(y0), uint32_t(y1 + 1), [&](uint32_t y)
-#endif
+  auto make_camera_ray = [&](int x, int y)
     {
-    pixel* p_canvas_line = out.row(y) + x0;
-    for (int x = x0; x <= x1; ++x)
+    float4 screen_pos((2.f * ((x + 0.5f + _jitter_x) / w) - 1.f), (2.f * ((y + 0.5f + _jitter_y) / h) - 1.f), _camera.nearClippingPlane, 1.f);
+    float4 dir = matrix_vector_multiply(projection_matrix_inv, screen_pos);
+    dir[3] = 0.f;
+    // the view depth of the point at t on the ray is t times depth_per_t
+    const float depth_per_t = -dir[2];
+    dir = matrix_vector_multiply(s.coordinate_system, dir);
+
+    ray r;
+    r.orig = origin;
+    r.dir = dir;
+    r.t_near = s.diagonal / 100.f;
+    r.t_far = std::numeric_limits<float>::max();
+    if (depth_per_t > 0.f)
       {
-      float4 screen_pos((2.f * ((x + 0.5f) / w) - 1.f), (2.f * ((y + 0.5f) / h) - 1.f), _camera.nearClippingPlane, 1.f);
-      float4 dir = matrix_vector_multiply(projection_matrix_inv, screen_pos);
-      dir[3] = 0.f;
-      dir = matrix_vector_multiply(s.coordinate_system, dir);
-
-      ray r;
-      r.orig = origin;
-      r.dir = dir;
-      r.t_near = s.diagonal / 100.f;
-      r.t_far = std::numeric_limits<float>::max();
-
+      r.t_near = std::max(r.t_near, _visible_depth_min / depth_per_t * 0.9999f);
+      r.t_far = _visible_depth_max / depth_per_t * 1.0001f;
+      }
+    clip_ray(r, _clip_planes, _nr_of_clip_planes);
+    return r;
+    };
 
-      uint32_t object_id, two_level_index;
-      auto hit = bvh.find_closest_triangle(object_id, two_level_index, r, bvhs.data(), inverted_object_cs.data(), triangles.data(), vertices.data());
+  auto shade_pixel = [&](uint32_t i, ray r, const hit& hit, uint32_t object_id, uint32_t two_level_index)
+    {
+    if (hit.found)
+      {
+      float4 n = float4(triangle_normals[two_level_index][object_id][0], triangle_normals[two_level_index][object_id][1], triangle_normals[two_level_index][object_id][2], 0.f);
+      n = matrix_vector_multiply(s.coordinate_system_inv, n);
+      n = matrix_vector_multiply(object_cs[two_level_index], n);
+      r.t_far = hit.distance;
+      out.set_normal(i, n[0], n[1]);
+      out.depth[i] = hit.distance;
+      out.object_id[i] = object_id;
+      out.set_barycentric(i, hit.u, hit.v);
+      out.db_id[i] = db_ids[two_level_index];
+      out.color[i] = 0;
+
+      if (_settings.textured && uv_coordinates[two_level_index] != nullptr)
+        {
+        const auto& uvcoords = uv_coordinates[two_level_index][object_id];
+        auto coord = (1.f - hit.u - hit.v)*uvcoords[0] + hit.u*uvcoords[1] + hit.v*uvcoords[2];
+        coord[0] = std::max(std::min(coord[0], 1.f), 0.f);
+        coord[1] = std::max(std::min(coord[1], 1.f), 0.f);
+        const int w = textures[two_level_index]->width();
+        const int h = textures[two_level_index]->height();
+        int x = (int)(coord[0] * w);
+        int y = (int)(coord[1] * h);
+        x = x < 0 ? 0 : x >= w ? w-1 : x;
+        y = y < 0 ? 0 : y >= h ? h-1 : y;
+        uint32_t color = (*textures[two_level_index])(x, y);
+        out.color[i] = ((color & 0x00ffffff) << 8) | 2;
+        }
+      else if (_settings.vertexcolors && vertex_colors[two_level_index] != nullptr)
+        {
+        const uint32_t v0 = triangles[two_level_index][object_id][0];
+        const uint32_t v1 = triangles[two_level_index][object_id][1];
+        const uint32_t v2 = triangles[two_level_index][object_id][2];
+        const auto& c0 = vertex_colors[two_level_index][v0];
+        const auto& c1 = vertex_colors[two_level_index][v1];
+        const auto& c2 = vertex_colors[two_level_index][v2];
+        const auto c = c0 * (1.f - hit.u - hit.v) + hit.u*c1 + hit.v*c2;
+        out.color[i] = ((uint32_t)(uint8_t)(c[0] * 255.f) << 8) | ((uint32_t)(uint8_t)(c[1] * 255.f) << 16) | ((uint32_t)(uint8_t)(c[2] * 255.f) << 24) | 2;
+        }
+      }
+    else
+      out.clear(i);
+};
 
-      if (hit.found)
+  auto render_tile = [&](const tile& t)
+    {
+    if (is_cancelled())
+      return;
+#if defined(USE_RAY_PACKETS)
+    // Trace 2x2 blocks of coherent camera rays as one packet.
+    for (int y = t.y0; y <= t.y1; y += 2)
+      {
+      const bool second_row = y + 1 <= t.y1;
+      for (int x = t.x0; x <= t.x1; x += 2)
         {
-        float4 n = float4(triangle_normals[two_level_index][object_id][0], triangle_normals[two_level_index][object_id][1], triangle_normals[two_level_index][object_id][2], 0.f);
-        n = matrix_vector_multiply(s.coordinate_system_inv, n);
-        n = matrix_vector_multiply(object_cs[two_level_index], n);
-        r.t_far = hit.distance;
-        p_canvas_line->u = n[0];
-        p_canvas_line->v = n[1];
-        p_canvas_line->depth = hit.distance;
-        p_canvas_line->object_id = object_id;
-        p_canvas_line->barycentric_u = hit.u;
-        p_canvas_line->barycentric_v = hit.v;
-        p_canvas_line->db_id = db_ids[two_level_index];
-        p_canvas_line->mark = 0;
-
-        if (_settings.textured && uv_coordinates[two_level_index] != nullptr)
+        const bool second_column = x + 1 <= t.x1;
+        int mask = 1 | (second_column ? 2 : 0) | (second_row ? 4 : 0) | (second_row && second_column ? 8 : 0);
+        if (trace_mask)
           {
-          const auto& uvcoords = uv_coordinates[two_level_index][object_id];
-          auto coord = (1.f - hit.u - hit.v)*uvcoords[0] + hit.u*uvcoords[1] + hit.v*uvcoords[2];
-          coord[0] = std::max(std::min(coord[0], 1.f), 0.f);
-          coord[1] = std::max(std::min(coord[1], 1.f), 0.f);
-          const int w = textures[two_level_index]->width();
-          const int h = textures[two_level_index]->height();
-          int x = (int)(coord[0] * w);
-          int y = (int)(coord[1] * h);
-          x = x < 0 ? 0 : x >= w ? w-1 : x;
-          y = y < 0 ? 0 : y >= h ? h-1 : y;
-          uint32_t color = (*textures[two_level_index])(x, y);
-          p_canvas_line->r = color & 0x000000ff;
-          p_canvas_line->g = (color & 0x0000ff00) >> 8;
-          p_canvas_line->b = (color & 0x00ff0000) >> 16;
-          p_canvas_line->mark |= 2;
+          for (int lane = 0; lane < 4; ++lane)
+            {
+            if ((mask & (1 << lane)) && !trace_mask[(y + (lane >> 1)) * w + x + (lane & 1)])
+              mask &= ~(1 << lane);
+            }
+          if (!mask)
+            continue;
           }
-        else if (_settings.vertexcolors && vertex_colors[two_level_index] != nullptr)
+        ray rays[4];
+        for (int lane = 0; lane < 4; ++lane)
           {
-          const uint32_t v0 = triangles[two_level_index][object_id][0];
-          const uint32_t v1 = triangles[two_level_index][object_id][1];
-          const uint32_t v2 = triangles[two_level_index][object_id][2];
-          const auto& c0 = vertex_colors[two_level_index][v0];
-          const auto& c1 = vertex_colors[two_level_index][v1];
-          const auto& c2 = vertex_colors[two_level_index][v2];
-          const auto c = c0 * (1.f - hit.u - hit.v) + hit.u*c1 + hit.v*c2;
-          p_canvas_line->r = (uint8_t)(c[0] * 255.f);
-          p_canvas_line->g = (uint8_t)(c[1] * 255.f);
-          p_canvas_line->b = (uint8_t)(c[2] * 255.f);
-          p_canvas_line->mark |= 2;
-          }       
-
-        if (_settings.shadow)
+          if (mask & (1 << lane))
+            rays[lane] = make_camera_ray(x + (lane & 1), y + (lane >> 1));
+          }
+        wbvh_ray_packet rp;
+        make_ray_packet(rp, rays, mask);
+        wbvh_packet_hit packet_hit;
+        init_packet_hit(packet_hit);
+        bvh.find_closest_triangles(packet_hit, rp, mask, bvhs.data(), inverted_object_cs.data(), triangles.data(), vertices.data());
+        for (int lane = 0; lane < 4; ++lane)
           {
-          const uint32_t v0 = triangles[two_level_index][object_id][0];
-          const uint32_t v1 = triangles[two_level_index][object_id][1];
-          const uint32_t v2 = triangles[two_level_index][object_id][2];
-          float4 V0(vertices[two_level_index][v0][0], vertices[two_level_index][v0][1], vertices[two_level_index][v0][2], 1.f);
-          float4 V1(vertices[two_level_index][v1][0], vertices[two_level_index][v1][1], vertices[two_level_index][v1][2], 1.f);
-          float4 V2(vertices[two_level_index][v2][0], vertices[two_level_index][v2][1], vertices[two_level_index][v2][2], 1.f);
-          V0 = jtk::transform(object_cs[two_level_index], V0);
-          V1 = jtk::transform(object_cs[two_level_index], V1);
-          V2 = jtk::transform(object_cs[two_level_index], V2);
-          const float4 pos = V0 * (1.f - hit.u - hit.v) + hit.u*V1 + hit.v*V2;
-          const float4 light_dir = light - pos;
-
-          r.orig = pos;
-          r.dir = light_dir;
-          r.t_near = 1e-3f;
-          r.t_far = std::numeric_limits<float>::max();
-          auto hit2 = bvh.find_closest_triangle(object_id, two_level_index, r, bvhs.data(), inverted_object_cs.data(), triangles.data(), vertices.data());
-          if (hit2.found)
-            p_canvas_line->mark |= 1;
+          if (!(mask & (1 << lane)))
+            continue;
+          hit lane_hit;
+          lane_hit.found = (packet_hit.found & (1 << lane)) != 0;
+          lane_hit.u = packet_hit.u[lane];
+          lane_hit.v = packet_hit.v[lane];
+          lane_hit.distance = packet_hit.distance[lane];
+          shade_pixel(out.index(x + (lane & 1), y + (lane >> 1)), rays[lane], lane_hit, packet_hit.triangle_id[lane], packet_hit.two_level_index[lane]);
           }
         }
-      else
+      }
+#else
+    for (int y = t.y0; y <= t.y1; ++y)
+      {
+      for (int x = t.x0; x <= t.x1; ++x)
         {
-        p_canvas_line->db_id = 0;
-        p_canvas_line->object_id = (uint32_t)-1;
-        p_canvas_line->u = 0.f;
-        p_canvas_line->v = 0.f;
-        p_canvas_line->depth = std::numeric_limits<float>::max();
+        if (trace_mask && !trace_mask[y * w + x])
+          continue;
+        ray r = make_camera_ray(x, y);
+        uint32_t object_id, two_level_index;
+        auto hit = bvh.find_closest_triangle(object_id, two_level_index, r, bvhs.data(), inverted_object_cs.data(), triangles.data(), vertices.data());
+        shade_pixel(out.index(x, y), r, hit, object_id, two_level_index);
         }
-      ++p_canvas_line;
       }
+#endif
+    };
+
+  _scheduler.make_tiles(x0, y0, x1, y1);
 #if defined(USE_THREAD_POOL)
-    }, _tp);
+  _scheduler.run(render_tile, _tp);
 #else
-    });
+  _scheduler.run(render_tile);
 #endif
+
+  if (_settings.shadow)
+    _update_shadows(out, x0, y0, x1, y1, s, trace_mask);
   }
 
-void canvas::render_scene(jtk::image<pixel>& out, const scene* s)
+namespace
   {
-  if (out.width() != _canvas.width() || out.height() != _canvas.height())
-    out = jtk::image<pixel>(_canvas.width(), _canvas.height());
 
-  if (s)
-    update_canvas(out, 0, 0, width() - 1, height() - 1, *s);
-  else
+  float4 light_position(const scene& s)
     {
-    for (auto& p : out)
-      {
-      p.db_id = 0;
-      p.object_id = (uint32_t)-1;
-      }
+    float4 light(s.pivot[0] + s.diagonal*3.f, s.pivot[1] + s.diagonal*3.f, s.pivot[2] + s.diagonal*3.f, 1.f);
+    return matrix_vector_multiply(s.coordinate_system, light);
     }
-  }
 
-void canvas::render_scene(const scene* s)
-  {
-  copy(im, background);
+  // The world position of the hit in pixel p, recovered from its triangle and barycentric coordinates.
+  float4 hit_position(const scene_render_cache& cache, const g_buffer& out, uint32_t p, uint32_t two_level_index)
+    {
+    const uint32_t object_id = out.object_id[p];
+    const uint32_t v0 = cache.triangles[two_level_index][object_id][0];
+    const uint32_t v1 = cache.triangles[two_level_index][object_id][1];
+    const uint32_t v2 = cache.triangles[two_level_index][object_id][2];
+    const vec3<float>* vertices = cache.vertices[two_level_index];
+    float4 V0(vertices[v0][0], vertices[v0][1], vertices[v0][2], 1.f);
+    float4 V1(vertices[v1][0], vertices[v1][1], vertices[v1][2], 1.f);
+    float4 V2(vertices[v2][0], vertices[v2][1], vertices[v2][2], 1.f);
+    V0 = jtk::transform(cache.object_cs[two_level_index], V0);
+    V1 = jtk::transform(cache.object_cs[two_level_index], V1);
+    V2 = jtk::transform(cache.object_cs[two_level_index], V2);
+    const float bu = out.barycentric_u(p);
+    const float bv = out.barycentric_v(p);
+    return V0 * (1.f - bu - bv) + bu*V1 + bv*V2;
+    }
 
-  render_scene(_canvas, s);
   }
 
-
-void canvas::blit_onto(jtk::image<uint32_t>& screen, int32_t pos_x, int32_t pos_y)
+namespace
   {
-  if (pos_x & 3)
-    throw std::runtime_error("blit_onto: can't use SIMD.");
 
-  uint32_t im_x = 0;
-  uint32_t im_y = 0;
+  const uint32_t shadow_batch_size = 256;
+  const uint32_t shadow_grid_bits = 9;
 
-  if (pos_x < 0)
+  // Puts two zero bits in between the lower shadow_grid_bits bits of x.
+  inline uint64_t spread_bits(uint32_t x)
     {
-    im_x = -pos_x;
-    pos_x = 0;
+    uint64_t r = x & ((1u << shadow_grid_bits) - 1);
+    r = (r | (r << 16)) & 0x030000ff;
+    r = (r | (r << 8)) & 0x0300f00f;
+    r = (r | (r << 4)) & 0x030c30c3;
+    r = (r | (r << 2)) & 0x09249249;
+    return r;
     }
-  if (pos_y < 0)
+
+  /*
+  Sort key of a shadow ray: the octant of its direction in the upper 3 bits, then the morton code of the cell of its origin
+  in a grid over the bounding box of all origins, then the index of the ray in the lower 32 bits.
+  */
+  inline uint64_t shadow_ray_key(const vec3<float>& orig, const float4& light, const vec3<float>& min_bb, const vec3<float>& cell_scale, uint32_t index)
     {
-    im_y = -pos_y;
-    pos_y = 0;
+    const uint64_t octant = (light[0] < orig[0] ? 1 : 0) | (light[1] < orig[1] ? 2 : 0) | (light[2] < orig[2] ? 4 : 0);
+    const float max_cell = (float)((1u << shadow_grid_bits) - 1);
+    uint64_t cell = 0;
+    for (int j = 0; j < 3; ++j)
+      cell |= spread_bits((uint32_t)std::min(std::max((orig[j] - min_bb[j]) * cell_scale[j], 0.f), max_cell)) << j;
+    return (octant << (32 + 3 * shadow_grid_bits)) | (cell << 32) | (uint64_t)index;
     }
 
-  int32_t im_szx = (int32_t)im.width() - (int32_t)im_x;
-  int32_t im_szy = (int32_t)im.height() - (int32_t)im_y;
-
-  if (pos_x + im_szx > (int)screen.width())
-    im_szx = (int32_t)screen.width() - pos_x;
-  if (pos_y + im_szy > (int)screen.height())
-    im_szy = (int32_t)screen.height() - pos_y;
+  }
 
-  if (im_szx < 0)
-    return;
-  if (im_szy < 0)
+/*
+Sets the shadow bit of the pixels in out that hit a triangle, by tracing a ray from the hit point to the light.
+The hit point is recovered from the barycentric coordinates, so this can run on its own when only the shadow
+setting or the light changed.
+The rays are first collected from the G-buffer, then sorted by direction octant and origin cell, and traced in
+batches of neighbouring rays, which keeps the traversal of consecutive rays on the same nodes and triangles.
+*/
+void canvas::_update_shadows(g_buffer& out, int x0, int y0, int x1, int y1, const scene& s, const uint8_t* trace_mask)
+  {
+  const uint32_t w = out.width();
+  const scene_render_cache& cache = get_render_cache(s);
+  if (!cache.bvh)
     return;
+  const float4 light = light_position(s);
 
-  if (im_szx & 3)
-    im_szx += 4 - (im_szx & 3);
+  auto needs_shadow_ray = [&](uint32_t i)
+    {
+    return out.object_id[i] != (uint32_t)-1 && out.db_id[i] < cache.db_id_to_index.size() && cache.db_id_to_index[out.db_id[i]] != (uint32_t)-1;
+    };
+
+  // collect: count the rays per row, then write the hit points at the prefix sum of the counts
+  const uint32_t nr_of_rows = (uint32_t)(y1 - y0 + 1);
+  _shadow_row_offsets.resize(nr_of_rows + 1);
+  parallel_for(uint32_t(0), nr_of_rows, [&](uint32_t i)
+    {
+    const int y = y0 + (int)i;
+    uint32_t count = 0;
+    for (int x = x0; x <= x1; ++x)
+      {
+      if (trace_mask && !trace_mask[y * w + x])
+        continue;
+      const uint32_t p = out.index(x, y);
+      out.color[p] &= ~1u;
+      if (needs_shadow_ray(p))
+        ++count;
+      }
+    _shadow_row_offsets[i + 1] = count;
+    });
+  _shadow_row_offsets[0] = 0;
+  for (uint32_t i = 0; i < nr_of_rows; ++i)
+    _shadow_row_offsets[i + 1] += _shadow_row_offsets[i];
+  const uint32_t nr_of_rays = _shadow_row_offsets[nr_of_rows];
+  if (nr_of_rays == 0)
+    return;
+  _shadow_origins.resize(nr_of_rays);
+  _shadow_pixels.resize(nr_of_rays);
+  _shadow_keys.resize(nr_of_rays);
 
-  const uint32_t sse_sz = im_szx >> 2;
+  parallel_for(uint32_t(0), nr_of_rows, [&](uint32_t i)
+    {
+    const int y = y0 + (int)i;
+    uint32_t index = _shadow_row_offsets[i];
+    for (int x = x0; x <= x1; ++x)
+      {
+      const uint32_t p = out.index(x, y);
+      if ((trace_mask && !trace_mask[y * w + x]) || !needs_shadow_ray(p))
+        continue;
+      const float4 pos = hit_position(cache, out, p, cache.db_id_to_index[out.db_id[p]]);
+      _shadow_origins[index] = vec3<float>(pos[0], pos[1], pos[2]);
+      _shadow_pixels[index] = p;
+      ++index;
+      }
+    });
 
-  for (int y = 0; y < im_szy; ++y)
+  // sort
+  vec3<float> min_bb = _shadow_origins[0];
+  vec3<float> max_bb = _shadow_origins[0];
+  for (const auto& orig : _shadow_origins)
+    {
+    min_bb = min(min_bb, orig);
+    max_bb = max(max_bb, orig);
+    }
+  vec3<float> cell_scale;
+  for (int j = 0; j < 3; ++j)
+    cell_scale[j] = max_bb[j] > min_bb[j] ? (float)(1u << shadow_grid_bits) / (max_bb[j] - min_bb[j]) : 0.f;
+  parallel_for(uint32_t(0), nr_of_rays, [&](uint32_t i)
     {
-    uint32_t* p_screen = screen.row(screen.height() - 1 - (y + pos_y)) + pos_x;
-    uint32_t* p_canvas = im.row(im_y + y) + im_x;
+    _shadow_keys[i] = shadow_ray_key(_shadow_origins[i], light, min_bb, cell_scale, i);
+    });
+  std::sort(_shadow_keys.begin(), _shadow_keys.end());
 
-    for (uint32_t x = 0; x < sse_sz; ++x, p_screen += 4, p_canvas += 4)
+  // trace
+  const uint32_t nr_of_batches = (nr_of_rays + shadow_batch_size - 1) / shadow_batch_size;
+  auto trace_batch = [&](uint32_t batch)
+    {
+    if (is_cancelled())
+      return;
+    const uint32_t first = batch * shadow_batch_size;
+    const uint32_t last = std::min(first + shadow_batch_size, nr_of_rays);
+    for (uint32_t i = first; i < last; ++i)
       {
-      __m128 buf = _mm_load_ps((float*)p_canvas);
-      _mm_store_ps((float*)p_screen, buf);
+      const uint32_t index = (uint32_t)(_shadow_keys[i] & 0xffffffff);
+      const vec3<float>& orig = _shadow_origins[index];
+      ray r;
+      r.orig = float4(orig[0], orig[1], orig[2], 1.f);
+      r.dir = light - r.orig;
+      r.t_near = 1e-3f;
+      r.t_far = std::numeric_limits<float>::max();
+      if (clip_ray(r, _clip_planes, _nr_of_clip_planes) && cache.bvh->is_occluded(r, cache.bvhs.data(), cache.inverted_object_cs.data(), cache.triangles.data(), cache.vertices.data()))
+        out.color[_shadow_pixels[index]] |= 1;
       }
+    };
+#if defined(USE_THREAD_POOL)
+  pooled_parallel_for(uint32_t(0), nr_of_batches, trace_batch, _tp);
+#else
+  parallel_for(uint32_t(0), nr_of_batches, trace_batch);
+#endif
+  }
+
+namespace
+  {
+
+  const uint32_t ambient_occlusion_rays_per_frame = 4;
+  const uint32_t ambient_occlusion_max_samples = 64;
+  const float ambient_occlusion_radius = 0.05f; // relative to the diagonal of the scene
+  const uint32_t ambient_occlusion_batch_size = 256;
+
+  inline uint32_t hash(uint32_t x)
+    {
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+    }
+
+  inline float radical_inverse(uint32_t bits)
+    {
+    bits = (bits << 16) | (bits >> 16);
+    bits = ((bits & 0x55555555u) << 1) | ((bits & 0xaaaaaaaau) >> 1);
+    bits = ((bits & 0x33333333u) << 2) | ((bits & 0xccccccccu) >> 2);
+    bits = ((bits & 0x0f0f0f0fu) << 4) | ((bits & 0xf0f0f0f0u) >> 4);
+    bits = ((bits & 0x00ff00ffu) << 8) | ((bits & 0xff00ff00u) >> 8);
+    return (float)bits * 2.3283064365386963e-10f;
+    }
 
+  /*
+  Sample k of a cosine weighted hemisphere around the unit normal n. The samples of a pixel form a Hammersley set
+  of ambient_occlusion_max_samples points, shifted by the pixel's rotation so that neighbouring pixels use different directions.
+  */
+  inline float4 ambient_occlusion_direction(const vec3<float>& n, uint32_t k, uint32_t rotation)
+    {
+    float u1 = ((float)k + 0.5f) / (float)ambient_occlusion_max_samples + (float)(rotation & 0xffff) / 65536.f;
+    float u2 = radical_inverse(k) + (float)(rotation >> 16) / 65536.f;
+    u1 -= std::floor(u1);
+    u2 -= std::floor(u2);
+    const float r = std::sqrt(u1);
+    const float phi = 6.28318530718f * u2;
+    const float x = r * std::cos(phi);
+    const float y = r * std::sin(phi);
+    const float z = std::sqrt(std::max(1.f - u1, 0.f));
+    // orthonormal basis around n without branches on the direction of n
+    const float sign = n[2] >= 0.f ? 1.f : -1.f;
+    const float a = -1.f / (sign + n[2]);
+    const float b = n[0] * n[1] * a;
+    const vec3<float> t(1.f + sign * n[0] * n[0] * a, sign * b, -sign * n[0]);
+    const vec3<float> bt(b, sign + n[1] * n[1] * a, -n[1]);
+    return float4(x * t[0] + y * bt[0] + z * n[0], x * t[1] + y * bt[1] + z * n[1], x * t[2] + y * bt[2] + z * n[2], 0.f);
     }
+
   }
 
-void canvas::render_pointclouds_on_image(const scene* s, const jtk::image<pixel>& pix)
+bool canvas::_ambient_occlusion_pending() const
   {
-  using namespace jtk;
+  return _settings.ambient_occlusion && _previous_canvas_valid && _ambient_occlusion_samples < ambient_occlusion_max_samples;
+  }
 
-  if (!s->pointclouds.empty())
+bool canvas::needs_refinement() const
+  {
+  return _hits_incomplete() || _ambient_occlusion_pending() || _antialiasing_pending();
+  }
+
+/*
+Traces the next ambient_occlusion_rays_per_frame occlusion rays of every pixel of _canvas that hits a triangle, and adds the
+occluded ones to _ambient_occlusion. The first call after the hits changed restarts the accumulation: it collects the
+hit points and normals from the G-buffer once, so that later frames only pay for the occlusion rays themselves.
+*/
+void canvas::_update_ambient_occlusion(const scene& s)
+  {
+  const scene_render_cache& cache = get_render_cache(s);
+  if (!cache.bvh)
     {
-    if (_zbuffer.width() != pix.width() || _zbuffer.height() != pix.height())
-      _zbuffer = jtk::image<float>(pix.width(), pix.height());
-    int w = (int)pix.width();
-    int h = (int)pix.height();
-    for (int y = 0; y < h; ++y)
+    _ambient_occlusion_samples = ambient_occlusion_max_samples;
+    return;
+    }
+
+  if (_ambient_occlusion_samples == 0)
+    {
+    std::fill(_ambient_occlusion.begin(), _ambient_occlusion.end(), (uint16_t)0);
+    _ambient_occlusion_pixels.clear();
+    const uint32_t size = _canvas->width() * _canvas->height();
+    for (uint32_t p = 0; p < size; ++p)
       {
-      float* p_z = _zbuffer.data() + y * _zbuffer.stride();
-      const pixel* p_pix = pix.data() + y * pix.stride();
-      for (int x = 0; x < w; ++x)
-        {
-        *p_z = (p_pix->db_id != 0) ? 1.f / p_pix->depth : 0.f;
-        ++p_z;
-        ++p_pix;
-        }
+      if (_canvas->object_id[p] != (uint32_t)-1 && _canvas->db_id[p] < cache.db_id_to_index.size() && cache.db_id_to_index[_canvas->db_id[p]] != (uint32_t)-1)
+        _ambient_occlusion_pixels.push_back(p);
       }
-    _fb.h = h;
-    _fb.w = w;
-    _fb.pixels = im.data(); // todo: check stride an alignment
-    _fb.zbuffer = _zbuffer.data();
-    bind(_rd, _fb);
-    float camera_position[16], object_system[16], projection_mat[16];
-    for (int i = 0; i < 16; ++i)
+    const uint32_t nr_of_pixels = (uint32_t)_ambient_occlusion_pixels.size();
+    _ambient_occlusion_origins.resize(nr_of_pixels);
+    _ambient_occlusion_normals.resize(nr_of_pixels);
+    const float4 eye = matrix_vector_multiply(s.coordinate_system, float4(0.f, 0.f, 0.f, 1.f));
+    parallel_for(uint32_t(0), nr_of_pixels, [&](uint32_t i)
       {
-      projection_mat[i] = projection_matrix[i];
-      camera_position[i] = s->coordinate_system_inv[i];
-      }
-    for (const auto& pc : s->pointclouds)
+      const uint32_t p = _ambient_occlusion_pixels[i];
+      const uint32_t two_level_index = cache.db_id_to_index[_canvas->db_id[p]];
+      const float4 pos = hit_position(cache, *_canvas, p, two_level_index);
+      const vec3<float>& tn = cache.triangle_normals[two_level_index][_canvas->object_id[p]];
+      float4 n = matrix_vector_multiply(cache.object_cs[two_level_index], float4(tn[0], tn[1], tn[2], 0.f));
+      const float len = std::sqrt(dot(n, n));
+      // the hemisphere is on the side that is seen
+      const float side = dot(n, eye - pos) < 0.f ? -1.f : 1.f;
+      n = n * (len > 0.f ? side / len : side);
+      _ambient_occlusion_origins[i] = vec3<float>(pos[0], pos[1], pos[2]);
+      _ambient_occlusion_normals[i] = vec3<float>(n[0], n[1], n[2]);
+      });
+    }
+
+  const uint32_t first_sample = _ambient_occlusion_samples;
+  const uint32_t last_sample = std::min(first_sample + ambient_occlusion_rays_per_frame, ambient_occlusion_max_samples);
+  const uint32_t nr_of_pixels = (uint32_t)_ambient_occlusion_pixels.size();
+  const float radius = ambient_occlusion_radius * s.diagonal;
+  const uint32_t nr_of_batches = (nr_of_pixels + ambient_occlusion_batch_size - 1) / ambient_occlusion_batch_size;
+  auto trace_batch = [&](uint32_t batch)
+    {
+    if (is_cancelled())
+      return;
+    const uint32_t first = batch * ambient_occlusion_batch_size;
+    const uint32_t last = std::min(first + ambient_occlusion_batch_size, nr_of_pixels);
+    for (uint32_t i = first; i < last; ++i)
       {
-      for (int i = 0; i < 16; ++i)
+      const uint32_t p = _ambient_occlusion_pixels[i];
+      const vec3<float>& orig = _ambient_occlusion_origins[i];
+      const uint32_t rotation = hash(p);
+      ray r;
+      r.orig = float4(orig[0], orig[1], orig[2], 1.f);
+      uint32_t occluded = 0;
+      for (uint32_t k = first_sample; k < last_sample; ++k)
         {
-        object_system[i] = pc.cs[i];
+        r.dir = ambient_occlusion_direction(_ambient_occlusion_normals[i], k, rotation);
+        r.t_near = s.diagonal * 1e-4f;
+        r.t_far = radius;
+        if (clip_ray(r, _clip_planes, _nr_of_clip_planes) && cache.bvh->is_occluded(r, cache.bvhs.data(), cache.inverted_object_cs.data(), cache.triangles.data(), cache.vertices.data()))
+          ++occluded;
         }
-      bind(_rd, camera_position, object_system, projection_mat);
-      object_buffer ob;
-      ob.number_of_vertices = (uint32_t)pc.p_vertices->size();
-      ob.vertices = (const float*)pc.p_vertices->data();
-      ob.normals = _settings.shading ? (const float*)pc.p_normals->data() : nullptr;
-      ob.colors = _settings.one_bit ? nullptr : (const uint32_t*)pc.p_vertex_colors->data();
-      bind(_rd, ob);
-      present(_rd, 0xffffffff, [&](uint32_t vertex_id, const __m128i& index, const __m128i& mask)
-        {
-        if (_mm_extract_epi32(mask, 0) != 0)
-          {
-          const uint32_t idx = _mm_extract_epi32(index, 0);   
-          _canvas[idx].object_id = vertex_id;
-          _canvas[idx].depth = 1.f / _fb.zbuffer[idx];
-          _canvas[idx].db_id = pc.db_id;
-          }
-        if (_mm_extract_epi32(mask, 1) != 0)
-          {
-          const uint32_t idx = _mm_extract_epi32(index, 1);
-          _canvas[idx].object_id = vertex_id+1;
-          _canvas[idx].depth = 1.f / _fb.zbuffer[idx];
-          _canvas[idx].db_id = pc.db_id;
-          }
-        if (_mm_extract_epi32(mask, 2) != 0)
-          {
-          const uint32_t idx = _mm_extract_epi32(index, 2);
-          _canvas[idx].object_id = vertex_id+2;
-          _canvas[idx].depth = 1.f / _fb.zbuffer[idx];
-          _canvas[idx].db_id = pc.db_id;
-          }
-        if (_mm_extract_epi32(mask, 3) != 0)
-          {
-          const uint32_t idx = _mm_extract_epi32(index, 3);
-          _canvas[idx].object_id = vertex_id+3;
-          _canvas[idx].depth = 1.f / _fb.zbuffer[idx];
-          _canvas[idx].db_id = pc.db_id;
-          }
-        });
+      _ambient_occlusion[p] += (uint16_t)occluded;
+      }
+    };
+#if defined(USE_THREAD_POOL)
+  pooled_parallel_for(uint32_t(0), nr_of_batches, trace_batch, _tp);
+#else
+  parallel_for(uint32_t(0), nr_of_batches, trace_batch);
+#endif
+  _ambient_occlusion_samples = last_sample;
+  }
+
+/*
+Darkens the shaded pixels in im by the fraction of their ambient occlusion samples that were occluded. The samples were
+traced from the hits of _canvas, while im was shaded from pixels: where pixels is a jittered sample that hit another object
+than the pixel centre, the occlusion of the centre does not belong to it, and the pixel is left as it is.
+*/
+void canvas::_apply_ambient_occlusion(const g_buffer& pixels)
+  {
+  if (_ambient_occlusion_samples == 0)
+    return;
+  const uint32_t w = im.width();
+  const uint32_t h = im.height();
+  const float scale = 1.f / (float)_ambient_occlusion_samples;
+  parallel_for_row_blocks(h, [&](uint32_t y0, uint32_t y1)
+    {
+    for (uint32_t y = y0; y < y1; ++y)
+      {
+      uint32_t* p_im_line = im.row(y);
+      const uint32_t i0 = _canvas->index(0, y);
+      const uint16_t* occlusion = _ambient_occlusion.data() + i0;
+      for (uint32_t x = 0; x < w; ++x)
+        {
+        if (!occlusion[x])
+          continue;
+        if (&pixels != _canvas.get() && (pixels.db_id[i0 + x] != _canvas->db_id[i0 + x] || pixels.object_id[i0 + x] != _canvas->object_id[i0 + x]))
+          continue;
+        const float visibility = 1.f - (float)occlusion[x] * scale;
+        const uint32_t clr = p_im_line[x];
+        const uint32_t r = (uint32_t)((clr & 0xff) * visibility);
+        const uint32_t g = (uint32_t)(((clr >> 8) & 0xff) * visibility);
+        const uint32_t b = (uint32_t)(((clr >> 16) & 0xff) * visibility);
+        p_im_line[x] = (clr & 0xff000000) | (b << 16) | (g << 8) | r;
+        }
+      }
+    }, _tp);
+  }
+
+namespace
+  {
+
+  const uint32_t antialiasing_max_samples = 256; // the sums of 8-bit channels must fit in 16 bits
+
+  inline float halton(uint32_t index, uint32_t base)
+    {
+    float f = 1.f;
+    float r = 0.f;
+    while (index > 0)
+      {
+      f /= (float)base;
+      r += f * (float)(index % base);
+      index /= base;
+      }
+    return r;
+    }
+
+  }
+
+bool canvas::_antialiasing_pending() const
+  {
+  // the jittered rays only sample meshes, point clouds would be splatted again for the same image
+  if (!_previous_canvas_valid || _settings.one_bit || !_has_meshes)
+    return false;
+  const uint32_t max_samples = std::min(_settings.antialiasing_samples, antialiasing_max_samples);
+  return _antialiasing_samples < max_samples;
+  }
+
+/*
+Adds one sample per pixel to im. The camera rays go through a jittered position in the pixel, following the (2, 3) Halton
+sequence, are traced into _antialiasing_canvas and shaded like the G-buffer, and the resulting image is averaged with the
+earlier samples. The first call after the shading stage starts the sums from the image of the pixel centres.
+The G-buffer itself, which picking and the point clouds use, keeps the rays through the pixel centres.
+*/
+void canvas::_accumulate_antialiasing(const scene& s, const matcap& _matcap)
+  {
+  const uint32_t w = im.width();
+  const uint32_t h = im.height();
+  if (_antialiasing_canvas.width() != w || _antialiasing_canvas.height() != h)
+    _antialiasing_canvas = g_buffer(w, h);
+  _antialiasing_sum.resize((size_t)w * h * 4);
+
+  auto shade = [&](const g_buffer& pixels)
+    {
+    copy(im, background);
+    canvas_to_image(pixels, _matcap);
+    if (_settings.ambient_occlusion)
+      _apply_ambient_occlusion(pixels);
+    };
+
+  if (_antialiasing_samples == 1)
+    {
+    // im went to the last frame, so start from the pixel centres as they were shaded
+    if (_mesh_im_valid)
+      copy(im, _mesh_im);
+    else
+      shade(*_canvas);
+    parallel_for(uint32_t(0), h, [&](uint32_t y)
+      {
+      const uint8_t* p_im_line = (const uint8_t*)im.row(y);
+      uint16_t* p_sum = _antialiasing_sum.data() + (size_t)y * w * 4;
+      for (uint32_t x = 0; x < w * 4; ++x)
+        p_sum[x] = p_im_line[x];
+      });
+    }
+
+  _jitter_x = halton(_antialiasing_samples, 2) - 0.5f;
+  _jitter_y = halton(_antialiasing_samples, 3) - 0.5f;
+  _update_canvas(_antialiasing_canvas, 0, 0, (int)w - 1, (int)h - 1, s, nullptr);
+  _jitter_x = 0.f;
+  _jitter_y = 0.f;
+  if (is_cancelled())
+    return;
+  shade(_antialiasing_canvas);
+  ++_antialiasing_samples;
+
+  const uint32_t n = _antialiasing_samples;
+  parallel_for(uint32_t(0), h, [&](uint32_t y)
+    {
+    uint8_t* p_im_line = (uint8_t*)im.row(y);
+    uint16_t* p_sum = _antialiasing_sum.data() + (size_t)y * w * 4;
+    for (uint32_t x = 0; x < w * 4; ++x)
+      {
+      p_sum[x] = (uint16_t)(p_sum[x] + p_im_line[x]);
+      p_im_line[x] = (uint8_t)((p_sum[x] + n / 2) / n);
+      }
+    });
+  }
+
+void canvas::render_scene(g_buffer& out, const scene* s)
+  {
+  if (out.width() != _canvas->width() || out.height() != _canvas->height())
+    out = g_buffer(_canvas->width(), _canvas->height());
+
+  if (s)
+    update_canvas(out, 0, 0, width() - 1, height() - 1, *s);
+  else
+    {
+    const uint32_t size = out.width() * out.height();
+    for (uint32_t i = 0; i < size; ++i)
+      out.clear(i);
+    }
+  }
+
+namespace
+  {
+
+  // The settings that change the contents of the G-buffer
+  bool equal_clipping_planes(const canvas::canvas_settings& left, const canvas::canvas_settings& right)
+    {
+    for (uint32_t i = 0; i < max_clipping_planes; ++i)
+      {
+      const clipping_plane& l = left.clipping_planes[i];
+      const clipping_plane& r = right.clipping_planes[i];
+      if (l.enabled != r.enabled)
+        return false;
+      if (l.enabled && (l.normal[0] != r.normal[0] || l.normal[1] != r.normal[1] || l.normal[2] != r.normal[2] || l.offset != r.offset))
+        return false;
+      }
+    return true;
+    }
+
+  bool equal_settings(const canvas::canvas_settings& left, const canvas::canvas_settings& right)
+    {
+    return left.shadow == right.shadow && left.textured == right.textured && left.vertexcolors == right.vertexcolors &&
+      left.reprojection == right.reprojection && equal_clipping_planes(left, right);
+    }
+
+  // The settings that change how the G-buffer is turned into an image
+  bool equal_shading_settings(const canvas::canvas_settings& left, const canvas::canvas_settings& right)
+    {
+    return left.one_bit == right.one_bit && left.edges == right.edges && left.wireframe == right.wireframe && left.shading == right.shading;
+    }
+
+  // The settings that change how the point clouds are splatted onto the image
+  bool equal_pointcloud_settings(const canvas::canvas_settings& left, const canvas::canvas_settings& right)
+    {
+    return left.point_budget == right.point_budget && left.eye_dome_lighting == right.eye_dome_lighting &&
+      left.eye_dome_lighting_strength == right.eye_dome_lighting_strength;
+    }
+
+  void atomic_min(std::atomic<uint64_t>& a, uint64_t value)
+    {
+    uint64_t current = a.load(std::memory_order_relaxed);
+    while (value < current && !a.compare_exchange_weak(current, value, std::memory_order_relaxed))
+      {
+      }
+    }
+
+  }
+
+bool canvas::_can_reproject(const scene& s)
+  {
+  if (!_settings.reprojection || !_previous_canvas_valid)
+    return false;
+  if (!equal_settings(_settings, _previous_settings))
+    return false;
+  return get_render_cache(s).version == _previous_scene_version;
+  }
+
+/*
+Forward warps the last frame into the current camera. Every traced pixel of the last frame is turned into a world position
+with its depth, and projected into the new view. When several pixels land on the same target, the closest one wins.
+Target pixels that receive nothing (disocclusions, cracks, background) are traced again, and so is a rolling 1 out of 16
+pixels, so that errors of the warp (e.g. stale shadows) never survive more than 16 frames.
+*/
+void canvas::_reproject(const scene& s)
+  {
+  const uint32_t w = _canvas->width();
+  const uint32_t h = _canvas->height();
+  const uint64_t empty = std::numeric_limits<uint64_t>::max();
+  const scene_render_cache& cache = get_render_cache(s);
+
+  const std::vector<uint32_t>& db_id_to_index = cache.db_id_to_index;
+
+  const float4 previous_origin = matrix_vector_multiply(_previous_coordinate_system, float4(0.f, 0.f, 0.f, 1.f));
+  const float4x4 world_to_clip = matrix_matrix_multiply(projection_matrix, s.coordinate_system_inv);
+  std::atomic<uint64_t>* keys = _reprojection_keys.get();
+
+  parallel_for(uint32_t(0), h, [&](uint32_t y)
+    {
+    for (uint32_t x = 0; x < w; ++x)
+      keys[y * w + x].store(empty, std::memory_order_relaxed);
+    });
+
+  parallel_for(uint32_t(0), h, [&](uint32_t y)
+    {
+    for (uint32_t x = 0; x < w; ++x)
+      {
+      const uint32_t p = _previous_canvas->index(x, y);
+      if (!_previous_canvas->db_id[p])
+        continue;
+      float4 screen_pos((2.f * ((x + 0.5f) / w) - 1.f), (2.f * ((y + 0.5f) / h) - 1.f), _camera.nearClippingPlane, 1.f);
+      float4 dir = matrix_vector_multiply(projection_matrix_inv, screen_pos);
+      dir[3] = 0.f;
+      dir = matrix_vector_multiply(_previous_coordinate_system, dir);
+      const float4 world = previous_origin + _previous_canvas->depth[p] * dir;
+      const float4 clip = matrix_vector_multiply(world_to_clip, world);
+      if (clip[3] <= 0.f)
+        continue;
+      const float tx = (clip[0] / clip[3] + 1.f) * 0.5f * w - 0.5f;
+      const float ty = (clip[1] / clip[3] + 1.f) * 0.5f * h - 0.5f;
+      if (!(tx > -0.5f && ty > -0.5f && tx < w - 0.5f && ty < h - 0.5f))
+        continue;
+      const uint32_t X = (uint32_t)(tx + 0.5f);
+      const uint32_t Y = (uint32_t)(ty + 0.5f);
+      if (X >= w || Y >= h)
+        continue;
+      // the depth of the canvas is the ray parameter along the (unnormalized) camera ray of the target pixel
+      float4 target_pos((2.f * ((X + 0.5f) / w) - 1.f), (2.f * ((Y + 0.5f) / h) - 1.f), _camera.nearClippingPlane, 1.f);
+      const float4 target_dir = matrix_vector_multiply(projection_matrix_inv, target_pos);
+      const float4 cam = matrix_vector_multiply(s.coordinate_system_inv, world);
+      const float depth = cam[2] / target_dir[2];
+      if (!(depth > 0.f))
+        continue;
+      uint32_t depth_bits;
+      memcpy(&depth_bits, &depth, sizeof(float));
+      atomic_min(keys[Y * w + X], ((uint64_t)depth_bits << 32) | (uint64_t)(y * w + x));
+      }
+    });
+
+  const uint32_t rolling = _reprojection_frame & 15;
+  std::atomic<uint32_t> nr_of_traced_pixels(0);
+  parallel_for(uint32_t(0), h, [&](uint32_t y)
+    {
+    uint32_t traced = 0;
+    uint8_t* mask = _trace_mask.data() + y * w;
+    for (uint32_t x = 0; x < w; ++x)
+      {
+      const uint32_t q = _canvas->index(x, y);
+      const uint64_t key = keys[y * w + x].load(std::memory_order_relaxed);
+      const uint32_t source = (uint32_t)(key & 0xffffffff);
+      uint32_t index = (uint32_t)-1;
+      if (key != empty && _previous_canvas->db_id[source] < db_id_to_index.size())
+        index = db_id_to_index[_previous_canvas->db_id[source]];
+      if (index == (uint32_t)-1 || ((x & 3) | ((y & 3) << 2)) == rolling)
+        {
+        mask[x] = 1;
+        ++traced;
+        continue;
+        }
+      mask[x] = 0;
+      _canvas->copy(q, *_previous_canvas, source);
+      const uint32_t depth_bits = (uint32_t)(key >> 32);
+      memcpy(&_canvas->depth[q], &depth_bits, sizeof(float));
+      const uint32_t object_id = _canvas->object_id[q];
+      float4 n = float4(cache.triangle_normals[index][object_id][0], cache.triangle_normals[index][object_id][1], cache.triangle_normals[index][object_id][2], 0.f);
+      n = matrix_vector_multiply(s.coordinate_system_inv, n);
+      n = matrix_vector_multiply(cache.object_cs[index], n);
+      _canvas->set_normal(q, n[0], n[1]);
+      }
+    nr_of_traced_pixels += traced;
+    });
+  _nr_of_traced_pixels = nr_of_traced_pixels;
+
+  _update_canvas(*_canvas, 0, 0, w - 1, h - 1, s, _trace_mask.data());
+  ++_reprojection_frame;
+  }
+
+namespace
+  {
+
+  // Order in which the pixels of a 4x4 block are traced by the progressive renderer. The first index gives 1/16 density,
+  // the first four indices form a regular 2x2 grid and thus give 1/4 density.
+  const uint32_t progressive_order[4][4] =
+    {
+      { 0, 8, 2, 10 },
+      { 12, 4, 14, 6 },
+      { 3, 11, 1, 9 },
+      { 15, 7, 13, 5 }
+    };
+
+  }
+
+bool canvas::_progressive_active() const
+  {
+  return _settings.progressive && _last_full_trace_time_in_s * 1000.0 > (double)_settings.progressive_threshold_in_ms;
+  }
+
+bool canvas::_can_refine(const scene& s)
+  {
+  if (!_previous_canvas_valid || _refinement_step >= 16)
+    return false;
+  if (!equal_settings(_settings, _previous_settings))
+    return false;
+  if (memcmp(&s.coordinate_system, &_previous_coordinate_system, sizeof(float4x4)) != 0)
+    return false;
+  return get_render_cache(s).version == _previous_scene_version;
+  }
+
+/*
+Traces the pixels with progressive_order in [first_step, last_step]. If _fill_untraced is set, the pixels
+that are not traced yet get a copy of the closest traced pixel of their 2x2 or 4x4 block, so that the
+canvas is complete at every step.
+*/
+void canvas::_trace_progressive(const scene& s, uint32_t first_step, uint32_t last_step)
+  {
+  const uint32_t w = _canvas->width();
+  const uint32_t h = _canvas->height();
+  parallel_for(uint32_t(0), h, [&](uint32_t y)
+    {
+    uint8_t* mask = _trace_mask.data() + y * w;
+    for (uint32_t x = 0; x < w; ++x)
+      {
+      const uint32_t step = progressive_order[y & 3][x & 3];
+      mask[x] = (step >= first_step && step <= last_step) ? 1 : 0;
+      }
+    });
+  _update_canvas(*_canvas, 0, 0, w - 1, h - 1, s, _trace_mask.data());
+  _nr_of_traced_pixels = (uint32_t)(((uint64_t)w * h * (last_step - first_step + 1)) / 16);
+
+  if (_fill_untraced && last_step < 15)
+    {
+    const uint32_t parent_mask = last_step >= 3 ? ~1u : ~3u;
+    parallel_for(uint32_t(0), h, [&](uint32_t y)
+      {
+      for (uint32_t x = 0; x < w; ++x)
+        {
+        if (progressive_order[y & 3][x & 3] > last_step)
+          _canvas->copy(_canvas->index(x, y), *_canvas, _canvas->index(x & parent_mask, y & parent_mask));
+        }
+      });
+    }
+  _refinement_step = last_step + 1;
+  }
+
+/*
+Upscales the G-buffer in _low_res_canvas to the full canvas. Every canvas pixel copies its nearest low resolution sample,
+and averages the normal and depth over those of its 4 bilinear neighbours that belong to the same object at a similar depth.
+This keeps silhouettes and depth discontinuities sharp, while smooth surfaces get smooth shading.
+*/
+void canvas::_upscale(const g_buffer& low_res)
+  {
+  const uint32_t w = _canvas->width();
+  const uint32_t h = _canvas->height();
+  const uint32_t lw = low_res.width();
+  const uint32_t lh = low_res.height();
+  const float sx = (float)lw / (float)w;
+  const float sy = (float)lh / (float)h;
+  parallel_for(uint32_t(0), h, [&](uint32_t y)
+    {
+    const float fy = std::min(std::max((y + 0.5f) * sy - 0.5f, 0.f), (float)(lh - 1));
+    const uint32_t y0 = (uint32_t)fy;
+    const uint32_t y1 = std::min(y0 + 1, lh - 1);
+    const float wy = fy - (float)y0;
+    for (uint32_t x = 0; x < w; ++x)
+      {
+      const uint32_t p = _canvas->index(x, y);
+      const float fx = std::min(std::max((x + 0.5f) * sx - 0.5f, 0.f), (float)(lw - 1));
+      const uint32_t x0 = (uint32_t)fx;
+      const uint32_t x1 = std::min(x0 + 1, lw - 1);
+      const float wx = fx - (float)x0;
+      const uint32_t samples[4] = { low_res.index(x0, y0), low_res.index(x1, y0), low_res.index(x0, y1), low_res.index(x1, y1) };
+      const float weights[4] = { (1.f - wx) * (1.f - wy), wx * (1.f - wy), (1.f - wx) * wy, wx * wy };
+      int nearest = 0;
+      for (int i = 1; i < 4; ++i)
+        {
+        if (weights[i] > weights[nearest])
+          nearest = i;
+        }
+      const uint32_t ref = samples[nearest];
+      _canvas->copy(p, low_res, ref);
+      if (low_res.object_id[ref] == (uint32_t)-1)
+        continue;
+      const float ref_depth = low_res.depth[ref];
+      float sum_w = 0.f, u = 0.f, v = 0.f, depth = 0.f;
+      for (int i = 0; i < 4; ++i)
+        {
+        const uint32_t q = samples[i];
+        if (low_res.object_id[q] == (uint32_t)-1 || low_res.db_id[q] != low_res.db_id[ref] || std::abs(low_res.depth[q] - ref_depth) > ref_depth * 0.02f)
+          continue;
+        sum_w += weights[i];
+        u += weights[i] * low_res.normal_u(q);
+        v += weights[i] * low_res.normal_v(q);
+        depth += weights[i] * low_res.depth[q];
+        }
+      if (sum_w > 0.f)
+        {
+        _canvas->set_normal(p, u / sum_w, v / sum_w);
+        _canvas->depth[p] = depth / sum_w;
+        }
+      }
+    });
+  }
+
+void canvas::set_last_frame_time(double time_in_s)
+  {
+  if (!_last_frame_traced || !_settings.dynamic_resolution || time_in_s <= 0.0)
+    return;
+  // the cost of a frame is roughly proportional to the number of traced pixels, so scale the area with budget / time
+  double ratio = (double)_settings.frame_budget_in_ms / (time_in_s * 1000.0);
+  ratio = std::min(std::max(ratio, 0.5), 2.0);
+  double area = (double)_resolution_scale * (double)_resolution_scale * ratio;
+  area = std::min(std::max(area, 1.0 / 16.0), 1.0);
+  _resolution_scale = (float)std::sqrt(area);
+  }
+
+void canvas::render_scene(const scene* s)
+  {
+  _reprojected = false;
+  _upscaled = false;
+  _last_frame_traced = false;
+  if (s && _camera_moved && _settings.dynamic_resolution && _resolution_scale < 0.95f)
+    {
+    const uint32_t lw = std::max<uint32_t>(1, (uint32_t)(width() * _resolution_scale));
+    const uint32_t lh = std::max<uint32_t>(1, (uint32_t)(height() * _resolution_scale));
+    if (_low_res_canvas.width() != lw || _low_res_canvas.height() != lh)
+      _low_res_canvas = g_buffer(lw, lh);
+    _update_canvas(_low_res_canvas, 0, 0, (int)lw - 1, (int)lh - 1, *s, nullptr);
+    _make_canvas_writable(false);
+    _upscale(_low_res_canvas);
+    _nr_of_traced_pixels = lw * lh;
+    _upscaled = true;
+    _refinement_step = _progressive_active() ? 0 : 16;
+    _fill_untraced = false;
+    }
+  else if (s && _camera_moved && _can_reproject(*s))
+    {
+    std::swap(_canvas, _previous_canvas);
+    _make_canvas_writable(false);
+    _reproject(*s);
+    _reprojected = true;
+    // the warped frame is refined by the progressive steps when idle, or replaced by a full frame otherwise
+    _refinement_step = _progressive_active() ? 0 : 16;
+    _fill_untraced = false;
+    }
+  else if (s && _camera_moved && _progressive_active())
+    {
+    _fill_untraced = true;
+    _make_canvas_writable(false);
+    _trace_progressive(*s, 0, _settings.progressive_density >= 16 ? 0 : 3);
+    }
+  else if (s && !_camera_moved && _can_refine(*s))
+    {
+    // the refinement steps add pixels to the hits of the frame on screen
+    _make_canvas_writable(true);
+    _trace_progressive(*s, _refinement_step, _refinement_step);
+    }
+  else
+    {
+    jtk::timer t;
+    t.start();
+    _make_canvas_writable(false);
+    render_scene(*_canvas, s);
+    _nr_of_traced_pixels = s ? width() * height() : 0;
+    _refinement_step = 16;
+    if (s && !is_cancelled())
+      _last_full_trace_time_in_s = t.time_elapsed();
+    }
+  _last_frame_traced = _upscaled || (_nr_of_traced_pixels == width() * height());
+
+  _camera_moved = false;
+  _previous_canvas_valid = s != nullptr;
+  if (s)
+    {
+    _previous_coordinate_system = s->coordinate_system;
+    _previous_scene_version = get_render_cache(*s).version;
+    }
+  _previous_settings = _settings;
+  }
+
+bool canvas::_hits_dirty(const scene* s)
+  {
+  if (!s || (_dirty_stages & RENDER_STAGE_HITS) || _camera_moved || _hits_incomplete() || !_previous_canvas_valid)
+    return true;
+  if (_settings.textured != _previous_settings.textured || _settings.vertexcolors != _previous_settings.vertexcolors)
+    return true;
+  if (!equal_clipping_planes(_settings, _previous_settings))
+    return true;
+  if (memcmp(&s->coordinate_system, &_previous_coordinate_system, sizeof(float4x4)) != 0)
+    return true;
+  return get_render_cache(*s).version != _previous_scene_version;
+  }
+
+void canvas::_abort_frame()
+  {
+  // the G-buffer is partly traced, so nothing may be reused from it
+  _dirty_stages = RENDER_STAGE_ALL;
+  _previous_canvas_valid = false;
+  _reprojected = false;
+  _upscaled = false;
+  _refinement_step = 16;
+  _last_frame_traced = false;
+  }
+
+/*
+Hands im and the G-buffer of the frame to the ui thread without copying them. im is swapped with the image of the back
+frame, so that the image of an older frame comes back to be rendered into: every frame that is published has rewritten
+all of im. The G-buffer is shared, see _make_canvas_writable.
+*/
+void canvas::_publish_frame(const scene* s)
+  {
+  canvas_frame& f = _frames.back();
+  std::swap(f.im, im);
+  if (im.width() != f.im.width() || im.height() != f.im.height())
+    im = jtk::image<uint32_t>(f.im.width(), f.im.height());
+  // without point clouds the frame shows the ray traced hits themselves
+  if (!_visible_pixels)
+    _visible_pixels = _canvas;
+  f.pixels = _visible_pixels;
+  f.coordinate_system = s ? s->coordinate_system : get_identity();
+  f.nr_of_traced_pixels = _nr_of_traced_pixels;
+  f.nr_of_splatted_points = _nr_of_splatted_points;
+  f.resolution_scale = _resolution_scale;
+  f.tiles = _scheduler.statistics();
+  _frames.publish();
+  }
+
+std::shared_ptr<g_buffer> canvas::_free_g_buffer()
+  {
+  for (const auto& b : _g_buffers)
+    {
+    if (b.use_count() == 1)
+      return b;
+    }
+  _g_buffers.push_back(std::make_shared<g_buffer>(im.width(), im.height()));
+  return _g_buffers.back();
+  }
+
+/*
+The published frames share their G-buffer with the renderer, and the ui thread reads it for picking, so the renderer
+does not write a G-buffer that a frame still holds. All G-buffers live in _g_buffers, and one that is held by _g_buffers
+and _canvas only is not shared. Otherwise _canvas moves to a free G-buffer, which the passes that overwrite every pixel,
+i.e. all the passes that run while the camera moves, take as it is. Only the passes that update _canvas in place after
+the camera stopped, the progressive refinement steps and the shadows of a moved light, copy the hits first.
+*/
+void canvas::_make_canvas_writable(bool keep_contents)
+  {
+  if (_canvas.use_count() <= 2)
+    return;
+  std::shared_ptr<g_buffer> b = _free_g_buffer();
+  if (keep_contents)
+    *b = *_canvas;
+  _canvas = b;
+  }
+
+uint32_t canvas::render(const scene* s, const matcap& _matcap)
+  {
+  uint32_t stages = _dirty_stages;
+  _last_frame_traced = false;
+  _update_clip_planes();
+  if (s && memcmp(&s->coordinate_system, &_previous_coordinate_system, sizeof(float4x4)) != 0)
+    _camera_moved = true;
+  const bool camera_moved = _camera_moved; // render_scene resets _camera_moved
+  _has_meshes = s && get_render_cache(*s).bvh != nullptr;
+  if (_hits_dirty(s))
+    stages |= RENDER_STAGE_HITS;
+  else if (_settings.shadow != _rendered_settings.shadow)
+    stages |= RENDER_STAGE_SHADOW;
+  else if (_settings.shadow)
+    {
+    const float4 light = light_position(*s);
+    if (light[0] != _rendered_light[0] || light[1] != _rendered_light[1] || light[2] != _rendered_light[2])
+      stages |= RENDER_STAGE_SHADOW;
+    }
+  if (_settings.ambient_occlusion != _rendered_settings.ambient_occlusion || _ambient_occlusion_pending())
+    stages |= RENDER_STAGE_AMBIENT_OCCLUSION;
+  if (!equal_shading_settings(_settings, _rendered_settings) || _matcap.im.data() != _rendered_matcap_pixels ||
+    _matcap.type != _rendered_matcap_type || _matcap.filename != _rendered_matcap_file)
+    stages |= RENDER_STAGE_SHADING;
+  const bool pointclouds_changed = s && s->pointclouds_version != _rendered_pointclouds_version;
+  if (pointclouds_changed || (s && !equal_pointcloud_settings(_settings, _rendered_settings)))
+    stages |= RENDER_STAGE_POINTCLOUDS;
+
+  // every later stage depends on the earlier ones: the shading overwrites im, so point clouds need to be splatted again,
+  // whereas the point clouds alone start again from the shaded image in _mesh_im
+  if (stages & RENDER_STAGE_HITS)
+    stages |= RENDER_STAGE_AMBIENT_OCCLUSION;
+  if (stages & (RENDER_STAGE_HITS | RENDER_STAGE_SHADOW | RENDER_STAGE_AMBIENT_OCCLUSION))
+    stages |= RENDER_STAGE_SHADING;
+  if ((stages & RENDER_STAGE_POINTCLOUDS) && !_mesh_im_valid)
+    stages |= RENDER_STAGE_SHADING;
+  if (stages & RENDER_STAGE_POINTCLOUDS)
+    stages |= RENDER_STAGE_COMPOSITE;
+  if (stages & RENDER_STAGE_SHADING)
+    stages |= RENDER_STAGE_POINTCLOUDS | RENDER_STAGE_COMPOSITE;
+  // a frame that traces or shades anew, e.g. while the camera moves, stays at one sample per pixel,
+  // and the samples after it get the point layer of its splat on top
+  else if (s && !_hits_incomplete() && !(stages & RENDER_STAGE_AMBIENT_OCCLUSION) && _antialiasing_pending())
+    {
+    stages |= RENDER_STAGE_ANTIALIASING | RENDER_STAGE_COMPOSITE;
+    if (!_point_layer_valid && !s->pointclouds.empty())
+      stages |= RENDER_STAGE_POINTCLOUDS;
+    }
+
+  // the published G-buffer is copied again only if one of the stages that write to it runs
+  if ((stages & (RENDER_STAGE_HITS | RENDER_STAGE_SHADOW)) || ((stages & RENDER_STAGE_POINTCLOUDS) && s && (pointclouds_changed || !s->pointclouds.empty())))
+    _visible_pixels.reset();
+  if (stages & RENDER_STAGE_HITS)
+    {
+    render_scene(s);
+    _ambient_occlusion_samples = 0;
+    stages |= RENDER_STAGE_SHADOW;
+    }
+  else if (stages & RENDER_STAGE_SHADOW)
+    {
+    _make_canvas_writable(true);
+    if (_settings.shadow)
+      _update_shadows(*_canvas, 0, 0, (int)width() - 1, (int)height() - 1, *s, nullptr);
+    else
+      {
+      for (auto& c : _canvas->color)
+        c &= ~1u;
+      }
+    }
+  // occlusion rays for hits that the next frame replaces are wasted, so these frames are shaded without ambient occlusion
+  if ((stages & RENDER_STAGE_AMBIENT_OCCLUSION) && _settings.ambient_occlusion && s && !camera_moved && !_hits_incomplete())
+    _update_ambient_occlusion(*s);
+  if (is_cancelled())
+    {
+    _abort_frame();
+    return 0;
+    }
+  if (stages & RENDER_STAGE_SHADING)
+    {
+    copy(im, background);
+    canvas_to_image(*_canvas, _matcap);
+    if (_settings.ambient_occlusion && !_settings.one_bit)
+      _apply_ambient_occlusion(*_canvas);
+    _antialiasing_samples = 1;
+    }
+  if (stages & RENDER_STAGE_ANTIALIASING)
+    {
+    _accumulate_antialiasing(*s, _matcap);
+    }
+  // _mesh_im keeps the mesh image for the frames that only splat the point clouds again, which scenes without point clouds do not need
+  if (stages & (RENDER_STAGE_SHADING | RENDER_STAGE_ANTIALIASING))
+    {
+    _mesh_im_valid = s && !s->pointclouds.empty();
+    if (_mesh_im_valid)
+      copy(_mesh_im, im);
+    }
+  if ((stages & RENDER_STAGE_POINTCLOUDS) && s)
+    {
+    if (!(stages & (RENDER_STAGE_SHADING | RENDER_STAGE_ANTIALIASING)))
+      copy(im, _mesh_im);
+    render_pointclouds_on_image(s, *_canvas);
+    // the z-buffer and the splat inputs stay the same while the antialiasing samples are added, so the splat is kept
+    _point_layer_valid = !s->pointclouds.empty() && !camera_moved && !_hits_incomplete();
+    if (_point_layer_valid)
+      copy(_point_im, im);
+    }
+  else if (stages & RENDER_STAGE_ANTIALIASING)
+    _composite_point_layer();
+  if (is_cancelled())
+    {
+    _abort_frame();
+    return 0;
+    }
+  if (stages & RENDER_STAGE_COMPOSITE)
+    _publish_frame(s);
+
+  _dirty_stages = 0;
+  _rendered_settings = _settings;
+  if (s)
+    {
+    _rendered_light = light_position(*s);
+    _rendered_pointclouds_version = s->pointclouds_version;
+    }
+  _rendered_matcap_pixels = _matcap.im.data();
+  _rendered_matcap_type = _matcap.type;
+  _rendered_matcap_file = _matcap.filename;
+  return stages;
+  }
+
+void canvas::blit_onto(void* pixels, int32_t pitch) const
+  {
+  const jtk::image<uint32_t>& front = _frames.front().im;
+  const simd_kernels& k = get_simd_kernels();
+  const uint32_t h = front.height();
+  const uint32_t w = front.width();
+  for (uint32_t y = 0; y < h; ++y)
+    k.copy_row((uint32_t*)((uint8_t*)pixels + (size_t)y * pitch), front.row(y), w);
+  }
+
+namespace
+  {
+
+  // True if the cube lies outside one side plane of the view frustum, behind the camera, or on the clipped side of one of the planes.
+  bool cube_is_culled(const float4x4& object_to_clip, const vec3<float>& min_bb, float size, const std::vector<float4>& clip_planes)
+    {
+    int outside[5 + max_clipping_planes] = {};
+    const uint32_t nr_of_planes = (uint32_t)clip_planes.size();
+    for (int c = 0; c < 8; ++c)
+      {
+      const float4 corner(min_bb[0] + ((c & 1) ? size : 0.f), min_bb[1] + ((c & 2) ? size : 0.f), min_bb[2] + ((c & 4) ? size : 0.f), 1.f);
+      const float4 clip = matrix_vector_multiply(object_to_clip, corner);
+      outside[0] += clip[0] > clip[3] ? 1 : 0;
+      outside[1] += clip[0] < -clip[3] ? 1 : 0;
+      outside[2] += clip[1] > clip[3] ? 1 : 0;
+      outside[3] += clip[1] < -clip[3] ? 1 : 0;
+      outside[4] += clip[3] <= 0.f ? 1 : 0;
+      for (uint32_t j = 0; j < nr_of_planes; ++j)
+        outside[5 + j] += plane_side(clip_planes[j], corner) > 0.f ? 1 : 0;
       }
+    return std::find(outside, outside + 5 + nr_of_planes, 8) != outside + 5 + nr_of_planes;
     }
+
+  struct point_node_candidate
+    {
+    float projected_size; // size of the cube of the node in pixels
+    uint32_t cloud;
+    uint32_t node;
+
+    bool operator < (const point_node_candidate& other) const { return projected_size < other.projected_size; }
+    };
+
   }
+
+/*
+Chooses the octree nodes of the point clouds to splat, largest on screen first, until the next node would exceed
+the point budget. The children of a node are only considered if the point spacing of the node is more than a pixel
+on screen, so the full detail of a cloud only comes back where the camera is close enough to see it.
+Nodes of streamed clouds whose points are not in memory yet are requested from the stream in the same order,
+and their subtrees are skipped: the coarser nodes above them fill in until the points arrive.
+*/
+void canvas::_select_point_nodes(const scene* s, uint32_t w)
+  {
+  _splat_clouds.clear();
+  _splat_batches.clear();
+  _nr_of_splatted_points = 0;
+  const float4 eye = matrix_vector_multiply(s->coordinate_system, float4(0.f, 0.f, 0.f, 1.f));
+  const float4x4 world_to_clip = matrix_matrix_multiply(projection_matrix, s->coordinate_system_inv);
+  const float pixels_per_unit = projection_matrix[0] * (float)w / 2.f; // at a view depth of 1
+  std::vector<float4x4> object_to_clip;
+  std::vector<float> scale;
+  std::vector<const scene_pointcloud*> clouds;
+  std::vector<const std::vector<pc_octree_node>*> cloud_nodes;
+  std::vector<point_node_candidate> heap;
+  _splat_chunks.clear();
+
+  auto push = [&](uint32_t cloud, uint32_t node)
+    {
+    const pc_octree_node& n = (*cloud_nodes[cloud])[node];
+    if (cube_is_culled(object_to_clip[cloud], n.min_bb, n.size, _splat_clouds[cloud].clip_planes))
+      return;
+    const float half = n.size / 2.f;
+    const float4 center = matrix_vector_multiply(clouds[cloud]->cs, float4(n.min_bb[0] + half, n.min_bb[1] + half, n.min_bb[2] + half, 1.f));
+    const float dx = center[0] - eye[0];
+    const float dy = center[1] - eye[1];
+    const float dz = center[2] - eye[2];
+    const float size = n.size * scale[cloud];
+    const float distance = std::max(std::sqrt(dx * dx + dy * dy + dz * dz) - size * 0.8660254f, size * 1e-3f);
+    point_node_candidate c;
+    c.projected_size = size * pixels_per_unit / distance;
+    c.cloud = cloud;
+    c.node = node;
+    heap.push_back(c);
+    std::push_heap(heap.begin(), heap.end());
+    };
+
+  for (const auto& pc : s->pointclouds)
+    {
+    const std::vector<pc_octree_node>* nodes = pc.stream ? &pc.stream->nodes() : (pc.octree ? &pc.octree->nodes() : nullptr);
+    if (!nodes || nodes->empty())
+      continue;
+    if (pc.stream)
+      pc.stream->begin_frame();
+    splat_cloud cloud;
+    cloud.cs = pc.cs;
+    cloud.db_id = pc.db_id;
+    for (uint32_t j = 0; j < _nr_of_clip_planes; ++j)
+      {
+      // the plane in the coordinates of the points is the transpose of cs times the plane
+      float4 plane;
+      for (int c = 0; c < 4; ++c)
+        plane[c] = _clip_planes[j][0] * pc.cs[c * 4] + _clip_planes[j][1] * pc.cs[c * 4 + 1] + _clip_planes[j][2] * pc.cs[c * 4 + 2] + _clip_planes[j][3] * pc.cs[c * 4 + 3];
+      cloud.clip_planes.push_back(plane);
+      }
+    _splat_clouds.push_back(cloud);
+    clouds.push_back(&pc);
+    cloud_nodes.push_back(nodes);
+    object_to_clip.push_back(matrix_matrix_multiply(world_to_clip, pc.cs));
+    scale.push_back(std::sqrt(pc.cs[0] * pc.cs[0] + pc.cs[1] * pc.cs[1] + pc.cs[2] * pc.cs[2]));
+    push((uint32_t)clouds.size() - 1, 0);
+    }
+
+  while (!heap.empty())
+    {
+    std::pop_heap(heap.begin(), heap.end());
+    const point_node_candidate c = heap.back();
+    heap.pop_back();
+    const scene_pointcloud& pc = *clouds[c.cloud];
+    const pc_octree_node& n = (*cloud_nodes[c.cloud])[c.node];
+    if ((uint64_t)_nr_of_splatted_points + n.count > _settings.point_budget)
+      break;
+    const vec3<float>* vertices = nullptr;
+    const vec3<float>* normals = nullptr;
+    const uint32_t* colors = nullptr;
+    if (pc.stream)
+      {
+      std::shared_ptr<const pc_chunk> chunk = pc.stream->get(c.node, c.projected_size);
+      if (!chunk)
+        continue;
+      vertices = chunk->vertices.data();
+      normals = chunk->normals.empty() ? nullptr : chunk->normals.data();
+      colors = chunk->colors.empty() ? nullptr : chunk->colors.data();
+      // keeps the chunk alive while it is splatted, also if the stream drops it from its cache
+      _splat_chunks.push_back(chunk);
+      }
+    else
+      {
+      vertices = pc.p_vertices->data() + n.first;
+      normals = pc.p_normals->empty() ? nullptr : pc.p_normals->data() + n.first;
+      colors = pc.p_vertex_colors->empty() ? nullptr : pc.p_vertex_colors->data() + n.first;
+      }
+    _nr_of_splatted_points += n.count;
+    for (uint32_t offset = 0; offset < n.count; offset += splat_batch_size)
+      {
+      splat_batch b;
+      b.vertices = vertices + offset;
+      b.normals = _settings.shading && normals ? normals + offset : nullptr;
+      b.colors = !_settings.one_bit && colors ? colors + offset : nullptr;
+      b.nr_of_points = std::min(splat_batch_size, n.count - offset);
+      b.first_id = n.first + offset;
+      b.cloud = c.cloud;
+      _splat_batches.push_back(b);
+      }
+    if (c.projected_size / (float)pc_octree_grid > 1.f)
+      {
+      for (uint32_t child : n.children)
+        {
+        if (child)
+          push(c.cloud, child);
+        }
+      }
+    }
+  }
+
+void canvas::render_pointclouds_on_image(const scene* s, const g_buffer& pix)
+  {
+  _nr_of_splatted_points = 0;
+  if (!s->pointclouds.empty())
+    {
+    // the point cloud records go into a copy, so that pix stays a pure ray traced G-buffer that later stages can reuse,
+    // and that copy is the G-buffer that gets published
+    std::shared_ptr<g_buffer> visible = _free_g_buffer();
+    *visible = pix;
+    if (_zbuffer.width() != pix.width() || _zbuffer.height() != pix.height())
+      _zbuffer = jtk::image<float>(pix.width(), pix.height());
+    const uint32_t w = pix.width();
+    const uint32_t h = pix.height();
+    const simd_kernels& k = get_simd_kernels();
+    // the splatter expects a dense z-buffer, so rows are written w apart regardless of the stride of _zbuffer
+    for (uint32_t y = 0; y < h; ++y)
+      k.splat_depth_row(_zbuffer.data() + y * w, pix.span(pix.index(0, y)), w);
+
+    _select_point_nodes(s, w);
+    _splatter.splat(im, *visible, _zbuffer.data(), _splat_clouds, _splat_batches, s->coordinate_system_inv, projection_matrix, _tp);
+    if (_settings.eye_dome_lighting && !_splat_batches.empty())
+      _apply_eye_dome_lighting(*visible);
+    _visible_pixels = visible;
+    }
+  }
+
+void canvas::_composite_point_layer()
+  {
+  if (!_point_layer_valid || !_visible_pixels)
+    return;
+  const g_buffer& pixels = *_visible_pixels;
+  const uint32_t w = im.width();
+  const uint32_t h = im.height();
+  parallel_for_row_blocks(h, [&](uint32_t y0, uint32_t y1)
+    {
+    for (uint32_t y = y0; y < y1; ++y)
+      {
+      uint32_t* p_im_line = im.row(y);
+      const uint32_t* p_point_line = _point_im.row(y);
+      const uint32_t* db_id = pixels.db_id.data() + pixels.index(0, y);
+      for (uint32_t x = 0; x < w; ++x)
+        {
+        if (get_db_key(db_id[x]) == PC_KEY)
+          p_im_line[x] = p_point_line[x];
+        }
+      }
+    }, _tp);
+  }
+
+/*
+Eye-dome lighting: every point is darkened by how far it lies behind its neighbours on screen, measured in log depth
+on the z-buffer that the splatter left behind. This outlines the silhouettes and the relief of point clouds
+without normals, at the cost of one pass over the image.
+*/
+void canvas::_apply_eye_dome_lighting(const g_buffer& pixels)
+  {
+  const uint32_t w = pixels.width();
+  const uint32_t h = pixels.height();
+  const uint32_t radius = 1;
+  const simd_kernels& k = get_simd_kernels();
+  parallel_for_row_blocks(h, [&](uint32_t y0, uint32_t y1)
+    {
+    for (uint32_t y = y0; y < y1; ++y)
+      {
+      simd_edl e;
+      e.z = _zbuffer.data() + y * w;
+      e.z_up = _zbuffer.data() + (y >= radius ? y - radius : 0) * w;
+      e.z_down = _zbuffer.data() + std::min(y + radius, h - 1) * w;
+      e.db_id = pixels.db_id.data() + pixels.index(0, y);
+      e.db_key = PC_KEY;
+      e.radius = radius;
+      e.strength = _settings.eye_dome_lighting_strength;
+      k.edl_row(im.row(y), e, w);
+      }
+    }, _tp);
+  }
+
@@ -2,13 +2,59 @@
 
 #include "camera.h"
 #include <jtk/image.h>
-#include <jtk/render.h>
-#include "pixel.h"
+#include "g_buffer.h"
 #include "scene.h"
 #include "mouse.h"
 #include "matcap.h"
+#include "point_splatter.h"
+#include "tile_scheduler.h"
+#include "triple_buffer.h"
 #include <jtk/concurrency.h>
 
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+enum render_stage
+  {
+  RENDER_STAGE_HITS = 1, // camera rays into the G-buffer
+  RENDER_STAGE_SHADOW = 2, // shadow bits of the G-buffer
+  RENDER_STAGE_AMBIENT_OCCLUSION = 4, // occlusion rays from the G-buffer, accumulated over the frames while the camera is still
+  RENDER_STAGE_SHADING = 8, // G-buffer to im with the matcap, edges, wireframe or one bit mode
+  RENDER_STAGE_ANTIALIASING = 16, // one more jittered sample per pixel traced, shaded and averaged into im while the camera is still
+  RENDER_STAGE_POINTCLOUDS = 32, // point clouds splatted onto im
+  RENDER_STAGE_COMPOSITE = 64, // im changed and needs to be presented again
+  RENDER_STAGE_ALL = 127
+  };
+
+const uint32_t max_clipping_planes = 6;
+
+// A section plane in world coordinates: the points x with dot(normal, x) > offset are cut away.
+struct clipping_plane
+  {
+  bool enabled;
+  float normal[3];
+  float offset;
+  };
+
+// A finished frame, as handed over by canvas::render to the thread that shows it.
+struct canvas_frame
+  {
+  jtk::image<uint32_t> im; // swapped with the image of the canvas when the frame is published
+  std::shared_ptr<const g_buffer> pixels; // the G-buffer including the point clouds, shared with the renderer, which does not write it while a frame holds it
+  jtk::float4x4 coordinate_system; // the camera of the frame
+  uint32_t nr_of_traced_pixels;
+  uint32_t nr_of_splatted_points;
+  float resolution_scale;
+  tile_statistics tiles;
+  };
+
+/*
+render runs on the render thread. Every finished frame is published in a triple buffer, and the ui thread
+takes the newest one with acquire_frame. The methods that the ui thread calls while a frame is rendered
+(get_pixel, do_mouse, blit_onto, get_frame and the getters of the frame) only read the acquired frame.
+*/
 class canvas
   {
   public:
@@ -17,11 +63,23 @@ class canvas
       {
       bool one_bit;
       bool shadow;
+      bool ambient_occlusion;
       bool edges;
       bool wireframe;
       bool shading;
       bool textured;
       bool vertexcolors;
+      bool reprojection;
+      bool progressive;
+      float progressive_threshold_in_ms; // progressive rendering kicks in when a fully traced frame is slower than this
+      uint32_t progressive_density; // 4 or 16: trace 1 out of progressive_density pixels while the camera moves
+      bool dynamic_resolution;
+      float frame_budget_in_ms; // target frame time for dynamic resolution while the camera moves
+      uint32_t antialiasing_samples; // samples per pixel that are accumulated while the camera is still, 1 turns anti-aliasing off
+      clipping_plane clipping_planes[max_clipping_planes];
+      uint32_t point_budget; // maximum number of points splatted per frame
+      bool eye_dome_lighting; // shade the point clouds by their depth differences with their neighbours on screen
+      float eye_dome_lighting_strength;
       };
 
     canvas();
@@ -34,21 +92,41 @@ class canvas
 
     void get_pixel(pixel& p, float pos_x, float pos_y, float mouse_offset_x, float mouse_offset_y);
 
-    void do_mouse(bool& refresh, mouse_data& data, scene& s, float mouse_offset_x, float mouse_offset_y);
+    void do_mouse(bool& refresh, mouse_data& data, scene_camera& s, float mouse_offset_x, float mouse_offset_y);
 
-    void update_canvas(jtk::image<pixel>& out, int x0, int y0, int x1, int y1, const scene& s);
+    void update_canvas(g_buffer& out, int x0, int y0, int x1, int y1, const scene& s);
 
     void update_canvas(int x0, int y0, int x1, int y1, const scene& s);
 
-    void render_scene(jtk::image<pixel>& out, const scene* s);
+    void render_scene(g_buffer& out, const scene* s);
 
     void render_scene(const scene* s);
 
-    void render_pointclouds_on_image(const scene* s, const jtk::image<pixel>& pix);
+    // Runs the render stages that are out of date, and returns the stages that ran (a combination of render_stage flags).
+    uint32_t render(const scene* s, const matcap& _matcap);
+
+    // Marks stages as out of date, for changes that the canvas cannot detect by itself.
+    void invalidate(uint32_t stages) { _dirty_stages |= stages; }
+
+    // Makes the render call in flight return as soon as possible, without publishing a frame. Can be called from any thread.
+    void cancel() { _cancel = true; }
+    void clear_cancel() { _cancel = false; }
+    bool is_cancelled() const { return _cancel.load(std::memory_order_relaxed); }
+
+    // Makes the last published frame the frame that is shown. Returns false if no new frame was published.
+    bool acquire_frame() { return _frames.acquire(); }
+
+    const canvas_frame& get_frame() const { return _frames.front(); }
+
+    // Gives all frames an empty G-buffer, so that nothing is picked from objects that were removed. Not while render runs.
+    void clear_frames();
+
+    void render_pointclouds_on_image(const scene* s, const g_buffer& pix);
 
     void set_background_color(uint32_t clr_top = 0xff000000, uint32_t clr_bottom = 0xff404040);
 
-    void blit_onto(jtk::image<uint32_t>& screen, int32_t pos_x, int32_t pos_y);
+    // Copies the image of the acquired frame to pixels, e.g. a locked texture, with rows pitch bytes apart.
+    void blit_onto(void* pixels, int32_t pitch) const;
 
     const uint32_t width() const { return im.width(); }
     const uint32_t height() const { return im.height(); }
@@ -58,7 +136,7 @@ class canvas
       _settings = s;
       }
 
-    void canvas_to_image(const jtk::image<pixel>& canvas, const matcap& _matcap);
+    void canvas_to_image(const g_buffer& canvas, const matcap& _matcap);
     void canvas_to_image(const matcap& _matcap);
 
     const jtk::float4x4& get_projection_matrix() const { return projection_matrix; }
@@ -66,18 +144,85 @@ class canvas
 
     const camera& get_camera() const { return _camera; }
 
-    const jtk::image<pixel>& get_pixels() const { return _canvas; }
+    const g_buffer& get_pixels() const { return *_frames.front().pixels; }
+
+    const jtk::image<uint32_t>& get_image() const { return _frames.front().im; }
 
-    const jtk::image<uint32_t>& get_image() const { return im; }
+    // True if the last frame was warped from the frame before instead of fully ray traced.
+    bool is_reprojected() const { return _reprojected; }
 
-    jtk::image<uint32_t>& get_image() { return im; }
+    // True if the last frame was not fully traced, or its ambient occlusion or anti-aliasing did not converge yet,
+    // and later frames without camera motion can refine it.
+    bool needs_refinement() const;
+
+    // Feeds the measured time of the last frame to the dynamic resolution controller.
+    void set_last_frame_time(double time_in_s);
+
+    float get_resolution_scale() const { return _frames.front().resolution_scale; }
+
+    uint32_t get_nr_of_traced_pixels() const { return _frames.front().nr_of_traced_pixels; }
 
   private:
     float compute_convex_cos_angle(float x1, float y1, float u1, float v1, float depth1, float x2, float y2, float u2, float v2, float depth2);
     
-    void _render_wireframe(const jtk::image<pixel>& canvas, const matcap& _matcap);
+    void _update_canvas(g_buffer& out, int x0, int y0, int x1, int y1, const scene& s, const uint8_t* trace_mask);
+
+    // Returns the top level bvh over the objects that intersect the view frustum, or nullptr if no object does.
+    const wbvh_two_level_with_transformations* _cull(const scene& s);
+
+    // Collects the enabled clipping planes of the settings as (normal, -offset) in _clip_planes.
+    void _update_clip_planes();
 
-    void _canvas_to_one_bit_image(const jtk::image<pixel>& _combined_canvas, const matcap& _matcap);
+    bool _can_reproject(const scene& s);
+
+    void _reproject(const scene& s);
+
+    bool _progressive_active() const;
+
+    bool _can_refine(const scene& s);
+
+    void _trace_progressive(const scene& s, uint32_t first_step, uint32_t last_step);
+
+    void _upscale(const g_buffer& low_res);
+
+    void _update_shadows(g_buffer& out, int x0, int y0, int x1, int y1, const scene& s, const uint8_t* trace_mask);
+
+    void _update_ambient_occlusion(const scene& s);
+
+    void _apply_ambient_occlusion(const g_buffer& pixels);
+
+    bool _ambient_occlusion_pending() const;
+
+    bool _antialiasing_pending() const;
+
+    void _accumulate_antialiasing(const scene& s, const matcap& _matcap);
+
+    bool _hits_incomplete() const { return _reprojected || _upscaled || _refinement_step < 16; }
+
+    bool _hits_dirty(const scene* s);
+
+    void _abort_frame();
+
+    void _publish_frame(const scene* s);
+
+    // A full size G-buffer that no frame and no stage uses, with undefined contents.
+    std::shared_ptr<g_buffer> _free_g_buffer();
+
+    // Makes sure that _canvas is not shared with a published frame, as it is about to be written.
+    // keep_contents is false for the passes that overwrite every pixel.
+    void _make_canvas_writable(bool keep_contents);
+
+    // Fills _splat_clouds and _splat_batches with the octree nodes of the point clouds that are splatted this frame.
+    void _select_point_nodes(const scene* s, uint32_t w);
+
+    void _apply_eye_dome_lighting(const g_buffer& pixels);
+
+    // Lays the splatted points of _point_im over im.
+    void _composite_point_layer();
+
+    void _render_wireframe(const g_buffer& canvas, const matcap& _matcap);
+
+    void _canvas_to_one_bit_image(const g_buffer& _combined_canvas, const matcap& _matcap);
 
     uint32_t _get_color(const pixel* p, const matcap& _matcap) const;
 
@@ -85,18 +230,74 @@ class canvas
 
 
   private:
-    jtk::render_data _rd;
-    jtk::frame_buffer _fb;
     jtk::image<float> _zbuffer;
 
     jtk::image<uint32_t> im, background;
-    jtk::image<jtk::float4> buffer;
+    jtk::image<uint32_t> _mesh_im; // im as it was shaded and averaged, before the point clouds were splatted on it
+    bool _mesh_im_valid; // only kept while the scene has point clouds
+    jtk::image<uint32_t> _point_im; // im after the point clouds were splatted, of which the pixels with a point are laid over the antialiasing samples
+    bool _point_layer_valid;
+    bool _has_meshes; // the scene has a mesh bvh, without it there is nothing to antialias
     camera _camera;
     jtk::float4x4 projection_matrix, projection_matrix_inv;
-    jtk::image<pixel> _canvas;
-    jtk::image<float> _u, _v;
+    std::shared_ptr<g_buffer> _canvas; // the ray traced hits, shared with the published frames until it is written again
     canvas_settings _settings;
 
     jtk::thread_pool _tp;
+    tile_scheduler _scheduler;
+
+    std::shared_ptr<g_buffer> _previous_canvas;
+    std::vector<std::shared_ptr<g_buffer>> _g_buffers; // all full size G-buffers, free for reuse while they hold the only reference
+    jtk::float4x4 _previous_coordinate_system;
+    canvas_settings _previous_settings;
+    uint64_t _previous_scene_version;
+    bool _previous_canvas_valid;
+    bool _camera_moved;
+    bool _reprojected;
+    uint32_t _reprojection_frame;
+    uint32_t _refinement_step;
+    bool _fill_untraced;
+    double _last_full_trace_time_in_s;
+    uint32_t _nr_of_traced_pixels;
+    g_buffer _low_res_canvas;
+    float _resolution_scale;
+    bool _upscaled;
+    bool _last_frame_traced;
+    uint32_t _dirty_stages;
+    std::shared_ptr<const g_buffer> _visible_pixels; // the G-buffer including the point clouds, as published, nullptr after the G-buffer changed
+    canvas_settings _rendered_settings;
+    jtk::float4 _rendered_light;
+    uint64_t _rendered_pointclouds_version;
+    const uint32_t* _rendered_matcap_pixels;
+    matcap_type _rendered_matcap_type;
+    std::string _rendered_matcap_file;
+    std::unique_ptr<std::atomic<uint64_t>[]> _reprojection_keys;
+    std::vector<uint8_t> _trace_mask;
+    std::vector<uint32_t> _shadow_row_offsets;
+    std::vector<jtk::vec3<float>> _shadow_origins;
+    std::vector<uint32_t> _shadow_pixels;
+    std::vector<uint64_t> _shadow_keys;
+    uint32_t _ambient_occlusion_samples; // samples per pixel in _ambient_occlusion, 0 after the hits changed
+    std::vector<uint16_t> _ambient_occlusion; // number of occluded samples per pixel of _canvas
+    std::vector<uint32_t> _ambient_occlusion_pixels;
+    std::vector<jtk::vec3<float>> _ambient_occlusion_origins;
+    std::vector<jtk::vec3<float>> _ambient_occlusion_normals;
+    uint32_t _antialiasing_samples; // samples per pixel averaged in im, 1 after the shading stage
+    std::vector<uint16_t> _antialiasing_sum; // r, g, b, a sums per pixel
+    g_buffer _antialiasing_canvas;
+    float _jitter_x, _jitter_y; // offset of the camera rays from the pixel centres
+    jtk::float4 _clip_planes[max_clipping_planes];
+    uint32_t _nr_of_clip_planes;
+    std::vector<uint32_t> _visible_objects; // indices in the render cache of the objects inside the view frustum
+    std::unique_ptr<wbvh_two_level_with_transformations> _visible_bvh; // nullptr if all objects are visible
+    uint64_t _visible_bvh_version; // render cache version of _visible_objects
+    float _visible_depth_min, _visible_depth_max; // view depth range of the bounding boxes of the visible objects
+    point_splatter _splatter;
+    std::vector<splat_cloud> _splat_clouds;
+    std::vector<splat_batch> _splat_batches;
+    std::vector<std::shared_ptr<const pc_chunk>> _splat_chunks; // the chunks of streamed point clouds in _splat_batches
+    uint32_t _nr_of_splatted_points;
+    triple_buffer<canvas_frame> _frames;
+    std::atomic<bool> _cancel;
     
   };
@@ -0,0 +1,98 @@
+#include "cpu.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+namespace
+  {
+
+  void cpuid(int* info, int leaf, int subleaf)
+    {
+#if defined(_MSC_VER)
+    __cpuidex(info, leaf, subleaf);
+#else
+    unsigned int a, b, c, d;
+    __cpuid_count(leaf, subleaf, a, b, c, d);
+    info[0] = (int)a;
+    info[1] = (int)b;
+    info[2] = (int)c;
+    info[3] = (int)d;
+#endif
+    }
+
+  uint64_t xgetbv0()
+    {
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    uint32_t eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((uint64_t)edx << 32) | eax;
+#endif
+    }
+
+  cpu_isa detect_cpu_isa()
+    {
+    int info[4];
+    cpuid(info, 0, 0);
+    const int max_leaf = info[0];
+    if (max_leaf < 7)
+      return cpu_isa::CPU_ISA_SSE41;
+    cpuid(info, 1, 0);
+    const bool fma = (info[2] & (1 << 12)) != 0;
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    const bool avx = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx || !fma)
+      return cpu_isa::CPU_ISA_SSE41;
+    const uint64_t xcr0 = xgetbv0();
+    if ((xcr0 & 0x6) != 0x6) // the os does not save the ymm registers
+      return cpu_isa::CPU_ISA_SSE41;
+    cpuid(info, 7, 0);
+    const bool avx2 = (info[1] & (1 << 5)) != 0;
+    const bool avx512f = (info[1] & (1 << 16)) != 0;
+    const bool avx512vl = (info[1] & (1 << 31)) != 0;
+    if (!avx2)
+      return cpu_isa::CPU_ISA_SSE41;
+    if (avx512f && avx512vl && (xcr0 & 0xe6) == 0xe6) // opmask and zmm state enabled
+      return cpu_isa::CPU_ISA_AVX512;
+    return cpu_isa::CPU_ISA_AVX2;
+    }
+
+  simd_kernels make_simd_kernels(cpu_isa isa)
+    {
+    simd_kernels k;
+    switch (isa)
+      {
+      case cpu_isa::CPU_ISA_AVX512: init_simd_kernels_avx512(k); break;
+      case cpu_isa::CPU_ISA_AVX2: init_simd_kernels_avx2(k); break;
+      default: init_simd_kernels_sse41(k); break;
+      }
+    return k;
+    }
+
+  }
+
+cpu_isa get_cpu_isa()
+  {
+  static const cpu_isa isa = detect_cpu_isa();
+  return isa;
+  }
+
+const char* cpu_isa_to_string(cpu_isa isa)
+  {
+  switch (isa)
+    {
+    case cpu_isa::CPU_ISA_AVX512: return "AVX-512";
+    case cpu_isa::CPU_ISA_AVX2: return "AVX2";
+    default: return "SSE4.1";
+    }
+  }
+
+const simd_kernels& get_simd_kernels()
+  {
+  static const simd_kernels k = make_simd_kernels(get_cpu_isa());
+  return k;
+  }
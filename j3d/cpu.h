@@ -0,0 +1,18 @@
+#pragma once
+
+#include "simd_kernels.h"
+
+enum class cpu_isa
+  {
+  CPU_ISA_SSE41,
+  CPU_ISA_AVX2,
+  CPU_ISA_AVX512
+  };
+
+// The widest instruction set that j3d has kernels for and that the cpu and os support. Detected once.
+cpu_isa get_cpu_isa();
+
+const char* cpu_isa_to_string(cpu_isa isa);
+
+// The kernels for get_cpu_isa().
+const simd_kernels& get_simd_kernels();
@@ -1,6 +1,7 @@
 #include "db.h"
 #include "mesh.h"
 #include "pc.h"
+#include "pc_stream.h"
 
 #include <cassert>
 
@@ -212,6 +213,19 @@ float4x4* get_cs(const db& _db, uint32_t id)
   return nullptr;
   }
 
+bool get_vertex(vec3<float>& v, const db& _db, uint32_t id, uint32_t vertex_id)
+  {
+  const std::vector<vec3<float>>* vertices = get_vertices(_db, id);
+  if (vertices && vertex_id < vertices->size())
+    {
+    v = (*vertices)[vertex_id];
+    return true;
+    }
+  if (get_db_key(id) == PC_KEY && _db.get_pc(id)->stream)
+    return _db.get_pc(id)->stream->find_point(v, vertex_id);
+  return false;
+  }
+
 bool is_visible(const db& _db, uint32_t id)
   {
   auto key = get_db_key(id);
@@ -66,5 +66,7 @@ class db
 std::vector<jtk::vec3<float>>* get_vertices(const db& _db, uint32_t id);
 std::vector<jtk::vec3<uint32_t>>* get_triangles(const db& _db, uint32_t id);
 jtk::float4x4* get_cs(const db& _db, uint32_t id);
+// Vertex vertex_id of object id, false if it is not in memory (streamed point clouds).
+bool get_vertex(jtk::vec3<float>& v, const db& _db, uint32_t id, uint32_t vertex_id);
 bool is_visible(const db& _db, uint32_t id);
 double get_load_time_in_s(const db& _db, uint32_t id);
\ No newline at end of file
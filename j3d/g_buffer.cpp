@@ -0,0 +1,97 @@
+#include "g_buffer.h"
+
+#include <limits>
+
+namespace
+  {
+
+  inline uint32_t encode_snorm16(float x)
+    {
+    x = x < -1.f ? -1.f : (x > 1.f ? 1.f : x);
+    const int32_t n = (int32_t)(x * 32767.f + (x < 0.f ? -0.5f : 0.5f));
+    return (uint32_t)(uint16_t)(int16_t)n;
+    }
+
+  inline uint32_t encode_unorm16(float x)
+    {
+    x = x < 0.f ? 0.f : (x > 1.f ? 1.f : x);
+    return (uint32_t)(x * 65535.f + 0.5f);
+    }
+
+  }
+
+g_buffer::g_buffer() : _width(0), _height(0)
+  {
+  }
+
+g_buffer::g_buffer(uint32_t w, uint32_t h) : _width(w), _height(h)
+  {
+  const size_t size = (size_t)w * h;
+  color.resize(size, 0);
+  normal.resize(size, 0);
+  depth.resize(size, std::numeric_limits<float>::max());
+  object_id.resize(size, (uint32_t)-1);
+  barycentric.resize(size, 0);
+  db_id.resize(size, 0);
+  }
+
+pixel g_buffer::get(uint32_t i) const
+  {
+  pixel p;
+  p.mark = (uint8_t)(color[i] & 0xff);
+  p.r = (uint8_t)((color[i] >> 8) & 0xff);
+  p.g = (uint8_t)((color[i] >> 16) & 0xff);
+  p.b = (uint8_t)(color[i] >> 24);
+  p.u = normal_u(i);
+  p.v = normal_v(i);
+  p.depth = depth[i];
+  p.object_id = object_id[i];
+  p.barycentric_u = barycentric_u(i);
+  p.barycentric_v = barycentric_v(i);
+  p.db_id = db_id[i];
+  return p;
+  }
+
+void g_buffer::set_normal(uint32_t i, float u, float v)
+  {
+  normal[i] = encode_snorm16(u) | (encode_snorm16(v) << 16);
+  }
+
+void g_buffer::set_barycentric(uint32_t i, float u, float v)
+  {
+  const uint32_t qu = encode_unorm16(u);
+  uint32_t qv = encode_unorm16(v);
+  // rounding may not push the point outside of the triangle, or the shadow ray starts behind a neighbouring triangle
+  if (qu + qv > 65535)
+    qv = 65535 - qu;
+  barycentric[i] = qu | (qv << 16);
+  }
+
+void g_buffer::clear(uint32_t i)
+  {
+  normal[i] = 0;
+  depth[i] = std::numeric_limits<float>::max();
+  object_id[i] = (uint32_t)-1;
+  db_id[i] = 0;
+  }
+
+void g_buffer::copy(uint32_t i, const g_buffer& src, uint32_t j)
+  {
+  color[i] = src.color[j];
+  normal[i] = src.normal[j];
+  depth[i] = src.depth[j];
+  object_id[i] = src.object_id[j];
+  barycentric[i] = src.barycentric[j];
+  db_id[i] = src.db_id[j];
+  }
+
+simd_g_buffer_span g_buffer::span(uint32_t i) const
+  {
+  simd_g_buffer_span s;
+  s.color = color.data() + i;
+  s.normal = normal.data() + i;
+  s.depth = depth.data() + i;
+  s.object_id = object_id.data() + i;
+  s.db_id = db_id.data() + i;
+  return s;
+  }
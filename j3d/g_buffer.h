@@ -0,0 +1,62 @@
+#pragma once
+
+#include "pixel.h"
+#include "simd_kernels.h"
+
+#include <stdint.h>
+#include <vector>
+
+/*
+The G-buffer of the canvas, stored as one plane per channel instead of an image of pixel records,
+so that the post processing kernels load each channel with contiguous vector loads.
+Pixel (x, y) is element y*width + x of every plane.
+The normal is the x and y of the view space normal as two 16-bit snorms: its z is always reconstructed
+as sqrt(1-u*u-v*v), because a normal that is seen points towards the camera.
+The barycentric coordinates are two 16-bit unorms.
+*/
+class g_buffer
+  {
+  public:
+    g_buffer();
+    g_buffer(uint32_t w, uint32_t h);
+
+    uint32_t width() const { return _width; }
+    uint32_t height() const { return _height; }
+
+    uint32_t index(uint32_t x, uint32_t y) const { return y * _width + x; }
+
+    // The decoded record of pixel i
+    pixel get(uint32_t i) const;
+
+    pixel operator()(uint32_t x, uint32_t y) const { return get(index(x, y)); }
+
+    uint32_t mark(uint32_t i) const { return color[i] & 0xff; }
+
+    float normal_u(uint32_t i) const { return (float)(int16_t)(normal[i] & 0xffff) * g_buffer_normal_scale; }
+    float normal_v(uint32_t i) const { return (float)(int16_t)(normal[i] >> 16) * g_buffer_normal_scale; }
+
+    float barycentric_u(uint32_t i) const { return (float)(barycentric[i] & 0xffff) * (1.f / 65535.f); }
+    float barycentric_v(uint32_t i) const { return (float)(barycentric[i] >> 16) * (1.f / 65535.f); }
+
+    void set_normal(uint32_t i, float u, float v);
+    void set_barycentric(uint32_t i, float u, float v);
+
+    // Marks pixel i as background. The color channel is left as is.
+    void clear(uint32_t i);
+
+    // Copies pixel j of src to pixel i.
+    void copy(uint32_t i, const g_buffer& src, uint32_t j);
+
+    simd_g_buffer_span span(uint32_t i) const;
+
+  public:
+    std::vector<uint32_t> color; // mark | r << 8 | g << 16 | b << 24, see pixel for the bits of mark
+    std::vector<uint32_t> normal;
+    std::vector<float> depth;
+    std::vector<uint32_t> object_id;
+    std::vector<uint32_t> barycentric;
+    std::vector<uint32_t> db_id;
+
+  private:
+    uint32_t _width, _height;
+  };
@@ -0,0 +1,228 @@
+// This file is compiled with AVX2. Only include simd_kernels_impl.h and intrinsics here.
+#include "simd_kernels_impl.h"
+
+namespace
+  {
+
+  inline __m256i load8i(const uint32_t* p)
+    {
+    return _mm256_loadu_si256((const __m256i*)p);
+    }
+
+  inline void decode_normals(__m256& u, __m256& v, const uint32_t* normal)
+    {
+    const __m256i n = load8i(normal);
+    const __m256 scale = _mm256_set1_ps(g_buffer_normal_scale);
+    u = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_slli_epi32(n, 16), 16)), scale);
+    v = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srai_epi32(n, 16)), scale);
+    }
+
+  void shade_row(uint32_t* out, const simd_g_buffer_span& pixels, uint32_t nr_of_pixels, const simd_matcap& m, int shading)
+    {
+    const __m256 one = _mm256_set1_ps(1.f);
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 width_minus_one = _mm256_set1_ps((float)(m.width - 1));
+    const __m256 height_minus_one = _mm256_set1_ps((float)(m.height - 1));
+    const __m256i stride = _mm256_set1_epi32((int)m.stride);
+    const __m256i no_object = _mm256_set1_epi32(-1);
+    const __m256i byte_mask = _mm256_set1_epi32(0xff);
+    const __m256i alpha = _mm256_set1_epi32((int)0xff000000);
+    const __m256i quarter_mask = _mm256_set1_epi32(0x003f3f3f);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i bit0 = _mm256_set1_epi32(1);
+    const __m256i bit1 = _mm256_set1_epi32(2);
+
+    uint32_t i = 0;
+    for (; i + 8 <= nr_of_pixels; i += 8)
+      {
+      const __m256i object_id = load8i(pixels.object_id + i);
+      const __m256i valid = _mm256_xor_si256(_mm256_cmpeq_epi32(object_id, no_object), no_object);
+      if (_mm256_testz_si256(valid, valid))
+        continue;
+      const __m256i mark_rgb = load8i(pixels.color + i);
+      const __m256i mark = _mm256_and_si256(mark_rgb, byte_mask);
+      __m256 u, v;
+      decode_normals(u, v, pixels.normal + i);
+      const __m256i colored = _mm256_cmpeq_epi32(_mm256_and_si256(mark, bit1), bit1);
+      const __m256i matcap_lanes = _mm256_andnot_si256(colored, valid);
+
+      __m256i clr = zero;
+      if (!_mm256_testz_si256(matcap_lanes, matcap_lanes))
+        {
+        const __m256 fu = _mm256_floor_ps(_mm256_add_ps(half, _mm256_mul_ps(_mm256_mul_ps(_mm256_add_ps(u, one), width_minus_one), half)));
+        const __m256 fv = _mm256_floor_ps(_mm256_add_ps(half, _mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(one, v), height_minus_one), half)));
+        const __m256i index = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_cvttps_epi32(fv), stride), _mm256_cvttps_epi32(fu));
+        clr = _mm256_mask_i32gather_epi32(zero, (const int*)m.pixels, index, matcap_lanes, 4);
+        const __m256i shadow = _mm256_xor_si256(_mm256_cmpeq_epi32(mark, zero), no_object);
+        const __m256i dark = _mm256_or_si256(alpha, _mm256_and_si256(_mm256_srli_epi32(clr, 2), quarter_mask));
+        clr = _mm256_blendv_epi8(clr, dark, shadow);
+        }
+      const __m256i colored_lanes = _mm256_and_si256(colored, valid);
+      if (!_mm256_testz_si256(colored_lanes, colored_lanes))
+        {
+        __m256i r = _mm256_and_si256(_mm256_srli_epi32(mark_rgb, 8), byte_mask);
+        __m256i g = _mm256_and_si256(_mm256_srli_epi32(mark_rgb, 16), byte_mask);
+        __m256i b = _mm256_srli_epi32(mark_rgb, 24);
+        const __m256i in_shadow = _mm256_cmpeq_epi32(_mm256_and_si256(mark, bit0), bit0);
+        if (shading)
+          {
+          const __m256 w = _mm256_sqrt_ps(_mm256_sub_ps(_mm256_sub_ps(one, _mm256_mul_ps(u, u)), _mm256_mul_ps(v, v)));
+          const __m256 occ = _mm256_blendv_ps(one, _mm256_set1_ps(0.3f), _mm256_castsi256_ps(in_shadow));
+          const __m256 dif = _mm256_mul_ps(_mm256_min_ps(_mm256_max_ps(w, _mm256_setzero_ps()), one), occ);
+          r = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(r), dif));
+          g = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(g), dif));
+          b = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(b), dif));
+          }
+        else
+          {
+          r = _mm256_blendv_epi8(r, _mm256_srli_epi32(r, 2), in_shadow);
+          g = _mm256_blendv_epi8(g, _mm256_srli_epi32(g, 2), in_shadow);
+          b = _mm256_blendv_epi8(b, _mm256_srli_epi32(b, 2), in_shadow);
+          }
+        const __m256i rgb = _mm256_or_si256(_mm256_or_si256(alpha, _mm256_slli_epi32(b, 16)), _mm256_or_si256(_mm256_slli_epi32(g, 8), r));
+        clr = _mm256_blendv_epi8(clr, rgb, colored);
+        }
+      _mm256_maskstore_epi32((int*)(out + i), valid, clr);
+      }
+    shade_row_scalar(out, pixels, i, nr_of_pixels, m, shading);
+    }
+
+  void splat_depth_row(float* z, const simd_g_buffer_span& pixels, uint32_t nr_of_pixels)
+    {
+    const __m256 one = _mm256_set1_ps(1.f);
+    uint32_t i = 0;
+    for (; i + 8 <= nr_of_pixels; i += 8)
+      {
+      const __m256i db_id = load8i(pixels.db_id + i);
+      const __m256 depth = _mm256_loadu_ps(pixels.depth + i);
+      const __m256 no_object = _mm256_castsi256_ps(_mm256_cmpeq_epi32(db_id, _mm256_setzero_si256()));
+      _mm256_storeu_ps(z + i, _mm256_andnot_ps(no_object, _mm256_div_ps(one, depth)));
+      }
+    splat_depth_row_scalar(z, pixels, i, nr_of_pixels);
+    }
+
+  void copy_row(uint32_t* dest, const uint32_t* src, uint32_t nr_of_pixels)
+    {
+    uint32_t i = 0;
+    for (; i + 8 <= nr_of_pixels; i += 8)
+      _mm256_storeu_si256((__m256i*)(dest + i), _mm256_loadu_si256((const __m256i*)(src + i)));
+    for (; i < nr_of_pixels; ++i)
+      dest[i] = src[i];
+    }
+
+  void edge_row(uint8_t* flags, const simd_g_buffer_span& pixels, const simd_g_buffer_span& up_pixels, uint32_t nr_of_pixels, float threshold)
+    {
+    const __m256i no_object = _mm256_set1_epi32(-1);
+    const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    const __m256 t = _mm256_set1_ps(threshold);
+    uint32_t i = 0;
+    for (; i + 8 <= nr_of_pixels; i += 8)
+      {
+      const __m256i id = load8i(pixels.object_id + i);
+      const __m256i valid = _mm256_xor_si256(_mm256_cmpeq_epi32(id, no_object), no_object);
+      if (_mm256_testz_si256(valid, valid))
+        {
+        *(int64_t*)(flags + i) = 0;
+        continue;
+        }
+      __m256 u, v, right_u, right_v, up_u, up_v;
+      decode_normals(u, v, pixels.normal + i);
+      decode_normals(right_u, right_v, pixels.normal + i + 1);
+      decode_normals(up_u, up_v, up_pixels.normal + i);
+
+      const __m256i right_id = load8i(pixels.object_id + i + 1);
+      const __m256i right_valid = _mm256_andnot_si256(_mm256_cmpeq_epi32(right_id, no_object), valid);
+      const __m256 right_normal = _mm256_or_ps(_mm256_cmp_ps(_mm256_and_ps(_mm256_sub_ps(u, right_u), abs_mask), t, _CMP_GT_OQ),
+        _mm256_cmp_ps(_mm256_and_ps(_mm256_sub_ps(v, right_v), abs_mask), t, _CMP_GT_OQ));
+
+      const __m256i up_id = load8i(up_pixels.object_id + i);
+      const __m256i up_valid = _mm256_andnot_si256(_mm256_cmpeq_epi32(up_id, no_object), valid);
+      const __m256 up_normal = _mm256_or_ps(_mm256_cmp_ps(_mm256_and_ps(_mm256_sub_ps(u, up_u), abs_mask), t, _CMP_GT_OQ),
+        _mm256_cmp_ps(_mm256_and_ps(_mm256_sub_ps(v, up_v), abs_mask), t, _CMP_GT_OQ));
+
+      __m256i f = _mm256_and_si256(_mm256_and_si256(right_valid, _mm256_castps_si256(right_normal)), _mm256_set1_epi32(SIMD_EDGE_NORMAL_RIGHT));
+      f = _mm256_or_si256(f, _mm256_and_si256(_mm256_and_si256(up_valid, _mm256_castps_si256(up_normal)), _mm256_set1_epi32(SIMD_EDGE_NORMAL_UP)));
+      f = _mm256_or_si256(f, _mm256_and_si256(_mm256_andnot_si256(_mm256_cmpeq_epi32(right_id, id), right_valid), _mm256_set1_epi32(SIMD_EDGE_OBJECT_RIGHT)));
+      f = _mm256_or_si256(f, _mm256_and_si256(_mm256_andnot_si256(_mm256_cmpeq_epi32(up_id, id), up_valid), _mm256_set1_epi32(SIMD_EDGE_OBJECT_UP)));
+      const __m128i f16 = _mm_packus_epi32(_mm256_castsi256_si128(f), _mm256_extracti128_si256(f, 1));
+      _mm_storel_epi64((__m128i*)(flags + i), _mm_packus_epi16(f16, f16));
+      }
+    edge_row_scalar(flags, pixels, up_pixels, i, nr_of_pixels, threshold);
+    }
+
+  inline __m256 edl_log2(__m256 x)
+    {
+    const __m256i bits = _mm256_castps_si256(x);
+    const __m256 e = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(127)));
+    const __m256 m = _mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(0x007fffff)), _mm256_set1_epi32(0x3f800000)));
+    __m256 p = _mm256_add_ps(_mm256_set1_ps(edl_log2_c3), _mm256_mul_ps(m, _mm256_set1_ps(edl_log2_c4)));
+    p = _mm256_add_ps(_mm256_set1_ps(edl_log2_c2), _mm256_mul_ps(m, p));
+    p = _mm256_add_ps(_mm256_set1_ps(edl_log2_c1), _mm256_mul_ps(m, p));
+    p = _mm256_add_ps(_mm256_set1_ps(edl_log2_c0), _mm256_mul_ps(m, p));
+    return _mm256_add_ps(e, p);
+    }
+
+  inline __m256 edl_exp2(__m256 x)
+    {
+    x = _mm256_max_ps(x, _mm256_set1_ps(-126.f));
+    const __m256 xi = _mm256_floor_ps(x);
+    const __m256 f = _mm256_sub_ps(x, xi);
+    __m256 p = _mm256_add_ps(_mm256_set1_ps(edl_exp2_c2), _mm256_mul_ps(f, _mm256_set1_ps(edl_exp2_c3)));
+    p = _mm256_add_ps(_mm256_set1_ps(edl_exp2_c1), _mm256_mul_ps(f, p));
+    p = _mm256_add_ps(_mm256_set1_ps(1.f), _mm256_mul_ps(f, p));
+    return _mm256_castsi256_ps(_mm256_add_epi32(_mm256_castps_si256(p), _mm256_slli_epi32(_mm256_cvttps_epi32(xi), 23)));
+    }
+
+  void edl_row(uint32_t* out, const simd_edl& e, uint32_t nr_of_pixels)
+    {
+    const uint32_t r = e.radius;
+    if (nr_of_pixels <= 2 * r)
+      {
+      edl_row_scalar(out, e, 0, nr_of_pixels, nr_of_pixels);
+      return;
+      }
+    edl_row_scalar(out, e, 0, r, nr_of_pixels);
+    const __m256 one = _mm256_set1_ps(1.f);
+    const __m256 max_ratio = _mm256_set1_ps(edl_max_ratio);
+    const __m256 k = _mm256_set1_ps(edl_exponent_scale(e.strength));
+    const __m256i key = _mm256_set1_epi32((int)e.db_key);
+    const __m256i byte_mask = _mm256_set1_epi32(0xff);
+    const uint32_t last = nr_of_pixels - r;
+    uint32_t i = r;
+    for (; i + 8 <= last; i += 8)
+      {
+      const __m256 z = _mm256_loadu_ps(e.z + i);
+      const __m256i valid = _mm256_and_si256(_mm256_cmpeq_epi32(_mm256_srli_epi32(load8i(e.db_id + i), 29), key), _mm256_castps_si256(_mm256_cmp_ps(z, _mm256_setzero_ps(), _CMP_GT_OQ)));
+      if (!_mm256_movemask_ps(_mm256_castsi256_ps(valid)))
+        continue;
+      const __m256 inv_z = _mm256_div_ps(one, z);
+      const float* neighbours[8] = { e.z + i - r, e.z + i + r, e.z_up + i - r, e.z_up + i, e.z_up + i + r, e.z_down + i - r, e.z_down + i, e.z_down + i + r };
+      __m256 product = one;
+      for (const float* n : neighbours)
+        product = _mm256_mul_ps(product, _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(n), inv_z), one), max_ratio));
+      const __m256 shade = edl_exp2(_mm256_mul_ps(k, edl_log2(product)));
+      const __m256i s = _mm256_cvttps_epi32(_mm256_mul_ps(shade, _mm256_set1_ps(256.f)));
+      const __m256i clr = _mm256_loadu_si256((const __m256i*)(out + i));
+      const __m256i red = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_and_si256(clr, byte_mask), s), 8);
+      const __m256i green = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_and_si256(_mm256_srli_epi32(clr, 8), byte_mask), s), 8);
+      const __m256i blue = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_and_si256(_mm256_srli_epi32(clr, 16), byte_mask), s), 8);
+      const __m256i rgb = _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(clr, _mm256_set1_epi32((int)0xff000000)), _mm256_slli_epi32(blue, 16)), _mm256_or_si256(_mm256_slli_epi32(green, 8), red));
+      _mm256_storeu_si256((__m256i*)(out + i), _mm256_blendv_epi8(clr, rgb, valid));
+      }
+    edl_row_scalar(out, e, i, nr_of_pixels, nr_of_pixels);
+    }
+
+  }
+
+void init_simd_kernels_avx2(simd_kernels& k)
+  {
+  k.name = "AVX2";
+  k.wbvh8_closest_hit = &wbvh8_closest_hit;
+  k.wbvh8_any_hit = &wbvh8_any_hit;
+  k.wbvh8_all_hits = &wbvh8_all_hits;
+  k.shade_row = &shade_row;
+  k.splat_depth_row = &splat_depth_row;
+  k.copy_row = &copy_row;
+  k.edge_row = &edge_row;
+  k.edl_row = &edl_row;
+  }
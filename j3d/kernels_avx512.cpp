@@ -0,0 +1,225 @@
+// This file is compiled with AVX-512 (F and VL). Only include simd_kernels_impl.h and intrinsics here.
+#include "simd_kernels_impl.h"
+
+namespace
+  {
+
+  inline __m512i load16i(const uint32_t* p)
+    {
+    return _mm512_loadu_si512((const void*)p);
+    }
+
+  inline void decode_normals(__m512& u, __m512& v, const uint32_t* normal)
+    {
+    const __m512i n = load16i(normal);
+    const __m512 scale = _mm512_set1_ps(g_buffer_normal_scale);
+    u = _mm512_mul_ps(_mm512_cvtepi32_ps(_mm512_srai_epi32(_mm512_slli_epi32(n, 16), 16)), scale);
+    v = _mm512_mul_ps(_mm512_cvtepi32_ps(_mm512_srai_epi32(n, 16)), scale);
+    }
+
+  void shade_row(uint32_t* out, const simd_g_buffer_span& pixels, uint32_t nr_of_pixels, const simd_matcap& m, int shading)
+    {
+    const __m512 one = _mm512_set1_ps(1.f);
+    const __m512 half = _mm512_set1_ps(0.5f);
+    const __m512 width_minus_one = _mm512_set1_ps((float)(m.width - 1));
+    const __m512 height_minus_one = _mm512_set1_ps((float)(m.height - 1));
+    const __m512i stride = _mm512_set1_epi32((int)m.stride);
+    const __m512i byte_mask = _mm512_set1_epi32(0xff);
+    const __m512i alpha = _mm512_set1_epi32((int)0xff000000);
+    const __m512i quarter_mask = _mm512_set1_epi32(0x003f3f3f);
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i bit0 = _mm512_set1_epi32(1);
+    const __m512i bit1 = _mm512_set1_epi32(2);
+
+    uint32_t i = 0;
+    for (; i + 16 <= nr_of_pixels; i += 16)
+      {
+      const __m512i object_id = load16i(pixels.object_id + i);
+      const __mmask16 valid = _mm512_cmpneq_epi32_mask(object_id, _mm512_set1_epi32(-1));
+      if (!valid)
+        continue;
+      const __m512i mark_rgb = load16i(pixels.color + i);
+      const __m512i mark = _mm512_and_si512(mark_rgb, byte_mask);
+      __m512 u, v;
+      decode_normals(u, v, pixels.normal + i);
+      const __mmask16 colored = _mm512_test_epi32_mask(mark, bit1);
+      const __mmask16 matcap_lanes = valid & ~colored;
+
+      __m512i clr = zero;
+      if (matcap_lanes)
+        {
+        const __m512 fu = _mm512_roundscale_ps(_mm512_add_ps(half, _mm512_mul_ps(_mm512_mul_ps(_mm512_add_ps(u, one), width_minus_one), half)), _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+        const __m512 fv = _mm512_roundscale_ps(_mm512_add_ps(half, _mm512_mul_ps(_mm512_mul_ps(_mm512_sub_ps(one, v), height_minus_one), half)), _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+        const __m512i index = _mm512_add_epi32(_mm512_mullo_epi32(_mm512_cvttps_epi32(fv), stride), _mm512_cvttps_epi32(fu));
+        clr = _mm512_mask_i32gather_epi32(zero, matcap_lanes, index, m.pixels, 4);
+        const __mmask16 shadow = _mm512_test_epi32_mask(mark, mark);
+        const __m512i dark = _mm512_or_si512(alpha, _mm512_and_si512(_mm512_srli_epi32(clr, 2), quarter_mask));
+        clr = _mm512_mask_blend_epi32(shadow, clr, dark);
+        }
+      if (valid & colored)
+        {
+        __m512i r = _mm512_and_si512(_mm512_srli_epi32(mark_rgb, 8), byte_mask);
+        __m512i g = _mm512_and_si512(_mm512_srli_epi32(mark_rgb, 16), byte_mask);
+        __m512i b = _mm512_srli_epi32(mark_rgb, 24);
+        const __mmask16 in_shadow = _mm512_test_epi32_mask(mark, bit0);
+        if (shading)
+          {
+          const __m512 w = _mm512_sqrt_ps(_mm512_sub_ps(_mm512_sub_ps(one, _mm512_mul_ps(u, u)), _mm512_mul_ps(v, v)));
+          const __m512 occ = _mm512_mask_blend_ps(in_shadow, one, _mm512_set1_ps(0.3f));
+          const __m512 dif = _mm512_mul_ps(_mm512_min_ps(_mm512_max_ps(w, _mm512_setzero_ps()), one), occ);
+          r = _mm512_cvttps_epi32(_mm512_mul_ps(_mm512_cvtepi32_ps(r), dif));
+          g = _mm512_cvttps_epi32(_mm512_mul_ps(_mm512_cvtepi32_ps(g), dif));
+          b = _mm512_cvttps_epi32(_mm512_mul_ps(_mm512_cvtepi32_ps(b), dif));
+          }
+        else
+          {
+          r = _mm512_mask_srli_epi32(r, in_shadow, r, 2);
+          g = _mm512_mask_srli_epi32(g, in_shadow, g, 2);
+          b = _mm512_mask_srli_epi32(b, in_shadow, b, 2);
+          }
+        const __m512i rgb = _mm512_or_si512(_mm512_or_si512(alpha, _mm512_slli_epi32(b, 16)), _mm512_or_si512(_mm512_slli_epi32(g, 8), r));
+        clr = _mm512_mask_blend_epi32(colored, clr, rgb);
+        }
+      _mm512_mask_storeu_epi32(out + i, valid, clr);
+      }
+    shade_row_scalar(out, pixels, i, nr_of_pixels, m, shading);
+    }
+
+  void splat_depth_row(float* z, const simd_g_buffer_span& pixels, uint32_t nr_of_pixels)
+    {
+    const __m512 one = _mm512_set1_ps(1.f);
+    uint32_t i = 0;
+    for (; i + 16 <= nr_of_pixels; i += 16)
+      {
+      const __m512i db_id = load16i(pixels.db_id + i);
+      const __m512 depth = _mm512_loadu_ps(pixels.depth + i);
+      const __mmask16 has_object = _mm512_test_epi32_mask(db_id, db_id);
+      _mm512_storeu_ps(z + i, _mm512_maskz_div_ps(has_object, one, depth));
+      }
+    splat_depth_row_scalar(z, pixels, i, nr_of_pixels);
+    }
+
+  void copy_row(uint32_t* dest, const uint32_t* src, uint32_t nr_of_pixels)
+    {
+    uint32_t i = 0;
+    for (; i + 16 <= nr_of_pixels; i += 16)
+      _mm512_storeu_si512((void*)(dest + i), _mm512_loadu_si512((const void*)(src + i)));
+    for (; i < nr_of_pixels; ++i)
+      dest[i] = src[i];
+    }
+
+  void edge_row(uint8_t* flags, const simd_g_buffer_span& pixels, const simd_g_buffer_span& up_pixels, uint32_t nr_of_pixels, float threshold)
+    {
+    const __m512i no_object = _mm512_set1_epi32(-1);
+    const __m512 t = _mm512_set1_ps(threshold);
+    const __m512i zero = _mm512_setzero_si512();
+    uint32_t i = 0;
+    for (; i + 16 <= nr_of_pixels; i += 16)
+      {
+      const __m512i id = load16i(pixels.object_id + i);
+      const __mmask16 valid = _mm512_cmpneq_epi32_mask(id, no_object);
+      if (!valid)
+        {
+        _mm_storeu_si128((__m128i*)(flags + i), _mm_setzero_si128());
+        continue;
+        }
+      __m512 u, v, right_u, right_v, up_u, up_v;
+      decode_normals(u, v, pixels.normal + i);
+      decode_normals(right_u, right_v, pixels.normal + i + 1);
+      decode_normals(up_u, up_v, up_pixels.normal + i);
+
+      const __m512i right_id = load16i(pixels.object_id + i + 1);
+      const __mmask16 right_valid = valid & _mm512_cmpneq_epi32_mask(right_id, no_object);
+      const __mmask16 right_normal = _mm512_cmp_ps_mask(_mm512_abs_ps(_mm512_sub_ps(u, right_u)), t, _CMP_GT_OQ) |
+        _mm512_cmp_ps_mask(_mm512_abs_ps(_mm512_sub_ps(v, right_v)), t, _CMP_GT_OQ);
+
+      const __m512i up_id = load16i(up_pixels.object_id + i);
+      const __mmask16 up_valid = valid & _mm512_cmpneq_epi32_mask(up_id, no_object);
+      const __mmask16 up_normal = _mm512_cmp_ps_mask(_mm512_abs_ps(_mm512_sub_ps(u, up_u)), t, _CMP_GT_OQ) |
+        _mm512_cmp_ps_mask(_mm512_abs_ps(_mm512_sub_ps(v, up_v)), t, _CMP_GT_OQ);
+
+      __m512i f = _mm512_mask_mov_epi32(zero, right_valid & right_normal, _mm512_set1_epi32(SIMD_EDGE_NORMAL_RIGHT));
+      f = _mm512_mask_or_epi32(f, up_valid & up_normal, f, _mm512_set1_epi32(SIMD_EDGE_NORMAL_UP));
+      f = _mm512_mask_or_epi32(f, right_valid & _mm512_cmpneq_epi32_mask(right_id, id), f, _mm512_set1_epi32(SIMD_EDGE_OBJECT_RIGHT));
+      f = _mm512_mask_or_epi32(f, up_valid & _mm512_cmpneq_epi32_mask(up_id, id), f, _mm512_set1_epi32(SIMD_EDGE_OBJECT_UP));
+      _mm_storeu_si128((__m128i*)(flags + i), _mm512_cvtepi32_epi8(f));
+      }
+    edge_row_scalar(flags, pixels, up_pixels, i, nr_of_pixels, threshold);
+    }
+
+  inline __m512 edl_log2(__m512 x)
+    {
+    const __m512i bits = _mm512_castps_si512(x);
+    const __m512 e = _mm512_cvtepi32_ps(_mm512_sub_epi32(_mm512_srli_epi32(bits, 23), _mm512_set1_epi32(127)));
+    const __m512 m = _mm512_castsi512_ps(_mm512_or_si512(_mm512_and_si512(bits, _mm512_set1_epi32(0x007fffff)), _mm512_set1_epi32(0x3f800000)));
+    __m512 p = _mm512_add_ps(_mm512_set1_ps(edl_log2_c3), _mm512_mul_ps(m, _mm512_set1_ps(edl_log2_c4)));
+    p = _mm512_add_ps(_mm512_set1_ps(edl_log2_c2), _mm512_mul_ps(m, p));
+    p = _mm512_add_ps(_mm512_set1_ps(edl_log2_c1), _mm512_mul_ps(m, p));
+    p = _mm512_add_ps(_mm512_set1_ps(edl_log2_c0), _mm512_mul_ps(m, p));
+    return _mm512_add_ps(e, p);
+    }
+
+  inline __m512 edl_exp2(__m512 x)
+    {
+    x = _mm512_max_ps(x, _mm512_set1_ps(-126.f));
+    const __m512 xi = _mm512_roundscale_ps(x, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+    const __m512 f = _mm512_sub_ps(x, xi);
+    __m512 p = _mm512_add_ps(_mm512_set1_ps(edl_exp2_c2), _mm512_mul_ps(f, _mm512_set1_ps(edl_exp2_c3)));
+    p = _mm512_add_ps(_mm512_set1_ps(edl_exp2_c1), _mm512_mul_ps(f, p));
+    p = _mm512_add_ps(_mm512_set1_ps(1.f), _mm512_mul_ps(f, p));
+    return _mm512_castsi512_ps(_mm512_add_epi32(_mm512_castps_si512(p), _mm512_slli_epi32(_mm512_cvttps_epi32(xi), 23)));
+    }
+
+  void edl_row(uint32_t* out, const simd_edl& e, uint32_t nr_of_pixels)
+    {
+    const uint32_t r = e.radius;
+    if (nr_of_pixels <= 2 * r)
+      {
+      edl_row_scalar(out, e, 0, nr_of_pixels, nr_of_pixels);
+      return;
+      }
+    edl_row_scalar(out, e, 0, r, nr_of_pixels);
+    const __m512 one = _mm512_set1_ps(1.f);
+    const __m512 max_ratio = _mm512_set1_ps(edl_max_ratio);
+    const __m512 k = _mm512_set1_ps(edl_exponent_scale(e.strength));
+    const __m512i key = _mm512_set1_epi32((int)e.db_key);
+    const __m512i byte_mask = _mm512_set1_epi32(0xff);
+    const uint32_t last = nr_of_pixels - r;
+    uint32_t i = r;
+    for (; i + 16 <= last; i += 16)
+      {
+      const __m512 z = _mm512_loadu_ps(e.z + i);
+      const __mmask16 valid = _mm512_cmpeq_epi32_mask(_mm512_srli_epi32(load16i(e.db_id + i), 29), key) & _mm512_cmp_ps_mask(z, _mm512_setzero_ps(), _CMP_GT_OQ);
+      if (!valid)
+        continue;
+      const __m512 inv_z = _mm512_div_ps(one, z);
+      const float* neighbours[8] = { e.z + i - r, e.z + i + r, e.z_up + i - r, e.z_up + i, e.z_up + i + r, e.z_down + i - r, e.z_down + i, e.z_down + i + r };
+      __m512 product = one;
+      for (const float* n : neighbours)
+        product = _mm512_mul_ps(product, _mm512_min_ps(_mm512_max_ps(_mm512_mul_ps(_mm512_loadu_ps(n), inv_z), one), max_ratio));
+      const __m512 shade = edl_exp2(_mm512_mul_ps(k, edl_log2(product)));
+      const __m512i s = _mm512_cvttps_epi32(_mm512_mul_ps(shade, _mm512_set1_ps(256.f)));
+      const __m512i clr = load16i(out + i);
+      const __m512i red = _mm512_srli_epi32(_mm512_mullo_epi32(_mm512_and_si512(clr, byte_mask), s), 8);
+      const __m512i green = _mm512_srli_epi32(_mm512_mullo_epi32(_mm512_and_si512(_mm512_srli_epi32(clr, 8), byte_mask), s), 8);
+      const __m512i blue = _mm512_srli_epi32(_mm512_mullo_epi32(_mm512_and_si512(_mm512_srli_epi32(clr, 16), byte_mask), s), 8);
+      const __m512i rgb = _mm512_or_si512(_mm512_or_si512(_mm512_and_si512(clr, _mm512_set1_epi32((int)0xff000000)), _mm512_slli_epi32(blue, 16)), _mm512_or_si512(_mm512_slli_epi32(green, 8), red));
+      _mm512_mask_storeu_epi32(out + i, valid, rgb);
+      }
+    edl_row_scalar(out, e, i, nr_of_pixels, nr_of_pixels);
+    }
+
+  }
+
+void init_simd_kernels_avx512(simd_kernels& k)
+  {
+  k.name = "AVX-512";
+  k.wbvh8_closest_hit = &wbvh8_closest_hit;
+  k.wbvh8_any_hit = &wbvh8_any_hit;
+  k.wbvh8_all_hits = &wbvh8_all_hits;
+  k.shade_row = &shade_row;
+  k.splat_depth_row = &splat_depth_row;
+  k.copy_row = &copy_row;
+  k.edge_row = &edge_row;
+  k.edl_row = &edl_row;
+  }
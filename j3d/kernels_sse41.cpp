@@ -0,0 +1,242 @@
+// This file is compiled with SSE4.1. Only include simd_kernels_impl.h and intrinsics here.
+#include "simd_kernels_impl.h"
+
+namespace
+  {
+
+  inline __m128i load4(const uint32_t* p)
+    {
+    return _mm_loadu_si128((const __m128i*)p);
+    }
+
+  inline void decode_normals(__m128& u, __m128& v, const uint32_t* normal)
+    {
+    const __m128i n = load4(normal);
+    const __m128 scale = _mm_set1_ps(g_buffer_normal_scale);
+    u = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_slli_epi32(n, 16), 16)), scale);
+    v = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(n, 16)), scale);
+    }
+
+  inline __m128i gather4_masked(const uint32_t* base, __m128i index, int mask)
+    {
+    alignas(16) uint32_t idx[4];
+    alignas(16) uint32_t res[4] = { 0, 0, 0, 0 };
+    _mm_store_si128((__m128i*)idx, index);
+    for (int lane = 0; lane < 4; ++lane)
+      {
+      if (mask & (1 << lane))
+        res[lane] = base[idx[lane]];
+      }
+    return _mm_load_si128((const __m128i*)res);
+    }
+
+  void shade_row(uint32_t* out, const simd_g_buffer_span& pixels, uint32_t nr_of_pixels, const simd_matcap& m, int shading)
+    {
+    const __m128 one = _mm_set1_ps(1.f);
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 width_minus_one = _mm_set1_ps((float)(m.width - 1));
+    const __m128 height_minus_one = _mm_set1_ps((float)(m.height - 1));
+    const __m128i stride = _mm_set1_epi32((int)m.stride);
+    const __m128i no_object = _mm_set1_epi32(-1);
+    const __m128i byte_mask = _mm_set1_epi32(0xff);
+    const __m128i alpha = _mm_set1_epi32((int)0xff000000);
+    const __m128i quarter_mask = _mm_set1_epi32(0x003f3f3f);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bit0 = _mm_set1_epi32(1);
+    const __m128i bit1 = _mm_set1_epi32(2);
+
+    uint32_t i = 0;
+    for (; i + 4 <= nr_of_pixels; i += 4)
+      {
+      const __m128i object_id = load4(pixels.object_id + i);
+      const __m128i valid = _mm_xor_si128(_mm_cmpeq_epi32(object_id, no_object), no_object);
+      const int valid_mask = _mm_movemask_ps(_mm_castsi128_ps(valid));
+      if (!valid_mask)
+        continue;
+      const __m128i mark_rgb = load4(pixels.color + i);
+      const __m128i mark = _mm_and_si128(mark_rgb, byte_mask);
+      __m128 u, v;
+      decode_normals(u, v, pixels.normal + i);
+      const __m128i colored = _mm_cmpeq_epi32(_mm_and_si128(mark, bit1), bit1);
+      const int matcap_mask = valid_mask & ~_mm_movemask_ps(_mm_castsi128_ps(colored));
+
+      __m128i clr = zero;
+      if (matcap_mask)
+        {
+        const __m128 fu = _mm_floor_ps(_mm_add_ps(half, _mm_mul_ps(_mm_mul_ps(_mm_add_ps(u, one), width_minus_one), half)));
+        const __m128 fv = _mm_floor_ps(_mm_add_ps(half, _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(one, v), height_minus_one), half)));
+        const __m128i index = _mm_add_epi32(_mm_mullo_epi32(_mm_cvttps_epi32(fv), stride), _mm_cvttps_epi32(fu));
+        clr = gather4_masked(m.pixels, index, matcap_mask);
+        const __m128i shadow = _mm_xor_si128(_mm_cmpeq_epi32(mark, zero), no_object);
+        const __m128i dark = _mm_or_si128(alpha, _mm_and_si128(_mm_srli_epi32(clr, 2), quarter_mask));
+        clr = _mm_blendv_epi8(clr, dark, shadow);
+        }
+      if (valid_mask & ~matcap_mask)
+        {
+        __m128i r = _mm_and_si128(_mm_srli_epi32(mark_rgb, 8), byte_mask);
+        __m128i g = _mm_and_si128(_mm_srli_epi32(mark_rgb, 16), byte_mask);
+        __m128i b = _mm_srli_epi32(mark_rgb, 24);
+        const __m128i in_shadow = _mm_cmpeq_epi32(_mm_and_si128(mark, bit0), bit0);
+        if (shading)
+          {
+          const __m128 w = _mm_sqrt_ps(_mm_sub_ps(_mm_sub_ps(one, _mm_mul_ps(u, u)), _mm_mul_ps(v, v)));
+          const __m128 occ = _mm_blendv_ps(one, _mm_set1_ps(0.3f), _mm_castsi128_ps(in_shadow));
+          const __m128 dif = _mm_mul_ps(_mm_min_ps(_mm_max_ps(w, _mm_setzero_ps()), one), occ);
+          r = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(r), dif));
+          g = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(g), dif));
+          b = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(b), dif));
+          }
+        else
+          {
+          r = _mm_blendv_epi8(r, _mm_srli_epi32(r, 2), in_shadow);
+          g = _mm_blendv_epi8(g, _mm_srli_epi32(g, 2), in_shadow);
+          b = _mm_blendv_epi8(b, _mm_srli_epi32(b, 2), in_shadow);
+          }
+        const __m128i rgb = _mm_or_si128(_mm_or_si128(alpha, _mm_slli_epi32(b, 16)), _mm_or_si128(_mm_slli_epi32(g, 8), r));
+        clr = _mm_blendv_epi8(clr, rgb, colored);
+        }
+      const __m128i old = _mm_loadu_si128((const __m128i*)(out + i));
+      _mm_storeu_si128((__m128i*)(out + i), _mm_blendv_epi8(old, clr, valid));
+      }
+    shade_row_scalar(out, pixels, i, nr_of_pixels, m, shading);
+    }
+
+  void splat_depth_row(float* z, const simd_g_buffer_span& pixels, uint32_t nr_of_pixels)
+    {
+    const __m128 one = _mm_set1_ps(1.f);
+    uint32_t i = 0;
+    for (; i + 4 <= nr_of_pixels; i += 4)
+      {
+      const __m128i db_id = load4(pixels.db_id + i);
+      const __m128 depth = _mm_loadu_ps(pixels.depth + i);
+      const __m128 has_object = _mm_castsi128_ps(_mm_xor_si128(_mm_cmpeq_epi32(db_id, _mm_setzero_si128()), _mm_set1_epi32(-1)));
+      _mm_storeu_ps(z + i, _mm_and_ps(has_object, _mm_div_ps(one, depth)));
+      }
+    splat_depth_row_scalar(z, pixels, i, nr_of_pixels);
+    }
+
+  void copy_row(uint32_t* dest, const uint32_t* src, uint32_t nr_of_pixels)
+    {
+    uint32_t i = 0;
+    for (; i + 4 <= nr_of_pixels; i += 4)
+      _mm_storeu_si128((__m128i*)(dest + i), _mm_loadu_si128((const __m128i*)(src + i)));
+    for (; i < nr_of_pixels; ++i)
+      dest[i] = src[i];
+    }
+
+  void edge_row(uint8_t* flags, const simd_g_buffer_span& pixels, const simd_g_buffer_span& up_pixels, uint32_t nr_of_pixels, float threshold)
+    {
+    const __m128i no_object = _mm_set1_epi32(-1);
+    const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    const __m128 t = _mm_set1_ps(threshold);
+    uint32_t i = 0;
+    for (; i + 4 <= nr_of_pixels; i += 4)
+      {
+      const __m128i id = load4(pixels.object_id + i);
+      const __m128i valid = _mm_xor_si128(_mm_cmpeq_epi32(id, no_object), no_object);
+      if (!_mm_movemask_ps(_mm_castsi128_ps(valid)))
+        {
+        *(int*)(flags + i) = 0;
+        continue;
+        }
+      __m128 u, v, right_u, right_v, up_u, up_v;
+      decode_normals(u, v, pixels.normal + i);
+      decode_normals(right_u, right_v, pixels.normal + i + 1);
+      decode_normals(up_u, up_v, up_pixels.normal + i);
+
+      const __m128i right_id = load4(pixels.object_id + i + 1);
+      const __m128i right_valid = _mm_andnot_si128(_mm_cmpeq_epi32(right_id, no_object), valid);
+      const __m128 right_normal = _mm_or_ps(_mm_cmpgt_ps(_mm_and_ps(_mm_sub_ps(u, right_u), abs_mask), t),
+        _mm_cmpgt_ps(_mm_and_ps(_mm_sub_ps(v, right_v), abs_mask), t));
+
+      const __m128i up_id = load4(up_pixels.object_id + i);
+      const __m128i up_valid = _mm_andnot_si128(_mm_cmpeq_epi32(up_id, no_object), valid);
+      const __m128 up_normal = _mm_or_ps(_mm_cmpgt_ps(_mm_and_ps(_mm_sub_ps(u, up_u), abs_mask), t),
+        _mm_cmpgt_ps(_mm_and_ps(_mm_sub_ps(v, up_v), abs_mask), t));
+
+      __m128i f = _mm_and_si128(_mm_and_si128(right_valid, _mm_castps_si128(right_normal)), _mm_set1_epi32(SIMD_EDGE_NORMAL_RIGHT));
+      f = _mm_or_si128(f, _mm_and_si128(_mm_and_si128(up_valid, _mm_castps_si128(up_normal)), _mm_set1_epi32(SIMD_EDGE_NORMAL_UP)));
+      f = _mm_or_si128(f, _mm_and_si128(_mm_andnot_si128(_mm_cmpeq_epi32(right_id, id), right_valid), _mm_set1_epi32(SIMD_EDGE_OBJECT_RIGHT)));
+      f = _mm_or_si128(f, _mm_and_si128(_mm_andnot_si128(_mm_cmpeq_epi32(up_id, id), up_valid), _mm_set1_epi32(SIMD_EDGE_OBJECT_UP)));
+      const __m128i f16 = _mm_packus_epi32(f, f);
+      *(int*)(flags + i) = _mm_cvtsi128_si32(_mm_packus_epi16(f16, f16));
+      }
+    edge_row_scalar(flags, pixels, up_pixels, i, nr_of_pixels, threshold);
+    }
+
+  inline __m128 edl_log2(__m128 x)
+    {
+    const __m128i bits = _mm_castps_si128(x);
+    const __m128 e = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(127)));
+    const __m128 m = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x007fffff)), _mm_set1_epi32(0x3f800000)));
+    __m128 p = _mm_add_ps(_mm_set1_ps(edl_log2_c3), _mm_mul_ps(m, _mm_set1_ps(edl_log2_c4)));
+    p = _mm_add_ps(_mm_set1_ps(edl_log2_c2), _mm_mul_ps(m, p));
+    p = _mm_add_ps(_mm_set1_ps(edl_log2_c1), _mm_mul_ps(m, p));
+    p = _mm_add_ps(_mm_set1_ps(edl_log2_c0), _mm_mul_ps(m, p));
+    return _mm_add_ps(e, p);
+    }
+
+  inline __m128 edl_exp2(__m128 x)
+    {
+    x = _mm_max_ps(x, _mm_set1_ps(-126.f));
+    const __m128 xi = _mm_floor_ps(x);
+    const __m128 f = _mm_sub_ps(x, xi);
+    __m128 p = _mm_add_ps(_mm_set1_ps(edl_exp2_c2), _mm_mul_ps(f, _mm_set1_ps(edl_exp2_c3)));
+    p = _mm_add_ps(_mm_set1_ps(edl_exp2_c1), _mm_mul_ps(f, p));
+    p = _mm_add_ps(_mm_set1_ps(1.f), _mm_mul_ps(f, p));
+    return _mm_castsi128_ps(_mm_add_epi32(_mm_castps_si128(p), _mm_slli_epi32(_mm_cvttps_epi32(xi), 23)));
+    }
+
+  void edl_row(uint32_t* out, const simd_edl& e, uint32_t nr_of_pixels)
+    {
+    const uint32_t r = e.radius;
+    if (nr_of_pixels <= 2 * r)
+      {
+      edl_row_scalar(out, e, 0, nr_of_pixels, nr_of_pixels);
+      return;
+      }
+    edl_row_scalar(out, e, 0, r, nr_of_pixels);
+    const __m128 one = _mm_set1_ps(1.f);
+    const __m128 max_ratio = _mm_set1_ps(edl_max_ratio);
+    const __m128 k = _mm_set1_ps(edl_exponent_scale(e.strength));
+    const __m128i key = _mm_set1_epi32((int)e.db_key);
+    const __m128i byte_mask = _mm_set1_epi32(0xff);
+    const uint32_t last = nr_of_pixels - r;
+    uint32_t i = r;
+    for (; i + 4 <= last; i += 4)
+      {
+      const __m128 z = _mm_loadu_ps(e.z + i);
+      const __m128i valid = _mm_and_si128(_mm_cmpeq_epi32(_mm_srli_epi32(load4(e.db_id + i), 29), key), _mm_castps_si128(_mm_cmpgt_ps(z, _mm_setzero_ps())));
+      if (!_mm_movemask_ps(_mm_castsi128_ps(valid)))
+        continue;
+      const __m128 inv_z = _mm_div_ps(one, z);
+      const float* neighbours[8] = { e.z + i - r, e.z + i + r, e.z_up + i - r, e.z_up + i, e.z_up + i + r, e.z_down + i - r, e.z_down + i, e.z_down + i + r };
+      __m128 product = one;
+      for (const float* n : neighbours)
+        product = _mm_mul_ps(product, _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(n), inv_z), one), max_ratio));
+      const __m128 shade = edl_exp2(_mm_mul_ps(k, edl_log2(product)));
+      const __m128i s = _mm_cvttps_epi32(_mm_mul_ps(shade, _mm_set1_ps(256.f)));
+      const __m128i clr = _mm_loadu_si128((const __m128i*)(out + i));
+      const __m128i red = _mm_srli_epi32(_mm_mullo_epi32(_mm_and_si128(clr, byte_mask), s), 8);
+      const __m128i green = _mm_srli_epi32(_mm_mullo_epi32(_mm_and_si128(_mm_srli_epi32(clr, 8), byte_mask), s), 8);
+      const __m128i blue = _mm_srli_epi32(_mm_mullo_epi32(_mm_and_si128(_mm_srli_epi32(clr, 16), byte_mask), s), 8);
+      const __m128i rgb = _mm_or_si128(_mm_or_si128(_mm_and_si128(clr, _mm_set1_epi32((int)0xff000000)), _mm_slli_epi32(blue, 16)), _mm_or_si128(_mm_slli_epi32(green, 8), red));
+      _mm_storeu_si128((__m128i*)(out + i), _mm_blendv_epi8(clr, rgb, valid));
+      }
+    edl_row_scalar(out, e, i, nr_of_pixels, nr_of_pixels);
+    }
+
+  }
+
+void init_simd_kernels_sse41(simd_kernels& k)
+  {
+  k.name = "SSE4.1";
+  k.wbvh8_closest_hit = &wbvh8_closest_hit;
+  k.wbvh8_any_hit = &wbvh8_any_hit;
+  k.wbvh8_all_hits = &wbvh8_all_hits;
+  k.shade_row = &shade_row;
+  k.splat_depth_row = &splat_depth_row;
+  k.copy_row = &copy_row;
+  k.edge_row = &edge_row;
+  k.edl_row = &edl_row;
+  }
@@ -33,6 +33,7 @@ struct mesh
   bool visible;
   double load_time_in_s;
   double acceleration_structure_construction_time_in_s;
+  double bvh_sah_cost;
   };
 
 std::vector<std::pair<std::string, mesh_filetype>> get_valid_mesh_extensions();
@@ -1,5 +1,6 @@
 #include "pc.h"
 #include "io.h"
+#include "pc_stream.h"
 
 #include "jtk/file_utils.h"
 #include "jtk/fitting.h"
@@ -15,6 +16,36 @@
 
 using namespace jtk;
 
+namespace
+  {
+
+  template <class T>
+  std::vector<T> to_original_order(const std::vector<T>& values, const std::vector<uint32_t>& ids)
+    {
+    if (values.size() != ids.size())
+      return values;
+    std::vector<T> original(values.size());
+    for (size_t i = 0; i < ids.size(); ++i)
+      original[ids[i]] = values[i];
+    return original;
+    }
+
+  // The points of p in the order of the file they came from, so that saving does not shuffle them.
+  pc in_original_order(const pc& p)
+    {
+    pc original;
+    original.vertices = to_original_order(p.vertices, p.original_ids);
+    original.normals = to_original_order(p.normals, p.original_ids);
+    original.vertex_colors = to_original_order(p.vertex_colors, p.original_ids);
+    original.cs = p.cs;
+    original.visible = p.visible;
+    original.load_time_in_s = p.load_time_in_s;
+    original.acceleration_structure_construction_time_in_s = p.acceleration_structure_construction_time_in_s;
+    return original;
+    }
+
+  }
+
 std::vector<std::pair<std::string, pc_filetype>> get_valid_pc_extensions()
   {
   std::vector<std::pair<std::string, pc_filetype>> extensions;
@@ -25,6 +56,7 @@ std::vector<std::pair<std::string, pc_filetype>> get_valid_pc_extensions()
   extensions.emplace_back(std::string("xyz"), pc_filetype::PC_FILETYPE_XYZ);
   extensions.emplace_back(std::string("trc"), pc_filetype::PC_FILETYPE_TRC);
   extensions.emplace_back(std::string("off"), pc_filetype::PC_FILETYPE_OFF);
+  extensions.emplace_back(std::string("pco"), pc_filetype::PC_FILETYPE_PCO);
 
   return extensions;
   }
@@ -106,6 +138,13 @@ bool read_from_file(pc& point_cloud, const std::string& filename)
           return false;
         break;
         }
+        case pc_filetype::PC_FILETYPE_PCO:
+        {
+        point_cloud.stream = std::make_shared<pc_stream>();
+        if (!point_cloud.stream->open(filename))
+          return false;
+        break;
+        }
         }
 
       point_cloud.cs = get_identity();
@@ -119,6 +158,8 @@ bool read_from_file(pc& point_cloud, const std::string& filename)
 
 bool vertices_to_csv(const pc& m, const std::string& filename)
   {
+  if (!m.original_ids.empty())
+    return vertices_to_csv(in_original_order(m), filename);
   std::vector<std::vector<std::string>> data;
   for (const auto& vertex : m.vertices)
     {
@@ -136,6 +177,8 @@ bool write_to_file(const pc& p, const std::string& filename)
   std::string ext = jtk::get_extension(filename);
   if (ext.empty())
     return false;
+  if (!p.original_ids.empty())
+    return write_to_file(in_original_order(p), filename);
   #ifdef _WIN32
   std::wstring wfilename = jtk::convert_string_to_wstring(filename);
   #else
@@ -17,17 +17,23 @@ enum class pc_filetype
   PC_FILETYPE_PTS,
   PC_FILETYPE_XYZ,
   PC_FILETYPE_TRC,
-  PC_FILETYPE_OFF
+  PC_FILETYPE_OFF,
+  PC_FILETYPE_PCO
   };
 
+class pc_stream;
+
 struct pc
   {
   std::vector<jtk::vec3<float>> vertices;  
   std::vector<jtk::vec3<float>> normals;
   std::vector<uint32_t> vertex_colors;  
+  std::vector<uint32_t> original_ids; // if not empty, vertices[i] is point original_ids[i] of the file, as the octree reorders the points
   jtk::float4x4 cs;
   bool visible;
   double load_time_in_s;
+  double acceleration_structure_construction_time_in_s;
+  std::shared_ptr<pc_stream> stream; // set if the points stay on disk, the vectors above are empty then
   };
 
 bool read_from_file(pc& point_cloud, const std::string& filename);
@@ -0,0 +1,163 @@
+#include "pc_octree.h"
+
+#include <jtk/concurrency.h>
+
+#include <algorithm>
+#include <cstring>
+
+using namespace jtk;
+
+namespace
+  {
+
+  const uint32_t pc_octree_leaf_size = 8192;
+  const uint32_t pc_octree_max_depth = 20;
+  const uint32_t pc_octree_parallel_size = 1 << 20; // subtrees with more points build their children in parallel
+
+  inline uint32_t grid_coordinate(float x, float min_x, float scale)
+    {
+    const float c = (x - min_x) * scale;
+    return c <= 0.f ? 0 : (c >= (float)(pc_octree_grid - 1) ? pc_octree_grid - 1 : (uint32_t)c);
+    }
+
+  /*
+  Builds the subtree over the points ids[first], ..., ids[last - 1] in the cube at min_bb with edge size, and returns
+  its nodes with the root first. The ids are reordered in place: the subsample of the root, then the subtree of every octant.
+  */
+  std::vector<pc_octree_node> build_subtree(uint32_t* ids, uint32_t first, uint32_t last, const vec3<float>& min_bb, float size, uint32_t depth, const vec3<float>* vertices)
+    {
+    std::vector<pc_octree_node> nodes(1);
+    pc_octree_node& root = nodes[0];
+    root.min_bb = min_bb;
+    root.size = size;
+    root.first = first;
+    root.count = last - first;
+    root.subtree_count = last - first;
+    memset(root.children, 0, sizeof(root.children));
+    if (last - first <= pc_octree_leaf_size || depth >= pc_octree_max_depth)
+      return nodes;
+
+    // subsample: the first point of every grid cell stays in the node
+    const uint32_t n = last - first;
+    const float scale = (float)pc_octree_grid / size;
+    std::vector<uint8_t> cells(pc_octree_grid * pc_octree_grid * pc_octree_grid, 0);
+    std::vector<uint32_t> sorted(n);
+    uint32_t nr_of_samples = 0;
+    uint32_t counts[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+    std::vector<uint8_t> octant(n);
+    const uint32_t half = pc_octree_grid / 2;
+    for (uint32_t i = 0; i < n; ++i)
+      {
+      const vec3<float>& v = vertices[ids[first + i]];
+      const uint32_t x = grid_coordinate(v[0], min_bb[0], scale);
+      const uint32_t y = grid_coordinate(v[1], min_bb[1], scale);
+      const uint32_t z = grid_coordinate(v[2], min_bb[2], scale);
+      uint8_t& cell = cells[(z * pc_octree_grid + y) * pc_octree_grid + x];
+      if (!cell)
+        {
+        cell = 1;
+        octant[i] = 8;
+        sorted[nr_of_samples++] = ids[first + i];
+        }
+      else
+        {
+        octant[i] = (uint8_t)((x >= half ? 1 : 0) | (y >= half ? 2 : 0) | (z >= half ? 4 : 0));
+        ++counts[octant[i]];
+        }
+      }
+    uint32_t offsets[8];
+    offsets[0] = nr_of_samples;
+    for (int o = 1; o < 8; ++o)
+      offsets[o] = offsets[o - 1] + counts[o - 1];
+    uint32_t child_first[8];
+    memcpy(child_first, offsets, sizeof(offsets));
+    for (uint32_t i = 0; i < n; ++i)
+      {
+      if (octant[i] < 8)
+        sorted[offsets[octant[i]]++] = ids[first + i];
+      }
+    memcpy(ids + first, sorted.data(), n * sizeof(uint32_t));
+    root.count = nr_of_samples;
+
+    std::vector<pc_octree_node> children[8];
+    auto build_child = [&](uint32_t o)
+      {
+      if (counts[o] == 0)
+        return;
+      const float child_size = size / 2.f;
+      vec3<float> child_min_bb(min_bb[0] + ((o & 1) ? child_size : 0.f), min_bb[1] + ((o & 2) ? child_size : 0.f), min_bb[2] + ((o & 4) ? child_size : 0.f));
+      children[o] = build_subtree(ids, first + child_first[o], first + child_first[o] + counts[o], child_min_bb, child_size, depth + 1, vertices);
+      };
+    if (n > pc_octree_parallel_size)
+      parallel_for(uint32_t(0), uint32_t(8), build_child);
+    else
+      {
+      for (uint32_t o = 0; o < 8; ++o)
+        build_child(o);
+      }
+    for (uint32_t o = 0; o < 8; ++o)
+      {
+      if (children[o].empty())
+        continue;
+      const uint32_t base = (uint32_t)nodes.size();
+      nodes[0].children[o] = base;
+      for (const auto& child : children[o])
+        {
+        nodes.push_back(child);
+        for (uint32_t& c : nodes.back().children)
+          {
+          if (c)
+            c += base;
+          }
+        }
+      }
+    return nodes;
+    }
+
+  template <class T>
+  void permute(std::vector<T>& values, const std::vector<uint32_t>& ids)
+    {
+    if (values.size() != ids.size())
+      return;
+    std::vector<T> permuted(values.size());
+    parallel_for(uint32_t(0), (uint32_t)ids.size(), [&](uint32_t i)
+      {
+      permuted[i] = values[ids[i]];
+      });
+    values.swap(permuted);
+    }
+
+  }
+
+pc_octree::pc_octree(std::vector<vec3<float>>& vertices, std::vector<vec3<float>>& normals, std::vector<uint32_t>& colors, std::vector<uint32_t>& ids)
+  {
+  const uint32_t nr_of_points = (uint32_t)vertices.size();
+  if (nr_of_points == 0)
+    return;
+  vec3<float> min_bb = vertices[0];
+  vec3<float> max_bb = vertices[0];
+  for (const auto& v : vertices)
+    {
+    for (int j = 0; j < 3; ++j)
+      {
+      min_bb[j] = std::min(min_bb[j], v[j]);
+      max_bb[j] = std::max(max_bb[j], v[j]);
+      }
+    }
+  float size = std::max(std::max(max_bb[0] - min_bb[0], max_bb[1] - min_bb[1]), max_bb[2] - min_bb[2]);
+  if (size <= 0.f)
+    size = 1.f;
+  size *= 1.0001f; // keeps the points at max_bb inside the last grid cell
+
+  std::vector<uint32_t> order(nr_of_points);
+  for (uint32_t i = 0; i < nr_of_points; ++i)
+    order[i] = i;
+  _nodes = build_subtree(order.data(), 0, nr_of_points, min_bb, size, 0, vertices.data());
+  permute(vertices, order);
+  permute(normals, order);
+  permute(colors, order);
+  if (ids.size() == order.size())
+    permute(ids, order);
+  else
+    ids.swap(order);
+  }
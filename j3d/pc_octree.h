@@ -0,0 +1,41 @@
+#pragma once
+
+#include <jtk/vec.h>
+
+#include <stdint.h>
+#include <vector>
+
+struct pc_octree_node
+  {
+  jtk::vec3<float> min_bb; // corner of the cube of the node
+  float size; // edge length of the cube
+  uint32_t first; // the points of the node itself are first, ..., first + count - 1
+  uint32_t count;
+  uint32_t subtree_count; // points of the node and all its descendants, which follow the points of the node
+  uint32_t children[8]; // node index per octant, 0 if the octant is empty
+  };
+
+/*
+Level of detail hierarchy of a point cloud. Every inner node keeps a subsample of its points that is spread evenly
+over its cube, at most one point per cell of a pc_octree_grid^3 grid, and hands the other points to its children.
+Leaves keep all their points. The constructor reorders the points, normals and colors so that the points of every
+node and of every subtree are contiguous, which lets the renderer splat a node as one run of points. The ids are reordered
+alongside, so that ids[i] keeps telling where point i came from; empty ids are taken as 0, 1, 2, ... .
+Rendering the nodes down to some depth thus shows a uniform subsample of the cloud, with a point spacing of about
+size / pc_octree_grid of the deepest nodes.
+*/
+const uint32_t pc_octree_grid = 64;
+
+class pc_octree
+  {
+  public:
+    pc_octree(std::vector<jtk::vec3<float>>& vertices, std::vector<jtk::vec3<float>>& normals, std::vector<uint32_t>& colors, std::vector<uint32_t>& ids);
+
+    const std::vector<pc_octree_node>& nodes() const { return _nodes; }
+
+    // Distance between neighbouring points of the subsample of node i.
+    float spacing(uint32_t i) const { return _nodes[i].size / (float)pc_octree_grid; }
+
+  private:
+    std::vector<pc_octree_node> _nodes;
+  };
@@ -0,0 +1,326 @@
+#include "pc_stream.h"
+#include "pc.h"
+
+#include <jtk/file_utils.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+using namespace jtk;
+
+namespace
+  {
+
+  const char pco_magic[8] = { 'J', '3', 'D', 'P', 'C', 'O', '0', '1' };
+  const uint32_t pco_has_normals = 1;
+  const uint32_t pco_has_colors = 2;
+  const uint32_t pco_header_size = 8 + 4 * 4 + 6 * 4;
+  const uint32_t pco_node_size = 4 * 4 + 3 * 4 + 8 * 4;
+  const uint32_t pc_stream_nr_of_loaders = 2;
+
+  uint64_t point_size(bool normals, bool colors)
+    {
+    return sizeof(vec3<float>) + (normals ? sizeof(vec3<float>) : 0) + (colors ? sizeof(uint32_t) : 0);
+    }
+
+  template <class T>
+  void write_value(std::ofstream& f, T value)
+    {
+    f.write((const char*)&value, sizeof(T));
+    }
+
+  template <class T>
+  T read_value(std::ifstream& f)
+    {
+    T value;
+    f.read((char*)&value, sizeof(T));
+    return value;
+    }
+
+#ifdef _WIN32
+  std::wstring stream_filename(const std::string& filename)
+    {
+    return jtk::convert_string_to_wstring(filename);
+    }
+#else
+  std::string stream_filename(const std::string& filename)
+    {
+    return filename;
+    }
+#endif
+
+  }
+
+pc_stream::pc_stream() : _nr_of_points(0), _has_normals(false), _has_colors(false), _data_offset(0),
+  _frame(0), _memory_in_use(0), _memory_budget((uint64_t)2048 << 20), _stop(false)
+  {
+  }
+
+pc_stream::~pc_stream()
+  {
+    {
+    std::scoped_lock lock(_mut);
+    _stop = true;
+    }
+  _cv.notify_all();
+  for (auto& t : _loaders)
+    t.join();
+  }
+
+bool pc_stream::open(const std::string& filename)
+  {
+  std::ifstream f(stream_filename(filename), std::ios::binary);
+  if (!f.is_open())
+    return false;
+  char magic[8];
+  f.read(magic, 8);
+  if (!f || memcmp(magic, pco_magic, 8) != 0)
+    return false;
+  const uint32_t nr_of_nodes = read_value<uint32_t>(f);
+  _nr_of_points = read_value<uint32_t>(f);
+  const uint32_t flags = read_value<uint32_t>(f);
+  read_value<uint32_t>(f);
+  _has_normals = (flags & pco_has_normals) != 0;
+  _has_colors = (flags & pco_has_colors) != 0;
+  for (int j = 0; j < 3; ++j)
+    _min_bb[j] = read_value<float>(f);
+  for (int j = 0; j < 3; ++j)
+    _max_bb[j] = read_value<float>(f);
+  _nodes.resize(nr_of_nodes);
+  for (auto& n : _nodes)
+    {
+    for (int j = 0; j < 3; ++j)
+      n.min_bb[j] = read_value<float>(f);
+    n.size = read_value<float>(f);
+    n.first = read_value<uint32_t>(f);
+    n.count = read_value<uint32_t>(f);
+    n.subtree_count = read_value<uint32_t>(f);
+    for (auto& c : n.children)
+      c = read_value<uint32_t>(f);
+    }
+  if (!f || nr_of_nodes == 0)
+    return false;
+  // the children follow their parent in depth first order, and the points of every node lie within the file
+  for (uint32_t i = 0; i < nr_of_nodes; ++i)
+    {
+    const pc_octree_node& n = _nodes[i];
+    if ((uint64_t)n.first + n.count > _nr_of_points || (uint64_t)n.first + n.subtree_count > _nr_of_points || n.count > n.subtree_count)
+      return false;
+    if (i > 0 && n.first < _nodes[i - 1].first)
+      return false;
+    for (uint32_t c : n.children)
+      {
+      if (c != 0 && (c <= i || c >= nr_of_nodes))
+        return false;
+      }
+    }
+  _data_offset = (uint64_t)pco_header_size + (uint64_t)nr_of_nodes * pco_node_size;
+  f.seekg(0, std::ios::end);
+  if (!f || (uint64_t)f.tellg() != _data_offset + (uint64_t)_nr_of_points * point_size(_has_normals, _has_colors))
+    return false;
+  _filename = filename;
+  _entries.resize(nr_of_nodes);
+  for (auto& e : _entries)
+    {
+    e.frame = 0;
+    e.requested = false;
+    }
+  for (uint32_t i = 0; i < pc_stream_nr_of_loaders; ++i)
+    _loaders.emplace_back(&pc_stream::_load_loop, this);
+  return true;
+  }
+
+uint64_t pc_stream::_chunk_size(uint32_t node) const
+  {
+  return (uint64_t)_nodes[node].count * point_size(_has_normals, _has_colors);
+  }
+
+void pc_stream::begin_frame()
+  {
+  std::scoped_lock lock(_mut);
+  ++_frame;
+  for (const auto& r : _requests)
+    _entries[r.second].requested = false;
+  _requests.clear();
+  }
+
+std::shared_ptr<const pc_chunk> pc_stream::get(uint32_t node, float priority)
+  {
+  std::scoped_lock lock(_mut);
+  cache_entry& e = _entries[node];
+  e.frame = _frame;
+  if (e.chunk)
+    {
+    _lru.splice(_lru.begin(), _lru, e.lru);
+    return e.chunk;
+    }
+  if (!e.requested)
+    {
+    e.requested = true;
+    _requests.emplace_back(priority, node);
+    _cv.notify_one();
+    }
+  return nullptr;
+  }
+
+void pc_stream::set_memory_budget(uint64_t bytes)
+  {
+  std::scoped_lock lock(_mut);
+  _memory_budget = bytes;
+  while (_memory_in_use > _memory_budget && !_lru.empty() && _entries[_lru.back()].frame != _frame)
+    {
+    const uint32_t node = _lru.back();
+    _lru.pop_back();
+    _entries[node].chunk.reset();
+    _memory_in_use -= _chunk_size(node);
+    }
+  }
+
+uint64_t pc_stream::memory_in_use() const
+  {
+  std::scoped_lock lock(_mut);
+  return _memory_in_use;
+  }
+
+void pc_stream::set_on_load(std::function<void()> on_load)
+  {
+  std::scoped_lock lock(_mut);
+  _on_load = on_load;
+  }
+
+bool pc_stream::find_point(vec3<float>& v, uint32_t id) const
+  {
+  // the nodes are in depth first order, so their first points increase
+  auto it = std::upper_bound(_nodes.begin(), _nodes.end(), id, [](uint32_t i, const pc_octree_node& n) { return i < n.first; });
+  if (it == _nodes.begin())
+    return false;
+  --it;
+  if (id >= it->first + it->count)
+    return false;
+  std::scoped_lock lock(_mut);
+  const cache_entry& e = _entries[it - _nodes.begin()];
+  if (!e.chunk)
+    return false;
+  v = e.chunk->vertices[id - it->first];
+  return true;
+  }
+
+void pc_stream::_load_loop()
+  {
+  std::ifstream f(stream_filename(_filename), std::ios::binary);
+  std::unique_lock<std::mutex> lock(_mut);
+  for (;;)
+    {
+    _cv.wait(lock, [&] { return _stop || !_requests.empty(); });
+    if (_stop)
+      return;
+    auto it = std::max_element(_requests.begin(), _requests.end());
+    const uint32_t node = it->second;
+    *it = _requests.back();
+    _requests.pop_back();
+
+    // make room by dropping chunks that the current frame did not ask for
+    const uint64_t size = _chunk_size(node);
+    while (_memory_in_use + size > _memory_budget && !_lru.empty() && _entries[_lru.back()].frame != _frame)
+      {
+      const uint32_t evicted = _lru.back();
+      _lru.pop_back();
+      _entries[evicted].chunk.reset();
+      _memory_in_use -= _chunk_size(evicted);
+      }
+    if (_memory_in_use + size > _memory_budget)
+      {
+      _entries[node].requested = false;
+      continue;
+      }
+    _memory_in_use += size;
+    lock.unlock();
+
+    const pc_octree_node& n = _nodes[node];
+    std::shared_ptr<pc_chunk> chunk = std::make_shared<pc_chunk>();
+    chunk->vertices.resize(n.count);
+    f.clear();
+    f.seekg((std::streamoff)(_data_offset + (uint64_t)n.first * point_size(_has_normals, _has_colors)));
+    f.read((char*)chunk->vertices.data(), (std::streamsize)n.count * sizeof(vec3<float>));
+    if (_has_normals)
+      {
+      chunk->normals.resize(n.count);
+      f.read((char*)chunk->normals.data(), (std::streamsize)n.count * sizeof(vec3<float>));
+      }
+    if (_has_colors)
+      {
+      chunk->colors.resize(n.count);
+      f.read((char*)chunk->colors.data(), (std::streamsize)n.count * sizeof(uint32_t));
+      }
+    const bool ok = !f.fail();
+
+    lock.lock();
+    cache_entry& e = _entries[node];
+    e.requested = false;
+    if (!ok)
+      {
+      _memory_in_use -= size;
+      continue;
+      }
+    e.chunk = chunk;
+    _lru.push_front(node);
+    e.lru = _lru.begin();
+    std::function<void()> on_load = _on_load;
+    lock.unlock();
+    if (on_load)
+      on_load();
+    lock.lock();
+    }
+  }
+
+bool write_pco(const pc& p, const std::vector<pc_octree_node>& nodes, const std::string& filename)
+  {
+  if (p.vertices.empty() || nodes.empty() || nodes[0].subtree_count != (uint32_t)p.vertices.size())
+    return false;
+  const bool has_normals = p.normals.size() == p.vertices.size();
+  const bool has_colors = p.vertex_colors.size() == p.vertices.size();
+
+  std::ofstream f(stream_filename(filename), std::ios::binary);
+  if (!f.is_open())
+    return false;
+  vec3<float> min_bb = p.vertices[0];
+  vec3<float> max_bb = p.vertices[0];
+  for (const auto& v : p.vertices)
+    {
+    for (int j = 0; j < 3; ++j)
+      {
+      min_bb[j] = std::min(min_bb[j], v[j]);
+      max_bb[j] = std::max(max_bb[j], v[j]);
+      }
+    }
+  f.write(pco_magic, 8);
+  write_value<uint32_t>(f, (uint32_t)nodes.size());
+  write_value<uint32_t>(f, (uint32_t)p.vertices.size());
+  write_value<uint32_t>(f, (has_normals ? pco_has_normals : 0) | (has_colors ? pco_has_colors : 0));
+  write_value<uint32_t>(f, 0);
+  for (int j = 0; j < 3; ++j)
+    write_value<float>(f, min_bb[j]);
+  for (int j = 0; j < 3; ++j)
+    write_value<float>(f, max_bb[j]);
+  for (const auto& n : nodes)
+    {
+    for (int j = 0; j < 3; ++j)
+      write_value<float>(f, n.min_bb[j]);
+    write_value<float>(f, n.size);
+    write_value<uint32_t>(f, n.first);
+    write_value<uint32_t>(f, n.count);
+    write_value<uint32_t>(f, n.subtree_count);
+    for (uint32_t c : n.children)
+      write_value<uint32_t>(f, c);
+    }
+  for (const auto& n : nodes)
+    {
+    f.write((const char*)(p.vertices.data() + n.first), (std::streamsize)n.count * sizeof(vec3<float>));
+    if (has_normals)
+      f.write((const char*)(p.normals.data() + n.first), (std::streamsize)n.count * sizeof(vec3<float>));
+    if (has_colors)
+      f.write((const char*)(p.vertex_colors.data() + n.first), (std::streamsize)n.count * sizeof(uint32_t));
+    }
+  return !f.fail();
+  }
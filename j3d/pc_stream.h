@@ -0,0 +1,102 @@
+#pragma once
+
+#include <jtk/vec.h>
+
+#include "pc_octree.h"
+
+#include <stdint.h>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct pc;
+
+// The points of one octree node of a streamed point cloud.
+struct pc_chunk
+  {
+  std::vector<jtk::vec3<float>> vertices;
+  std::vector<jtk::vec3<float>> normals; // empty if the cloud has no normals
+  std::vector<uint32_t> colors; // empty if the cloud has no colors
+  };
+
+/*
+A point cloud that stays on disk in the pco format, and of which only the chunks that the renderer asks for are read.
+A pco file holds the nodes of a pc_octree, followed by the points of every node as one chunk: the vertices, then the normals,
+then the colors of the node. The chunks are read by background threads into a cache that drops the least recently used
+chunks when it grows beyond its memory budget. Chunks that were asked for in the current frame are never dropped: if they fill
+the whole budget, further requests of that frame are ignored, and the renderer keeps showing the coarser nodes.
+*/
+class pc_stream
+  {
+  public:
+    pc_stream();
+    ~pc_stream();
+
+    bool open(const std::string& filename);
+
+    const std::vector<pc_octree_node>& nodes() const { return _nodes; }
+
+    uint32_t nr_of_points() const { return _nr_of_points; }
+    bool has_normals() const { return _has_normals; }
+    bool has_colors() const { return _has_colors; }
+    const jtk::vec3<float>& min_bb() const { return _min_bb; }
+    const jtk::vec3<float>& max_bb() const { return _max_bb; }
+
+    // Starts a new frame: the requests of the previous frame that were not loaded yet are dropped.
+    void begin_frame();
+
+    // Returns the chunk of node i if it is in memory, and otherwise asks the loaders for it. Larger priorities are loaded first.
+    std::shared_ptr<const pc_chunk> get(uint32_t node, float priority);
+
+    void set_memory_budget(uint64_t bytes);
+
+    uint64_t memory_in_use() const;
+
+    // Called on a loader thread after every chunk that came in.
+    void set_on_load(std::function<void()> on_load);
+
+    // Finds point id if its chunk is in memory.
+    bool find_point(jtk::vec3<float>& v, uint32_t id) const;
+
+  private:
+    void _load_loop();
+
+    uint64_t _chunk_size(uint32_t node) const;
+
+  private:
+    struct cache_entry
+      {
+      std::shared_ptr<const pc_chunk> chunk;
+      std::list<uint32_t>::iterator lru; // position in _lru if chunk is set
+      uint64_t frame; // the last frame that asked for the chunk
+      bool requested;
+      };
+
+    std::string _filename;
+    std::vector<pc_octree_node> _nodes;
+    uint32_t _nr_of_points;
+    bool _has_normals, _has_colors;
+    jtk::vec3<float> _min_bb, _max_bb;
+    uint64_t _data_offset;
+
+    mutable std::mutex _mut;
+    std::condition_variable _cv;
+    std::vector<cache_entry> _entries;
+    std::list<uint32_t> _lru; // most recently used first
+    std::vector<std::pair<float, uint32_t>> _requests; // priority, node
+    uint64_t _frame;
+    uint64_t _memory_in_use;
+    uint64_t _memory_budget;
+    std::function<void()> _on_load;
+    bool _stop;
+    std::vector<std::thread> _loaders;
+  };
+
+// Writes p in the pco format, ready to be streamed by pc_stream. The points of p must be in the order of the octree nodes,
+// as they are in the db once the octree of the scene has sorted them.
+bool write_pco(const pc& p, const std::vector<pc_octree_node>& nodes, const std::string& filename);
@@ -28,6 +28,10 @@ uint32_t get_closest_vertex(const pixel& p, const vec3<float>* vertices, const v
 uint32_t get_closest_vertex(const pixel& p, const std::vector<jtk::vec3<float>>* vertices, const std::vector<jtk::vec3<uint32_t>>* triangles)
   {
   if (triangles != nullptr)
+    {
+    if (vertices == nullptr || p.object_id >= triangles->size())
+      return (uint32_t)-1;
     return get_closest_vertex(p, vertices->data(), triangles->data());
+    }
   return p.object_id;
   }
\ No newline at end of file
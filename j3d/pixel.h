@@ -26,4 +26,5 @@ struct pixel
   uint32_t db_id;
   };
 
+// Returns (uint32_t)-1 if the triangle of p does not exist, e.g. because p was picked from a frame of objects that were removed.
 uint32_t get_closest_vertex(const pixel& p, const std::vector<jtk::vec3<float>>* vertices, const std::vector<jtk::vec3<uint32_t>>* triangles);
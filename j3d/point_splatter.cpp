@@ -0,0 +1,192 @@
+#include "point_splatter.h"
+
+#include <jtk/render.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <thread>
+
+using namespace jtk;
+
+struct point_splatter::worker_buffers
+  {
+  render_data rd;
+  frame_buffer fb;
+  std::vector<uint32_t> color;
+  std::vector<float> z;
+  std::vector<uint32_t> id;
+  std::vector<uint32_t> cloud;
+  std::vector<vec3<float>> clipped_vertices, clipped_normals;
+  std::vector<uint32_t> clipped_colors, clipped_ids;
+  bool used;
+  };
+
+point_splatter::point_splatter()
+  {
+  uint32_t nr_of_workers = std::thread::hardware_concurrency();
+  if (nr_of_workers == 0)
+    nr_of_workers = 1;
+  nr_of_workers = std::min(nr_of_workers, point_splatter_max_workers);
+  for (uint32_t i = 0; i < nr_of_workers; ++i)
+    _workers.emplace_back(new worker_buffers());
+  }
+
+point_splatter::~point_splatter()
+  {
+  }
+
+void point_splatter::release()
+  {
+  for (auto& wb : _workers)
+    wb.reset(new worker_buffers());
+  }
+
+void point_splatter::splat(image<uint32_t>& im, g_buffer& out, float* z, const std::vector<splat_cloud>& clouds, const std::vector<splat_batch>& batches,
+  const float4x4& camera_inv, const float4x4& projection, thread_pool& tp)
+  {
+  if (batches.empty())
+    return;
+  const uint32_t w = out.width();
+  const uint32_t h = out.height();
+  const size_t size = (size_t)w * h;
+  float camera_position[16], projection_mat[16];
+  for (int i = 0; i < 16; ++i)
+    {
+    camera_position[i] = camera_inv[i];
+    projection_mat[i] = projection[i];
+    }
+  for (auto& wb : _workers)
+    wb->used = false;
+
+  const uint32_t nr_of_workers = std::min((uint32_t)_workers.size(), (uint32_t)batches.size());
+  std::atomic<uint32_t> next_batch(0);
+  pooled_parallel_for(uint32_t(0), nr_of_workers, [&](uint32_t worker)
+    {
+    worker_buffers& wb = *_workers[worker];
+    float object_system[16];
+    uint32_t b;
+    while ((b = next_batch.fetch_add(1, std::memory_order_relaxed)) < (uint32_t)batches.size())
+      {
+      if (!wb.used)
+        {
+        wb.used = true;
+        if (wb.z.size() != size)
+          {
+          // assigning frees the buffers of the old size, which resize would keep around when shrinking
+          wb.color = std::vector<uint32_t>(size);
+          wb.z = std::vector<float>(size);
+          wb.id = std::vector<uint32_t>(size);
+          wb.cloud = std::vector<uint32_t>(size);
+          }
+        memcpy(wb.z.data(), z, size * sizeof(float));
+        wb.fb.w = w;
+        wb.fb.h = h;
+        wb.fb.pixels = wb.color.data();
+        wb.fb.zbuffer = wb.z.data();
+        bind(wb.rd, wb.fb);
+        }
+      const splat_batch& batch = batches[b];
+      const splat_cloud& cloud = clouds[batch.cloud];
+      for (int i = 0; i < 16; ++i)
+        object_system[i] = cloud.cs[i];
+      bind(wb.rd, camera_position, object_system, projection_mat);
+      _splat_batch(wb, cloud, batch);
+      }
+    }, tp);
+
+  // depth resolve: per pixel the closest point of all workers, if it is in front of the G-buffer
+  std::vector<const worker_buffers*> used;
+  for (const auto& wb : _workers)
+    {
+    if (wb->used)
+      used.push_back(wb.get());
+    }
+  pooled_parallel_for(uint32_t(0), h, [&](uint32_t y)
+    {
+    uint32_t* p_im = im.data() + y * im.stride();
+    for (uint32_t x = 0; x < w; ++x)
+      {
+      const uint32_t i = y * w + x;
+      float best = z[i];
+      const worker_buffers* winner = nullptr;
+      for (const worker_buffers* wb : used)
+        {
+        if (wb->z[i] > best)
+          {
+          best = wb->z[i];
+          winner = wb;
+          }
+        }
+      if (winner)
+        {
+        p_im[x] = winner->color[i];
+        out.object_id[i] = winner->id[i];
+        out.depth[i] = 1.f / best;
+        out.db_id[i] = clouds[winner->cloud[i]].db_id;
+        z[i] = best;
+        }
+      }
+    }, tp);
+  }
+
+void point_splatter::_splat_batch(worker_buffers& wb, const splat_cloud& cloud, const splat_batch& batch)
+  {
+  object_buffer ob;
+  ob.number_of_vertices = batch.nr_of_points;
+  ob.vertices = (const float*)batch.vertices;
+  ob.normals = (const float*)batch.normals;
+  ob.colors = batch.colors;
+  const uint32_t* ids = nullptr;
+  if (!cloud.clip_planes.empty())
+    {
+    // the rasterizer has no clipping planes, so it gets a copy of the points that are kept
+    const uint32_t nr_of_planes = (uint32_t)cloud.clip_planes.size();
+    wb.clipped_vertices.clear();
+    wb.clipped_normals.clear();
+    wb.clipped_colors.clear();
+    wb.clipped_ids.clear();
+    for (uint32_t v = 0; v < batch.nr_of_points; ++v)
+      {
+      const vec3<float>& V = batch.vertices[v];
+      uint32_t j = 0;
+      while (j < nr_of_planes)
+        {
+        const float4& p = cloud.clip_planes[j];
+        if (p[0] * V[0] + p[1] * V[1] + p[2] * V[2] + p[3] > 0.f)
+          break;
+        ++j;
+        }
+      if (j < nr_of_planes)
+        continue;
+      wb.clipped_vertices.push_back(V);
+      if (batch.normals)
+        wb.clipped_normals.push_back(batch.normals[v]);
+      if (batch.colors)
+        wb.clipped_colors.push_back(batch.colors[v]);
+      wb.clipped_ids.push_back(batch.first_id + v);
+      }
+    if (wb.clipped_ids.empty())
+      return;
+    ob.number_of_vertices = (uint32_t)wb.clipped_ids.size();
+    ob.vertices = (const float*)wb.clipped_vertices.data();
+    ob.normals = batch.normals ? (const float*)wb.clipped_normals.data() : nullptr;
+    ob.colors = batch.colors ? wb.clipped_colors.data() : nullptr;
+    ids = wb.clipped_ids.data();
+    }
+  bind(wb.rd, ob);
+  present(wb.rd, 0xffffffff, [&](uint32_t vertex_id, const __m128i& index, const __m128i& mask)
+    {
+    alignas(16) uint32_t idx[4];
+    _mm_store_si128((__m128i*)idx, index);
+    const int lanes = ~_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(mask, _mm_setzero_si128()))) & 15;
+    for (int lane = 0; lane < 4; ++lane)
+      {
+      if (lanes & (1 << lane))
+        {
+        wb.id[idx[lane]] = ids ? ids[vertex_id + lane] : batch.first_id + vertex_id + lane;
+        wb.cloud[idx[lane]] = batch.cloud;
+        }
+      }
+    });
+  }
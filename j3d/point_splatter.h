@@ -0,0 +1,64 @@
+#pragma once
+
+#include <jtk/concurrency.h>
+#include <jtk/image.h>
+#include <jtk/vec.h>
+
+#include "g_buffer.h"
+
+#include <stdint.h>
+#include <memory>
+#include <vector>
+
+// A point cloud as the splatter sees it.
+struct splat_cloud
+  {
+  jtk::float4x4 cs;
+  uint32_t db_id;
+  std::vector<jtk::float4> clip_planes; // (normal, -offset) in the coordinates of the points, the points with dot(plane, (x, y, z, 1)) > 0 are not splatted
+  };
+
+// A run of consecutive points of one cloud.
+struct splat_batch
+  {
+  const jtk::vec3<float>* vertices;
+  const jtk::vec3<float>* normals; // nullptr for unshaded points
+  const uint32_t* colors; // nullptr for white points
+  uint32_t nr_of_points;
+  uint32_t first_id; // the object id of vertices[0]
+  uint32_t cloud; // index in the clouds passed to splat
+  };
+
+/*
+Splats point clouds with the jtk rasterizer on all workers of a thread pool.
+The workers take batches of points from a shared counter, and every worker rasterizes into its own color,
+inverse depth, id and cloud buffers, seeded with the inverse depth of the ray traced G-buffer.
+A final pass over the rows keeps, per pixel, the closest point of all workers, so that the result equals
+splatting all points on one thread, except for the choice between points at exactly the same depth.
+As every worker costs a set of screen sized buffers, at most point_splatter_max_workers workers splat, and no more
+than there are batches.
+*/
+const uint32_t point_splatter_max_workers = 8;
+
+class point_splatter
+  {
+  public:
+    point_splatter();
+    ~point_splatter();
+
+    // Splats the batches onto im and into the object id, depth and db id of out. z holds the inverse depth of out, or 0 where out is empty,
+    // and receives the inverse depth of the splatted points where they are in front.
+    void splat(jtk::image<uint32_t>& im, g_buffer& out, float* z, const std::vector<splat_cloud>& clouds, const std::vector<splat_batch>& batches,
+      const jtk::float4x4& camera_inv, const jtk::float4x4& projection, jtk::thread_pool& tp);
+
+    // Frees the buffers of the workers, they are allocated again by the next splat.
+    void release();
+
+  private:
+    struct worker_buffers;
+
+    void _splat_batch(worker_buffers& wb, const splat_cloud& cloud, const splat_batch& batch);
+
+  private:
+    std::vector<std::unique_ptr<worker_buffers>> _workers;
+  };
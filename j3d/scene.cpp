@@ -1,6 +1,7 @@
 #include "scene.h"
 #include "mesh.h"
 #include "pc.h"
+#include "pc_stream.h"
 #include <jtk/geometry.h>
 
 using namespace jtk;
@@ -20,8 +21,9 @@ void add_object(uint32_t id, scene& s, db& d)
     compute_triangle_normals(obj.triangle_normals, obj.p_vertices->data(), obj.p_triangles->data(), (uint32_t)obj.p_triangles->size());
     obj.cs = p_mesh->cs;
     compute_bb(obj.min_bb, obj.max_bb, (uint32_t)obj.p_vertices->size(), obj.p_vertices->data());    
-    obj.bvh = std::unique_ptr<qbvh>(new qbvh(*obj.p_triangles, obj.p_vertices->data()));
+    obj.bvh = std::unique_ptr<wbvh>(new wbvh(*obj.p_triangles, obj.p_vertices->data()));
     s.objects.emplace_back(std::move(obj));
+    invalidate_render_cache(s);
     } 
   if (d.is_pc(id))
     {
@@ -32,8 +34,20 @@ void add_object(uint32_t id, scene& s, db& d)
     obj.p_vertex_colors = &p_pc->vertex_colors;
     obj.p_normals = &p_pc->normals;   
     obj.cs = p_pc->cs;
-    compute_bb(obj.min_bb, obj.max_bb, (uint32_t)obj.p_vertices->size(), obj.p_vertices->data());   
+    obj.stream = p_pc->stream.get();
+    if (obj.stream)
+      {
+      obj.min_bb = obj.stream->min_bb();
+      obj.max_bb = obj.stream->max_bb();
+      }
+    else
+      {
+      // reorders the points of the db, so that the nodes of the octree are runs of points, and keeps their original order in original_ids
+      obj.octree = std::unique_ptr<pc_octree>(new pc_octree(p_pc->vertices, p_pc->normals, p_pc->vertex_colors, p_pc->original_ids));
+      compute_bb(obj.min_bb, obj.max_bb, (uint32_t)obj.p_vertices->size(), obj.p_vertices->data());
+      }
     s.pointclouds.emplace_back(std::move(obj));
+    ++s.pointclouds_version;
     } 
   }
 
@@ -41,10 +55,16 @@ void remove_object(uint32_t id, scene& s)
   {
   auto it = std::find_if(s.objects.begin(), s.objects.end(), [&](const scene_object& so) { return so.db_id == id; });
   if (it != s.objects.end())
+    {
     s.objects.erase(it);
+    invalidate_render_cache(s);
+    }
   auto it2 = std::find_if(s.pointclouds.begin(), s.pointclouds.end(), [&](const scene_pointcloud& so) { return so.db_id == id; });
   if (it2 != s.pointclouds.end())
+    {
     s.pointclouds.erase(it2);
+    ++s.pointclouds_version;
+    }
   }
 
 void prepare_scene(scene& s)
@@ -88,24 +108,92 @@ void prepare_scene(scene& s)
   s.diagonal = std::max<float>(s.diagonal, s.max_bb[2] - s.min_bb[2]);
   }
 
-void unzoom(scene& s)
+void invalidate_render_cache(const scene& s)
+  {
+  s.render_cache.valid = false;
+  }
+
+const scene_render_cache& get_render_cache(const scene& s)
+  {
+  scene_render_cache& c = s.render_cache;
+  if (c.valid)
+    return c;
+  c.bvhs.clear();
+  c.object_cs.clear();
+  c.inverted_object_cs.clear();
+  c.triangles.clear();
+  c.vertices.clear();
+  c.triangle_normals.clear();
+  c.vertex_colors.clear();
+  c.uv_coordinates.clear();
+  c.textures.clear();
+  c.db_ids.clear();
+  c.db_id_to_index.clear();
+  c.bvh.reset();
+  for (const auto& obj : s.objects)
+    {
+    if (!obj.bvh.get())
+      continue;
+    c.bvhs.push_back(obj.bvh.get());
+    c.object_cs.push_back(obj.cs);
+    c.inverted_object_cs.push_back(invert_orthonormal(obj.cs));
+    c.triangles.push_back(obj.p_triangles->data());
+    c.vertices.push_back(obj.p_vertices->data());
+    c.triangle_normals.push_back(obj.triangle_normals.data());
+    c.vertex_colors.push_back(obj.p_vertex_colors ? obj.p_vertex_colors->data() : nullptr);
+    c.uv_coordinates.push_back(obj.p_uv_coordinates ? obj.p_uv_coordinates->data() : nullptr);
+    c.textures.push_back(obj.p_texture);
+    c.db_ids.push_back(obj.db_id);
+    }
+  for (uint32_t i = 0; i < (uint32_t)c.db_ids.size(); ++i)
+    {
+    if (c.db_ids[i] >= c.db_id_to_index.size())
+      c.db_id_to_index.resize(c.db_ids[i] + 1, (uint32_t)-1);
+    c.db_id_to_index[c.db_ids[i]] = i;
+    }
+  if (!c.bvhs.empty())
+    c.bvh.reset(new wbvh_two_level_with_transformations(c.bvhs.data(), c.object_cs.data(), (uint32_t)c.bvhs.size()));
+  ++c.version;
+  c.valid = true;
+  return c;
+  }
+
+scene_camera get_camera(const scene& s)
+  {
+  scene_camera c;
+  c.coordinate_system = s.coordinate_system;
+  c.coordinate_system_inv = s.coordinate_system_inv;
+  for (int j = 0; j < 3; ++j)
+    c.pivot[j] = s.pivot[j];
+  return c;
+  }
+
+void set_camera(scene& s, const scene_camera& c)
+  {
+  s.coordinate_system = c.coordinate_system;
+  s.coordinate_system_inv = c.coordinate_system_inv;
+  for (int j = 0; j < 3; ++j)
+    s.pivot[j] = c.pivot[j];
+  }
+
+void unzoom(scene_camera& c, const scene& s)
   {
-  s.coordinate_system = get_identity();
+  c.coordinate_system = get_identity();
   for (int j = 0; j < 3; ++j)
-    s.pivot[j] = (s.min_bb[j] + s.max_bb[j])*0.5f;
+    c.pivot[j] = (s.min_bb[j] + s.max_bb[j])*0.5f;
 #if 0 // z axis up
-  s.coordinate_system[12] = s.pivot[0];
-  s.coordinate_system[13] = s.pivot[1] - s.diagonal * 2.f;
-  s.coordinate_system[14] = s.pivot[2] ;
+  c.coordinate_system[12] = c.pivot[0];
+  c.coordinate_system[13] = c.pivot[1] - s.diagonal * 2.f;
+  c.coordinate_system[14] = c.pivot[2] ;
 
-  s.coordinate_system[5] = 0;
-  s.coordinate_system[10] = 0;
-  s.coordinate_system[6] = 1;
-  s.coordinate_system[9] = -1;
+  c.coordinate_system[5] = 0;
+  c.coordinate_system[10] = 0;
+  c.coordinate_system[6] = 1;
+  c.coordinate_system[9] = -1;
 #else // y axis up
-  s.coordinate_system[12] = s.pivot[0];
-  s.coordinate_system[13] = s.pivot[1];
-  s.coordinate_system[14] = s.pivot[2] + s.diagonal * 2.f;
+  c.coordinate_system[12] = c.pivot[0];
+  c.coordinate_system[13] = c.pivot[1];
+  c.coordinate_system[14] = c.pivot[2] + s.diagonal * 2.f;
 #endif
-  s.coordinate_system_inv = invert_orthonormal(s.coordinate_system);
+  c.coordinate_system_inv = invert_orthonormal(c.coordinate_system);
   }
\ No newline at end of file
@@ -2,6 +2,9 @@
 #include <jtk/qbvh.h>
 #include <jtk/vec.h>
 #include "db.h"
+#include "pc_octree.h"
+#include "pc_stream.h"
+#include "wbvh.h"
 
 #include <stdint.h>
 #include <jtk/image.h>
@@ -20,7 +23,7 @@ struct scene_object
   jtk::vec3<float> min_bb;
   jtk::vec3<float> max_bb;
 
-  std::unique_ptr<jtk::qbvh> bvh;
+  std::unique_ptr<wbvh> bvh;
   jtk::float4x4 cs;
   };
 
@@ -35,6 +38,39 @@ struct scene_pointcloud
   jtk::vec3<float> max_bb;
 
   jtk::float4x4 cs;
+
+  std::unique_ptr<pc_octree> octree; // nullptr if the points are streamed
+  pc_stream* stream; // nullptr unless the points are streamed from disk
+  };
+
+/*
+Flat per-object arrays and the top level bvh over the objects of a scene, as used by the ray tracer.
+The scene keeps them between frames. They are rebuilt lazily by get_render_cache after an object was added
+or removed, or after invalidate_render_cache was called because the visibility or cs of an object changed.
+*/
+struct scene_render_cache
+  {
+  std::vector<const wbvh*> bvhs;
+  jtk::aligned_vector<jtk::float4x4> object_cs;
+  jtk::aligned_vector<jtk::float4x4> inverted_object_cs;
+  std::vector<const jtk::vec3<uint32_t>*> triangles;
+  std::vector<const jtk::vec3<float>*> vertices;
+  std::vector<const jtk::vec3<float>*> triangle_normals;
+  std::vector<const jtk::vec3<float>*> vertex_colors;
+  std::vector<const jtk::vec3<jtk::vec2<float>>*> uv_coordinates;
+  std::vector<const jtk::image<uint32_t>*> textures;
+  std::vector<uint32_t> db_ids;
+  std::vector<uint32_t> db_id_to_index; // (uint32_t)-1 for db ids that are not in the cache
+  std::unique_ptr<wbvh_two_level_with_transformations> bvh;
+  uint64_t version = 0; // incremented on every rebuild
+  bool valid = false;
+  };
+
+// The part of a scene that the camera controls change. The ui thread edits its own copy while the render thread renders the scene.
+struct scene_camera
+  {
+  jtk::float4x4 coordinate_system, coordinate_system_inv;
+  float pivot[3];
   };
 
 struct scene
@@ -48,6 +84,9 @@ struct scene
 
   std::list<scene_object> objects;
   std::list<scene_pointcloud> pointclouds;
+  uint64_t pointclouds_version = 0; // incremented when a point cloud is added or removed
+
+  mutable scene_render_cache render_cache;
   };
 
 void add_object(uint32_t id, scene& s, db& d);
@@ -56,4 +95,12 @@ void remove_object(uint32_t id, scene& s);
 
 void prepare_scene(scene& s);
 
-void unzoom(scene& s);
\ No newline at end of file
+void invalidate_render_cache(const scene& s);
+
+const scene_render_cache& get_render_cache(const scene& s);
+
+scene_camera get_camera(const scene& s);
+
+void set_camera(scene& s, const scene_camera& c);
+
+void unzoom(scene_camera& c, const scene& s);
\ No newline at end of file
@@ -6,14 +6,34 @@ settings::settings()
   {
   _canvas_settings.one_bit = false;
   _canvas_settings.shadow = false;
+  _canvas_settings.ambient_occlusion = false;
   _canvas_settings.edges = true;
   _canvas_settings.wireframe = false;
   _canvas_settings.shading = true;
   _canvas_settings.textured = true;
   _canvas_settings.vertexcolors = true;
+  _canvas_settings.reprojection = true;
+  _canvas_settings.progressive = true;
+  _canvas_settings.progressive_threshold_in_ms = 50.f;
+  _canvas_settings.progressive_density = 4;
+  _canvas_settings.dynamic_resolution = false;
+  _canvas_settings.frame_budget_in_ms = 33.f;
+  _canvas_settings.antialiasing_samples = 16;
+  _canvas_settings.point_budget = 10000000;
+  _canvas_settings.eye_dome_lighting = true;
+  _canvas_settings.eye_dome_lighting_strength = 1.f;
+  for (uint32_t i = 0; i < max_clipping_planes; ++i)
+    {
+    clipping_plane& p = _canvas_settings.clipping_planes[i];
+    p.enabled = false;
+    p.normal[0] = p.normal[1] = p.normal[2] = 0.f;
+    p.normal[i / 2] = (i & 1) ? -1.f : 1.f;
+    p.offset = 0.f;
+    }
   _canvas_w = 800;
   _canvas_h = 600;
   _vox_max_size = 100;
+  _point_cache_size_in_mb = 2048;
   _executable_path = jtk::get_executable_path();
   _index_in_folder = -1;
   _matcap_type = matcap_type::MATCAP_TYPE_INTERNAL_REDWAX;
@@ -31,15 +51,42 @@ settings read_settings(const char* filename)
   pref_file f(filename, pref_file::READ);
   f["one_bit"] >> s._canvas_settings.one_bit;
   f["shadow"] >> s._canvas_settings.shadow;
+  f["ambient_occlusion"] >> s._canvas_settings.ambient_occlusion;
   f["edges"] >> s._canvas_settings.edges;
   f["wireframe"] >> s._canvas_settings.wireframe;
   f["shading"] >> s._canvas_settings.shading;
   f["textured"] >> s._canvas_settings.textured;
   f["vertexcolors"] >> s._canvas_settings.vertexcolors;
+  f["reprojection"] >> s._canvas_settings.reprojection;
+  f["progressive"] >> s._canvas_settings.progressive;
+  f["progressive_threshold_in_ms"] >> s._canvas_settings.progressive_threshold_in_ms;
+  f["progressive_density"] >> s._canvas_settings.progressive_density;
+  f["dynamic_resolution"] >> s._canvas_settings.dynamic_resolution;
+  f["frame_budget_in_ms"] >> s._canvas_settings.frame_budget_in_ms;
+  f["antialiasing_samples"] >> s._canvas_settings.antialiasing_samples;
+  f["point_budget"] >> s._canvas_settings.point_budget;
+  f["eye_dome_lighting"] >> s._canvas_settings.eye_dome_lighting;
+  f["eye_dome_lighting_strength"] >> s._canvas_settings.eye_dome_lighting_strength;
+  for (uint32_t i = 0; i < max_clipping_planes; ++i)
+    {
+    clipping_plane& p = s._canvas_settings.clipping_planes[i];
+    const std::string label = "clipping_plane_" + std::to_string(i);
+    f[(label + "_enabled").c_str()] >> p.enabled;
+    std::vector<float> plane;
+    f[label.c_str()] >> plane;
+    if (plane.size() == 4)
+      {
+      p.normal[0] = plane[0];
+      p.normal[1] = plane[1];
+      p.normal[2] = plane[2];
+      p.offset = plane[3];
+      }
+    }
   f["current_folder"] >> s._current_folder;
   f["canvas_w"] >> s._canvas_w;
   f["canvas_h"] >> s._canvas_h;
   f["vox_max_size"] >> s._vox_max_size;
+  f["point_cache_size_in_mb"] >> s._point_cache_size_in_mb;
   int32_t i;
   f["matcap_type"] >> i;
   s._matcap_type = int_to_matcap_type(i);
@@ -58,15 +105,34 @@ void write_settings(const settings& s, const char* filename)
   pref_file f(filename, pref_file::WRITE);
   f << "one_bit" << s._canvas_settings.one_bit;
   f << "shadow" << s._canvas_settings.shadow;
+  f << "ambient_occlusion" << s._canvas_settings.ambient_occlusion;
   f << "edges" << s._canvas_settings.edges;
   f << "wireframe" << s._canvas_settings.wireframe;
   f << "shading" << s._canvas_settings.shading;
   f << "textured" << s._canvas_settings.textured;
   f << "vertexcolors" << s._canvas_settings.vertexcolors;
+  f << "reprojection" << s._canvas_settings.reprojection;
+  f << "progressive" << s._canvas_settings.progressive;
+  f << "progressive_threshold_in_ms" << s._canvas_settings.progressive_threshold_in_ms;
+  f << "progressive_density" << s._canvas_settings.progressive_density;
+  f << "dynamic_resolution" << s._canvas_settings.dynamic_resolution;
+  f << "frame_budget_in_ms" << s._canvas_settings.frame_budget_in_ms;
+  f << "antialiasing_samples" << s._canvas_settings.antialiasing_samples;
+  f << "point_budget" << s._canvas_settings.point_budget;
+  f << "eye_dome_lighting" << s._canvas_settings.eye_dome_lighting;
+  f << "eye_dome_lighting_strength" << s._canvas_settings.eye_dome_lighting_strength;
+  for (uint32_t i = 0; i < max_clipping_planes; ++i)
+    {
+    const clipping_plane& p = s._canvas_settings.clipping_planes[i];
+    const std::string label = "clipping_plane_" + std::to_string(i);
+    f << (label + "_enabled").c_str() << p.enabled;
+    f << label.c_str() << std::vector<double>{ p.normal[0], p.normal[1], p.normal[2], p.offset };
+    }
   f << "current_folder" << s._current_folder;
   f << "canvas_w" << s._canvas_w;
   f << "canvas_h" << s._canvas_h;
   f << "vox_max_size" << s._vox_max_size;
+  f << "point_cache_size_in_mb" << s._point_cache_size_in_mb;
   f << "matcap_type" << matcap_type_to_int(s._matcap_type);
   f << "matcap_file" << s._matcap_file;
   f << "gradient_top" << s._gradient_top;
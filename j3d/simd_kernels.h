@@ -0,0 +1,84 @@
+#pragma once
+
+#include "wbvh_kernels.h"
+
+#include <stdint.h>
+
+/*
+Table of the hot loops of j3d that exist in an SSE4.1, an AVX2 and an AVX-512 version.
+Each version lives in its own translation unit (kernels_sse41.cpp, kernels_avx2.cpp, kernels_avx512.cpp)
+that is compiled with the matching instruction set. The table for the cpu that j3d runs on
+is returned by get_simd_kernels() in cpu.h.
+*/
+
+// Channels of a run of G-buffer pixels, see g_buffer.h. Pixel i of the run is element i of every channel.
+struct simd_g_buffer_span
+  {
+  const uint32_t* color; // mark | r << 8 | g << 16 | b << 24
+  const uint32_t* normal; // u and v as 16-bit snorms, u in the lower half
+  const float* depth;
+  const uint32_t* object_id;
+  const uint32_t* db_id;
+  };
+
+// A 16-bit snorm n of the G-buffer normal decodes to n * g_buffer_normal_scale.
+const float g_buffer_normal_scale = 1.f / 32767.f;
+
+// Flags written by simd_kernels::edge_row for every pixel that has an object.
+enum simd_edge_flags
+  {
+  SIMD_EDGE_NORMAL_RIGHT = 1, // the right neighbour has an object and its normal differs by more than the threshold
+  SIMD_EDGE_NORMAL_UP = 2, // idem for the upper neighbour
+  SIMD_EDGE_OBJECT_RIGHT = 4, // the right neighbour has an object with another object_id
+  SIMD_EDGE_OBJECT_UP = 8 // idem for the upper neighbour
+  };
+
+struct simd_matcap
+  {
+  const uint32_t* pixels;
+  uint32_t width;
+  uint32_t height;
+  uint32_t stride;
+  };
+
+// Input of simd_kernels::edl_row. The depth rows hold inverse depths, with 0 where there is no object.
+struct simd_edl
+  {
+  const float* z; // the row that is shaded
+  const float* z_up; // the row radius pixels above, or the first row of the image
+  const float* z_down; // the row radius pixels below, or the last row of the image
+  const uint32_t* db_id;
+  uint32_t db_key; // only pixels with db_id >> 29 equal to db_key are shaded, see get_db_key in db.h
+  uint32_t radius; // distance in pixels to the eight neighbours
+  float strength;
+  };
+
+struct simd_kernels
+  {
+  const char* name;
+
+  void(*wbvh8_closest_hit)(wbvh_kernel_hit& h, wbvh_kernel_ray& r, const wbvh_node8* nodes, uint32_t start_child, uint32_t start_count, const uint32_t* primitive_ids, const uint32_t* triangles, const float* vertices);
+
+  // Returns 1 as soon as a triangle is hit between r.t_near and r.t_far, 0 if there is none.
+  int(*wbvh8_any_hit)(const wbvh_kernel_ray& r, const wbvh_node8* nodes, const uint32_t* primitive_ids, const uint32_t* triangles, const float* vertices);
+
+  void(*wbvh8_all_hits)(const wbvh_kernel_ray& r, const wbvh_node8* nodes, const uint32_t* primitive_ids, const uint32_t* triangles, const float* vertices, wbvh_hit_callback callback, void* context);
+
+  // Matcap or vertex color shading of nr_of_pixels G-buffer pixels. Pixels without object are left untouched in out.
+  void(*shade_row)(uint32_t* out, const simd_g_buffer_span& pixels, uint32_t nr_of_pixels, const simd_matcap& m, int shading);
+
+  // Writes the inverse depth of the G-buffer pixels to z, or 0 where there is no object, as depth test input for the point splatting.
+  void(*splat_depth_row)(float* z, const simd_g_buffer_span& pixels, uint32_t nr_of_pixels);
+
+  void(*copy_row)(uint32_t* dest, const uint32_t* src, uint32_t nr_of_pixels);
+
+  // Writes simd_edge_flags for nr_of_pixels G-buffer pixels, comparing pixel i with pixel i+1 of the same row and pixel i of up_pixels.
+  void(*edge_row)(uint8_t* flags, const simd_g_buffer_span& pixels, const simd_g_buffer_span& up_pixels, uint32_t nr_of_pixels, float threshold);
+
+  // Eye-dome lighting: darkens the colors in out of the pixels that lie behind their neighbours, as the mean difference in log2 depth.
+  void(*edl_row)(uint32_t* out, const simd_edl& e, uint32_t nr_of_pixels);
+  };
+
+void init_simd_kernels_sse41(simd_kernels& k);
+void init_simd_kernels_avx2(simd_kernels& k);
+void init_simd_kernels_avx512(simd_kernels& k);
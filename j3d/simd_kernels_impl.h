@@ -0,0 +1,475 @@
+#pragma once
+
+/*
+Code shared by kernels_sse41.cpp, kernels_avx2.cpp and kernels_avx512.cpp.
+Only include this file from those translation units: everything in here is compiled once per instruction set
+and has internal linkage, so that the linker never mixes up the versions.
+*/
+
+#include "simd_kernels.h"
+
+#include <immintrin.h>
+#include <string.h>
+
+namespace
+  {
+
+  /////////////////////////////////////////////////////////////////////
+  // eight floats, as one ymm register or as two xmm registers
+  /////////////////////////////////////////////////////////////////////
+
+#if defined(__AVX2__)
+  typedef __m256 float8;
+
+  inline float8 load8(const float* p) { return _mm256_loadu_ps(p); }
+  inline void store8(float* p, float8 a) { _mm256_storeu_ps(p, a); }
+  inline float8 set8(float f) { return _mm256_set1_ps(f); }
+  inline float8 sub8(float8 a, float8 b) { return _mm256_sub_ps(a, b); }
+  inline float8 mul8(float8 a, float8 b) { return _mm256_mul_ps(a, b); }
+  inline float8 min8(float8 a, float8 b) { return _mm256_min_ps(a, b); }
+  inline float8 max8(float8 a, float8 b) { return _mm256_max_ps(a, b); }
+#if defined(__AVX512VL__)
+  inline int less_equal8(float8 a, float8 b) { return (int)_mm256_cmp_ps_mask(a, b, _CMP_LE_OQ); }
+#else
+  inline int less_equal8(float8 a, float8 b) { return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_LE_OQ)); }
+#endif
+#else
+  struct float8
+    {
+    __m128 lo, hi;
+    };
+
+  inline float8 make8(__m128 lo, __m128 hi) { float8 r; r.lo = lo; r.hi = hi; return r; }
+  inline float8 load8(const float* p) { return make8(_mm_loadu_ps(p), _mm_loadu_ps(p + 4)); }
+  inline void store8(float* p, float8 a) { _mm_storeu_ps(p, a.lo); _mm_storeu_ps(p + 4, a.hi); }
+  inline float8 set8(float f) { return make8(_mm_set1_ps(f), _mm_set1_ps(f)); }
+  inline float8 sub8(float8 a, float8 b) { return make8(_mm_sub_ps(a.lo, b.lo), _mm_sub_ps(a.hi, b.hi)); }
+  inline float8 mul8(float8 a, float8 b) { return make8(_mm_mul_ps(a.lo, b.lo), _mm_mul_ps(a.hi, b.hi)); }
+  inline float8 min8(float8 a, float8 b) { return make8(_mm_min_ps(a.lo, b.lo), _mm_min_ps(a.hi, b.hi)); }
+  inline float8 max8(float8 a, float8 b) { return make8(_mm_max_ps(a.lo, b.lo), _mm_max_ps(a.hi, b.hi)); }
+  inline int less_equal8(float8 a, float8 b) { return _mm_movemask_ps(_mm_cmple_ps(a.lo, b.lo)) | (_mm_movemask_ps(_mm_cmple_ps(a.hi, b.hi)) << 4); }
+#endif
+
+  /////////////////////////////////////////////////////////////////////
+  // 8-wide bvh traversal
+  /////////////////////////////////////////////////////////////////////
+
+  const uint32_t wbvh8_stack_size = 512;
+
+  struct stack_entry
+    {
+    uint32_t child;
+    uint32_t count;
+    float t;
+    };
+
+  struct prepared_ray
+    {
+    float8 orig[3];
+    float8 inv_dir[3];
+    int sign[3];
+    };
+
+  inline void prepare_ray(prepared_ray& pr, const wbvh_kernel_ray& r)
+    {
+    for (int j = 0; j < 3; ++j)
+      {
+      float d = r.dir[j];
+      if (d > -1e-20f && d < 1e-20f)
+        d = d < 0.f ? -1e-20f : 1e-20f;
+      pr.orig[j] = set8(r.orig[j]);
+      pr.inv_dir[j] = set8(1.f / d);
+      pr.sign[j] = d < 0.f ? 1 : 0;
+      }
+    }
+
+  inline bool intersect_triangle(float& t, float& u, float& v, const wbvh_kernel_ray& r, const float* V0, const float* V1, const float* V2)
+    {
+    const float e1[3] = { V1[0] - V0[0], V1[1] - V0[1], V1[2] - V0[2] };
+    const float e2[3] = { V2[0] - V0[0], V2[1] - V0[1], V2[2] - V0[2] };
+    const float p[3] = { r.dir[1] * e2[2] - r.dir[2] * e2[1], r.dir[2] * e2[0] - r.dir[0] * e2[2], r.dir[0] * e2[1] - r.dir[1] * e2[0] };
+    const float det = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+    if (det == 0.f)
+      return false;
+    const float inv_det = 1.f / det;
+    const float s[3] = { r.orig[0] - V0[0], r.orig[1] - V0[1], r.orig[2] - V0[2] };
+    u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * inv_det;
+    if (u < 0.f || u > 1.f)
+      return false;
+    const float q[3] = { s[1] * e1[2] - s[2] * e1[1], s[2] * e1[0] - s[0] * e1[2], s[0] * e1[1] - s[1] * e1[0] };
+    v = (r.dir[0] * q[0] + r.dir[1] * q[1] + r.dir[2] * q[2]) * inv_det;
+    if (v < 0.f || u + v > 1.f)
+      return false;
+    t = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) * inv_det;
+    return t > r.t_near && t < r.t_far;
+    }
+
+  /*
+  Visits the hierarchy front to back. The leaf functor gets the primitive range of a leaf and may lower r.t_far,
+  which prunes the remaining entries. A leaf that lowers r.t_far below r.t_near ends the traversal.
+  */
+  template <class TLeaf>
+  inline void traverse8(const wbvh_node8* nodes, uint32_t start_child, uint32_t start_count, wbvh_kernel_ray& r, TLeaf& leaf)
+    {
+    prepared_ray pr;
+    prepare_ray(pr, r);
+    stack_entry stack[wbvh8_stack_size];
+    uint32_t stack_size = 0;
+    stack[stack_size].child = start_child;
+    stack[stack_size].count = start_count;
+    stack[stack_size].t = r.t_near;
+    ++stack_size;
+
+    const float8 t_near = set8(r.t_near);
+
+    while (stack_size)
+      {
+      const stack_entry e = stack[--stack_size];
+      if (e.t > r.t_far)
+        continue;
+      if (e.count)
+        {
+        leaf(e.child, e.count);
+        if (r.t_far < r.t_near)
+          return;
+        continue;
+        }
+      const wbvh_node8& node = nodes[e.child];
+      const float* near_x = pr.sign[0] ? node.bbox_max[0] : node.bbox_min[0];
+      const float* near_y = pr.sign[1] ? node.bbox_max[1] : node.bbox_min[1];
+      const float* near_z = pr.sign[2] ? node.bbox_max[2] : node.bbox_min[2];
+      const float* far_x = pr.sign[0] ? node.bbox_min[0] : node.bbox_max[0];
+      const float* far_y = pr.sign[1] ? node.bbox_min[1] : node.bbox_max[1];
+      const float* far_z = pr.sign[2] ? node.bbox_min[2] : node.bbox_max[2];
+      float8 tn = max8(mul8(sub8(load8(near_x), pr.orig[0]), pr.inv_dir[0]), t_near);
+      tn = max8(tn, mul8(sub8(load8(near_y), pr.orig[1]), pr.inv_dir[1]));
+      tn = max8(tn, mul8(sub8(load8(near_z), pr.orig[2]), pr.inv_dir[2]));
+      float8 tf = min8(mul8(sub8(load8(far_x), pr.orig[0]), pr.inv_dir[0]), set8(r.t_far));
+      tf = min8(tf, mul8(sub8(load8(far_y), pr.orig[1]), pr.inv_dir[1]));
+      tf = min8(tf, mul8(sub8(load8(far_z), pr.orig[2]), pr.inv_dir[2]));
+      const int mask = less_equal8(tn, tf);
+      if (!mask)
+        continue;
+      float t[8];
+      store8(t, tn);
+      uint32_t order[8];
+      int nr_of_hits = 0;
+      for (int i = 0; i < 8; ++i)
+        {
+        if (!(mask & (1 << i)))
+          continue;
+        int j = nr_of_hits++;
+        while (j > 0 && t[order[j - 1]] < t[i]) // farthest child first, so that the nearest is popped first
+          {
+          order[j] = order[j - 1];
+          --j;
+          }
+        order[j] = i;
+        }
+      for (int i = 0; i < nr_of_hits; ++i)
+        {
+        stack[stack_size].child = node.child[order[i]];
+        stack[stack_size].count = node.count[order[i]];
+        stack[stack_size].t = t[order[i]];
+        ++stack_size;
+        }
+      }
+    }
+
+  struct closest_leaf
+    {
+    wbvh_kernel_hit* h;
+    wbvh_kernel_ray* r;
+    const uint32_t* primitive_ids;
+    const uint32_t* triangles;
+    const float* vertices;
+
+    void operator()(uint32_t first, uint32_t count)
+      {
+      for (uint32_t i = first; i < first + count; ++i)
+        {
+        const uint32_t id = primitive_ids[i];
+        const uint32_t* tria = triangles + 3 * id;
+        float t, u, v;
+        if (intersect_triangle(t, u, v, *r, vertices + 3 * tria[0], vertices + 3 * tria[1], vertices + 3 * tria[2]))
+          {
+          r->t_far = t;
+          h->u = u;
+          h->v = v;
+          h->triangle_id = id;
+          h->found = 1;
+          }
+        }
+      }
+    };
+
+  struct all_hits_leaf
+    {
+    const wbvh_kernel_ray* r;
+    const uint32_t* primitive_ids;
+    const uint32_t* triangles;
+    const float* vertices;
+    wbvh_hit_callback callback;
+    void* context;
+
+    void operator()(uint32_t first, uint32_t count)
+      {
+      for (uint32_t i = first; i < first + count; ++i)
+        {
+        const uint32_t id = primitive_ids[i];
+        const uint32_t* tria = triangles + 3 * id;
+        float t, u, v;
+        if (intersect_triangle(t, u, v, *r, vertices + 3 * tria[0], vertices + 3 * tria[1], vertices + 3 * tria[2]))
+          callback(context, id, t, u, v);
+        }
+      }
+    };
+
+  struct any_hit_leaf
+    {
+    wbvh_kernel_ray* r;
+    const uint32_t* primitive_ids;
+    const uint32_t* triangles;
+    const float* vertices;
+    int found;
+
+    void operator()(uint32_t first, uint32_t count)
+      {
+      for (uint32_t i = first; i < first + count; ++i)
+        {
+        const uint32_t id = primitive_ids[i];
+        const uint32_t* tria = triangles + 3 * id;
+        float t, u, v;
+        if (intersect_triangle(t, u, v, *r, vertices + 3 * tria[0], vertices + 3 * tria[1], vertices + 3 * tria[2]))
+          {
+          found = 1;
+          r->t_far = -3.402823466e+38f; // stops traverse8
+          return;
+          }
+        }
+      }
+    };
+
+  void wbvh8_closest_hit(wbvh_kernel_hit& h, wbvh_kernel_ray& r, const wbvh_node8* nodes, uint32_t start_child, uint32_t start_count, const uint32_t* primitive_ids, const uint32_t* triangles, const float* vertices)
+    {
+    closest_leaf leaf;
+    leaf.h = &h;
+    leaf.r = &r;
+    leaf.primitive_ids = primitive_ids;
+    leaf.triangles = triangles;
+    leaf.vertices = vertices;
+    traverse8(nodes, start_child, start_count, r, leaf);
+    }
+
+  void wbvh8_all_hits(const wbvh_kernel_ray& r, const wbvh_node8* nodes, const uint32_t* primitive_ids, const uint32_t* triangles, const float* vertices, wbvh_hit_callback callback, void* context)
+    {
+    wbvh_kernel_ray local = r;
+    all_hits_leaf leaf;
+    leaf.r = &local;
+    leaf.primitive_ids = primitive_ids;
+    leaf.triangles = triangles;
+    leaf.vertices = vertices;
+    leaf.callback = callback;
+    leaf.context = context;
+    traverse8(nodes, 0, 0, local, leaf);
+    }
+
+  int wbvh8_any_hit(const wbvh_kernel_ray& r, const wbvh_node8* nodes, const uint32_t* primitive_ids, const uint32_t* triangles, const float* vertices)
+    {
+    wbvh_kernel_ray local = r;
+    any_hit_leaf leaf;
+    leaf.r = &local;
+    leaf.primitive_ids = primitive_ids;
+    leaf.triangles = triangles;
+    leaf.vertices = vertices;
+    leaf.found = 0;
+    traverse8(nodes, 0, 0, local, leaf);
+    return leaf.found;
+    }
+
+  /////////////////////////////////////////////////////////////////////
+  // scalar versions of the G-buffer kernels, used for the remainder of a row
+  /////////////////////////////////////////////////////////////////////
+
+  inline float normal_u(uint32_t n)
+    {
+    return (float)(int16_t)(n & 0xffff) * g_buffer_normal_scale;
+    }
+
+  inline float normal_v(uint32_t n)
+    {
+    return (float)(int16_t)(n >> 16) * g_buffer_normal_scale;
+    }
+
+  // Same result as canvas::_get_color.
+  inline uint32_t shade_pixel(const simd_g_buffer_span& p, uint32_t i, const simd_matcap& m, int shading)
+    {
+    const uint32_t mark_rgb = p.color[i];
+    const uint32_t mark = mark_rgb & 0xff;
+    const uint32_t r = (mark_rgb >> 8) & 0xff;
+    const uint32_t g = (mark_rgb >> 16) & 0xff;
+    const uint32_t b = mark_rgb >> 24;
+    const float u = normal_u(p.normal[i]);
+    const float v = normal_v(p.normal[i]);
+    if (mark & 2)
+      {
+      if (shading)
+        {
+        const float w = _mm_cvtss_f32(_mm_sqrt_ss(_mm_set_ss(1.f - u * u - v * v)));
+        const float occ = mark & 1 ? 0.3f : 1.f;
+        const float dif = _mm_cvtss_f32(_mm_min_ss(_mm_max_ss(_mm_set_ss(w), _mm_setzero_ps()), _mm_set_ss(1.f))) * occ;
+        return 0xff000000 | ((uint32_t)_mm_cvttss_si32(_mm_set_ss(b * dif)) << 16) | ((uint32_t)_mm_cvttss_si32(_mm_set_ss(g * dif)) << 8) | (uint32_t)_mm_cvttss_si32(_mm_set_ss(r * dif));
+        }
+      if (mark & 1)
+        return 0xff000000 | ((b >> 2) << 16) | ((g >> 2) << 8) | (r >> 2);
+      return 0xff000000 | (b << 16) | (g << 8) | r;
+      }
+    const float U = _mm_cvtss_f32(_mm_floor_ss(_mm_setzero_ps(), _mm_set_ss(0.5f + (u + 1.f) * (float)(m.width - 1) * 0.5f)));
+    const float V = _mm_cvtss_f32(_mm_floor_ss(_mm_setzero_ps(), _mm_set_ss(0.5f + (-v + 1.f) * (float)(m.height - 1) * 0.5f)));
+    uint32_t clr = m.pixels[(uint32_t)V * m.stride + (uint32_t)U];
+    if (mark)
+      clr = 0xff000000 | ((clr >> 2) & 0x003f3f3f);
+    return clr;
+    }
+
+  // The scalar kernels handle the pixels [first, last) of the span.
+  inline void shade_row_scalar(uint32_t* out, const simd_g_buffer_span& pixels, uint32_t first, uint32_t last, const simd_matcap& m, int shading)
+    {
+    for (uint32_t i = first; i < last; ++i)
+      {
+      if (pixels.object_id[i] != (uint32_t)-1)
+        out[i] = shade_pixel(pixels, i, m, shading);
+      }
+    }
+
+  inline void splat_depth_row_scalar(float* z, const simd_g_buffer_span& pixels, uint32_t first, uint32_t last)
+    {
+    for (uint32_t i = first; i < last; ++i)
+      z[i] = pixels.db_id[i] != 0 ? 1.f / pixels.depth[i] : 0.f;
+    }
+
+  inline float abs_ss(float x)
+    {
+    return _mm_cvtss_f32(_mm_and_ps(_mm_set_ss(x), _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff))));
+    }
+
+  // Same tests as the edge, wireframe and one bit passes of canvas.
+  inline uint8_t edge_pixel(const simd_g_buffer_span& p, uint32_t i, const simd_g_buffer_span& up, float threshold)
+    {
+    const uint32_t id = p.object_id[i];
+    if (id == (uint32_t)-1)
+      return 0;
+    const float u = normal_u(p.normal[i]);
+    const float v = normal_v(p.normal[i]);
+    uint8_t flags = 0;
+    const uint32_t right_id = p.object_id[i + 1];
+    if (right_id != (uint32_t)-1)
+      {
+      if (abs_ss(u - normal_u(p.normal[i + 1])) > threshold || abs_ss(v - normal_v(p.normal[i + 1])) > threshold)
+        flags |= SIMD_EDGE_NORMAL_RIGHT;
+      if (right_id != id)
+        flags |= SIMD_EDGE_OBJECT_RIGHT;
+      }
+    const uint32_t up_id = up.object_id[i];
+    if (up_id != (uint32_t)-1)
+      {
+      if (abs_ss(u - normal_u(up.normal[i])) > threshold || abs_ss(v - normal_v(up.normal[i])) > threshold)
+        flags |= SIMD_EDGE_NORMAL_UP;
+      if (up_id != id)
+        flags |= SIMD_EDGE_OBJECT_UP;
+      }
+    return flags;
+    }
+
+  inline void edge_row_scalar(uint8_t* flags, const simd_g_buffer_span& pixels, const simd_g_buffer_span& up_pixels, uint32_t first, uint32_t last, float threshold)
+    {
+    for (uint32_t i = first; i < last; ++i)
+      flags[i] = edge_pixel(pixels, i, up_pixels, threshold);
+    }
+
+  /////////////////////////////////////////////////////////////////////
+  // eye-dome lighting
+  /////////////////////////////////////////////////////////////////////
+
+  /*
+  The response of a pixel is the mean over its eight neighbours of max(0, log2(depth) - log2(neighbour depth)), and its color is
+  scaled by exp(-edl_scale * strength * response). As the depths are stored inverted, the sum of the log differences is the log of
+  the product of the ratios z_neighbour / z, which leaves one log2 and one exp2 per pixel. Background neighbours count as far away.
+  The SIMD versions evaluate the same polynomials as edl_log2 and edl_exp2.
+  */
+  const float edl_scale = 300.f;
+  const float edl_max_ratio = 32768.f; // keeps the product of eight ratios finite
+
+  // Polynomial fits of log2 on [1, 2) and of exp2 on [0, 1), accurate to about 2e-4.
+  const float edl_log2_c0 = -2.4968459f, edl_log2_c1 = 4.0285475f, edl_log2_c2 = -2.0812137f, edl_log2_c3 = 0.62887341f, edl_log2_c4 = -0.079158128f;
+  const float edl_exp2_c1 = 0.69606564f, edl_exp2_c2 = 0.22449434f, edl_exp2_c3 = 0.079440238f;
+
+  // Multiplier of log2 of the product of the ratios for the exponent of exp2.
+  inline float edl_exponent_scale(float strength)
+    {
+    return -strength * edl_scale * 1.44269504f / 8.f;
+    }
+
+  // log2(x) for finite x >= 1
+  inline float edl_log2(float x)
+    {
+    uint32_t bits;
+    memcpy(&bits, &x, 4);
+    const float e = (float)((int32_t)(bits >> 23) - 127);
+    bits = (bits & 0x007fffff) | 0x3f800000;
+    float m;
+    memcpy(&m, &bits, 4);
+    return e + (edl_log2_c0 + m * (edl_log2_c1 + m * (edl_log2_c2 + m * (edl_log2_c3 + m * edl_log2_c4))));
+    }
+
+  // exp2(x) for x <= 0, flushed to 2^-126 below
+  inline float edl_exp2(float x)
+    {
+    x = x < -126.f ? -126.f : x;
+    const float xi = (float)(int32_t)x > x ? (float)(int32_t)x - 1.f : (float)(int32_t)x;
+    const float f = x - xi;
+    float p = 1.f + f * (edl_exp2_c1 + f * (edl_exp2_c2 + f * edl_exp2_c3));
+    uint32_t bits;
+    memcpy(&bits, &p, 4);
+    bits += (uint32_t)((int32_t)xi << 23);
+    memcpy(&p, &bits, 4);
+    return p;
+    }
+
+  inline uint32_t scale_color(uint32_t clr, uint32_t scale_256)
+    {
+    const uint32_t r = ((clr & 0xff) * scale_256) >> 8;
+    const uint32_t g = (((clr >> 8) & 0xff) * scale_256) >> 8;
+    const uint32_t b = (((clr >> 16) & 0xff) * scale_256) >> 8;
+    return (clr & 0xff000000) | (b << 16) | (g << 8) | r;
+    }
+
+  inline float edl_ratio(float z_neighbour, float inv_z)
+    {
+    const float r = z_neighbour * inv_z;
+    return r < 1.f ? 1.f : (r > edl_max_ratio ? edl_max_ratio : r);
+    }
+
+  // The pixels [first, last) of a row of nr_of_pixels, with the neighbours clamped to the row.
+  inline void edl_row_scalar(uint32_t* out, const simd_edl& e, uint32_t first, uint32_t last, uint32_t nr_of_pixels)
+    {
+    const float k = edl_exponent_scale(e.strength);
+    for (uint32_t i = first; i < last; ++i)
+      {
+      const float z = e.z[i];
+      if ((e.db_id[i] >> 29) != e.db_key || !(z > 0.f))
+        continue;
+      const uint32_t l = i >= e.radius ? i - e.radius : 0;
+      const uint32_t r = i + e.radius < nr_of_pixels ? i + e.radius : nr_of_pixels - 1;
+      const float inv_z = 1.f / z;
+      // same neighbour order and multiplication order as the SIMD versions, so that all of them round alike
+      const float neighbours[8] = { e.z[l], e.z[r], e.z_up[l], e.z_up[i], e.z_up[r], e.z_down[l], e.z_down[i], e.z_down[r] };
+      float product = 1.f;
+      for (float n : neighbours)
+        product *= edl_ratio(n, inv_z);
+      const float shade = edl_exp2(k * edl_log2(product));
+      out[i] = scale_color(out[i], (uint32_t)(shade * 256.f));
+      }
+    }
+
+  }
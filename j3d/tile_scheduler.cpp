@@ -0,0 +1,134 @@
+#include "tile_scheduler.h"
+
+#include <algorithm>
+#include <thread>
+
+namespace
+  {
+
+  uint32_t spread_bits(uint32_t v)
+    {
+    v &= 0x0000ffff;
+    v = (v | (v << 8)) & 0x00ff00ff;
+    v = (v | (v << 4)) & 0x0f0f0f0f;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+    }
+
+  uint32_t morton_code(uint32_t x, uint32_t y)
+    {
+    return spread_bits(x) | (spread_bits(y) << 1);
+    }
+
+  }
+
+tile_scheduler::tile_scheduler()
+  {
+  uint32_t nr_of_workers = std::thread::hardware_concurrency();
+  if (nr_of_workers == 0)
+    nr_of_workers = 1;
+  for (uint32_t i = 0; i < nr_of_workers; ++i)
+    _queues.emplace_back(new work_queue());
+  _steals.resize(nr_of_workers, 0);
+  }
+
+void tile_scheduler::make_tiles(int x0, int y0, int x1, int y1, int tile_size)
+  {
+  _tiles.clear();
+  if (x1 < x0 || y1 < y0)
+    {
+    _tile_times.clear();
+    return;
+    }
+  const uint32_t tiles_x = (uint32_t)((x1 - x0) / tile_size + 1);
+  const uint32_t tiles_y = (uint32_t)((y1 - y0) / tile_size + 1);
+  std::vector<std::pair<uint32_t, tile>> coded;
+  coded.reserve(tiles_x * tiles_y);
+  for (uint32_t ty = 0; ty < tiles_y; ++ty)
+    {
+    for (uint32_t tx = 0; tx < tiles_x; ++tx)
+      {
+      tile t;
+      t.x0 = x0 + (int)tx * tile_size;
+      t.y0 = y0 + (int)ty * tile_size;
+      t.x1 = std::min(t.x0 + tile_size - 1, x1);
+      t.y1 = std::min(t.y0 + tile_size - 1, y1);
+      coded.emplace_back(morton_code(tx, ty), t);
+      }
+    }
+  std::sort(coded.begin(), coded.end(), [](const std::pair<uint32_t, tile>& a, const std::pair<uint32_t, tile>& b)
+    {
+    return a.first < b.first;
+    });
+  _tiles.reserve(coded.size());
+  for (const auto& c : coded)
+    _tiles.push_back(c.second);
+  _tile_times.assign(_tiles.size(), 0.f);
+  }
+
+void tile_scheduler::_distribute()
+  {
+  const uint32_t nr_of_workers = (uint32_t)_queues.size();
+  const uint32_t nr_of_tiles = (uint32_t)_tiles.size();
+  for (uint32_t w = 0; w < nr_of_workers; ++w)
+    {
+    const uint32_t first = (uint32_t)(((uint64_t)nr_of_tiles * w) / nr_of_workers);
+    const uint32_t last = (uint32_t)(((uint64_t)nr_of_tiles * (w + 1)) / nr_of_workers);
+    _queues[w]->tiles.clear();
+    for (uint32_t i = first; i < last; ++i)
+      _queues[w]->tiles.push_back(i);
+    _steals[w] = 0;
+    }
+  }
+
+bool tile_scheduler::_next(uint32_t& tile_index, uint32_t worker)
+  {
+  const uint32_t nr_of_workers = (uint32_t)_queues.size();
+    {
+    work_queue& own = *_queues[worker];
+    std::scoped_lock lock(own.mut);
+    if (!own.tiles.empty())
+      {
+      tile_index = own.tiles.front();
+      own.tiles.pop_front();
+      return true;
+      }
+    }
+  for (uint32_t i = 1; i < nr_of_workers; ++i)
+    {
+    work_queue& victim = *_queues[(worker + i) % nr_of_workers];
+    std::scoped_lock lock(victim.mut);
+    if (!victim.tiles.empty())
+      {
+      tile_index = victim.tiles.back();
+      victim.tiles.pop_back();
+      ++_steals[worker];
+      return true;
+      }
+    }
+  return false;
+  }
+
+tile_statistics tile_scheduler::statistics() const
+  {
+  tile_statistics s;
+  s.nr_of_tiles = (uint32_t)_tile_times.size();
+  s.nr_of_steals = 0;
+  for (auto st : _steals)
+    s.nr_of_steals += st;
+  s.min_time_in_s = 0.0;
+  s.max_time_in_s = 0.0;
+  s.average_time_in_s = 0.0;
+  if (_tile_times.empty())
+    return s;
+  s.min_time_in_s = _tile_times.front();
+  for (float t : _tile_times)
+    {
+    s.min_time_in_s = std::min(s.min_time_in_s, (double)t);
+    s.max_time_in_s = std::max(s.max_time_in_s, (double)t);
+    s.average_time_in_s += t;
+    }
+  s.average_time_in_s /= (double)_tile_times.size();
+  return s;
+  }
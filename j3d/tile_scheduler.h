@@ -0,0 +1,97 @@
+#pragma once
+
+#include <jtk/concurrency.h>
+#include <jtk/timer.h>
+
+#include <stdint.h>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+struct tile
+  {
+  int x0, y0, x1, y1; // inclusive pixel bounds
+  };
+
+struct tile_statistics
+  {
+  uint32_t nr_of_tiles;
+  uint32_t nr_of_steals;
+  double min_time_in_s;
+  double max_time_in_s;
+  double average_time_in_s;
+  };
+
+/*
+Splits a pixel rectangle into square tiles in Morton order and hands them out to the workers of a thread pool.
+Every worker owns a deque with a contiguous run of tiles. It pops tiles from the front of its own deque,
+and when that runs dry it steals from the back of the deque of another worker. Neighbouring tiles thus
+mostly stay on the same worker, while expensive regions of the image get spread over idle workers.
+*/
+class tile_scheduler
+  {
+  public:
+    tile_scheduler();
+
+    void make_tiles(int x0, int y0, int x1, int y1, int tile_size = 16);
+
+    const std::vector<tile>& tiles() const { return _tiles; }
+
+    // Calls fun(const tile&) for every tile, and records the time it took per tile.
+    template <class TFunctor>
+    void run(TFunctor fun, jtk::thread_pool& tp)
+      {
+      _distribute();
+      jtk::pooled_parallel_for(uint32_t(0), (uint32_t)_queues.size(), [&](uint32_t worker)
+        {
+        uint32_t tile_index;
+        while (_next(tile_index, worker))
+          {
+          jtk::timer t;
+          t.start();
+          fun(_tiles[tile_index]);
+          _tile_times[tile_index] = (float)t.time_elapsed();
+          }
+        }, tp);
+      }
+
+    // Calls fun(const tile&) for every tile without a thread pool.
+    template <class TFunctor>
+    void run(TFunctor fun)
+      {
+      _distribute();
+      jtk::parallel_for(uint32_t(0), (uint32_t)_queues.size(), [&](uint32_t worker)
+        {
+        uint32_t tile_index;
+        while (_next(tile_index, worker))
+          {
+          jtk::timer t;
+          t.start();
+          fun(_tiles[tile_index]);
+          _tile_times[tile_index] = (float)t.time_elapsed();
+          }
+        });
+      }
+
+    // The time per tile of the last run, in the order of tiles().
+    const std::vector<float>& tile_times() const { return _tile_times; }
+
+    tile_statistics statistics() const;
+
+  private:
+    void _distribute();
+    bool _next(uint32_t& tile_index, uint32_t worker);
+
+  private:
+    struct work_queue
+      {
+      std::mutex mut;
+      std::deque<uint32_t> tiles;
+      };
+
+    std::vector<tile> _tiles;
+    std::vector<float> _tile_times;
+    std::vector<std::unique_ptr<work_queue>> _queues;
+    std::vector<uint32_t> _steals;
+  };
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+
+/*
+Lock free hand over of values from one producer thread to one consumer thread.
+The producer fills back() and calls publish(), the consumer calls acquire() and reads front().
+Neither side ever waits for the other: the third buffer holds the last published value until
+the consumer takes it, or until the producer publishes a newer one.
+*/
+template <class T>
+class triple_buffer
+  {
+  public:
+    triple_buffer() : _back(0), _front(1), _ready(2)
+      {
+      }
+
+    // producer side
+
+    T& back() { return _buffers[_back]; }
+
+    void publish()
+      {
+      _back = _ready.exchange(_back | fresh_bit, std::memory_order_acq_rel) & index_mask;
+      }
+
+    // consumer side
+
+    // Makes the last published value the front value. Returns false if nothing was published since the last call.
+    bool acquire()
+      {
+      if (!(_ready.load(std::memory_order_relaxed) & fresh_bit))
+        return false;
+      _front = _ready.exchange(_front, std::memory_order_acq_rel) & index_mask;
+      return true;
+      }
+
+    const T& front() const { return _buffers[_front]; }
+
+    T& front() { return _buffers[_front]; }
+
+    // Only while neither side is using the buffers.
+    T* buffers() { return _buffers; }
+
+  private:
+    enum { index_mask = 3, fresh_bit = 4 };
+
+    T _buffers[3];
+    uint32_t _back, _front;
+    std::atomic<uint32_t> _ready;
+  };
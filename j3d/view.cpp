@@ -1,4 +1,5 @@
 #include "view.h"
+#include "cpu.h"
 #include "mesh.h"
 #include "pc.h"
 #include "view.h"
@@ -38,45 +39,9 @@ namespace
     return v;
     }
 
-  void clear_screen(image<uint32_t>& screen, const uint32_t clr)
-    {
-    for (auto& v : screen)
-      v = clr;
-    }
-    
-  SDL_Surface* create_sdl_surface(const image<uint32_t>& im)
-    {
-    SDL_Surface* surf = SDL_CreateRGBSurface(0, im.width(), im.height(), 32, 0x000000ff, 0x0000ff00, 0x00ff0000, 0xff000000);
-    return surf;
-    }
-
-  void fill_rgba_buffer_with_image(void* buffer, uint32_t buffer_bytes_per_row, const image<uint32_t>& im)
-    {
-    const int32_t w = im.width();
-    const int32_t h = im.height();
-    for (int y = 0; y < h; ++y)
-      {
-      uint32_t* p_buffer_row = (uint32_t*)((uint8_t*)buffer + y * buffer_bytes_per_row);
-      const uint32_t* p_source_row = im.data() + (h-y-1)*im.stride();
-      for (int x = 0; x < w; ++x)
-        {
-        *p_buffer_row++ = *p_source_row++;
-        }
-      }
-    }
-  
-  void fill_sdl_surface(SDL_Surface* surf, const image<uint32_t>& im)
-    {
-    assert(surf->w == im.width());
-    assert(surf->h == im.height());
-    SDL_LockSurface(surf);
-    fill_rgba_buffer_with_image(surf->pixels, surf->pitch, im);
-    SDL_UnlockSurface(surf);
-    }
-
   }
 
-view::view() : _w(1600), _h(900), _window(nullptr), _canvas_texture(nullptr), _canvas_surface(nullptr), _renderer(nullptr)
+view::view() : _w(1600), _h(900), _window(nullptr), _canvas_texture(nullptr), _renderer(nullptr)
   {
   SDL_DisplayMode DM;
   SDL_GetCurrentDisplayMode(0, &DM);
@@ -93,12 +58,10 @@ view::view() : _w(1600), _h(900), _window(nullptr), _canvas_texture(nullptr), _c
 
   _quit = false;
   _refresh = true;
+  _wake_event = SDL_RegisterEvents(1);
 
   //prepare_window();
 
-  _screen = image<uint32_t>(_w, _h);
-  clear_screen(_screen, _settings._background);
-
   _m.left_dragging = false;
   _m.right_dragging = false;
   _m.right_button_down = false;
@@ -135,11 +98,13 @@ view::view() : _w(1600), _h(900), _window(nullptr), _canvas_texture(nullptr), _c
     _scene.min_bb[1] = 0.f;
     _scene.max_bb[2] = 0.f;
   }
-  
+  _camera = get_camera(_scene);
   }
 
 view::~view()
   {
+  _stop_render_thread();
+  _db.clear(); // joins the loader threads of streamed point clouds, which call back into the view
   std::string settings_path = get_settings_path();
   write_settings(_settings, settings_path.c_str());
   delete_window();
@@ -155,7 +120,7 @@ void view::delete_window()
   ImGui::DestroyContext();
 
   SDL_DestroyTexture(_canvas_texture);
-  SDL_FreeSurface(_canvas_surface);
+  _canvas_texture = nullptr;
   SDL_DestroyRenderer(_renderer);
   SDL_DestroyWindow(_window);
   _window = nullptr;
@@ -205,6 +170,7 @@ void view::update_current_folder(const std::string& folder)
 
 int64_t view::load_mesh_from_file(const char* filename)
   {
+  _canvas.cancel();
   std::scoped_lock lock(_mut);
   mesh m;
   std::string f(filename);
@@ -225,15 +191,18 @@ int64_t view::load_mesh_from_file(const char* filename)
   db_mesh->vertex_colors.swap(m.vertex_colors);
   db_mesh->cs = m.cs;
   db_mesh->visible = m.visible;
+  db_mesh->acceleration_structure_construction_time_in_s = 0.0;
+  db_mesh->bvh_sah_cost = 0.0;
   if (db_mesh->visible)
     {
     t.start();
     add_object(id, _scene, _db);
     db_mesh->acceleration_structure_construction_time_in_s = t.time_elapsed();
+    db_mesh->bvh_sah_cost = _scene.objects.back().bvh->sah_cost();
     }
   prepare_scene(_scene);
   if (_settings._auto_unzoom) {
-    ::unzoom(_scene);
+    ::unzoom(_camera, _scene);
   }
   _refresh = true;
   return (int64_t)id;
@@ -241,6 +210,7 @@ int64_t view::load_mesh_from_file(const char* filename)
 
 int64_t view::load_pc_from_file(const char* filename)
   {
+  _canvas.cancel();
   std::scoped_lock lock(_mut);
   pc point_cloud;
   std::string f(filename);
@@ -259,11 +229,32 @@ int64_t view::load_pc_from_file(const char* filename)
   db_pc->vertex_colors.swap(point_cloud.vertex_colors);
   db_pc->cs = point_cloud.cs;
   db_pc->visible = point_cloud.visible;
+  db_pc->stream = point_cloud.stream;
+  if (db_pc->stream)
+    {
+    db_pc->stream->set_memory_budget((uint64_t)_settings._point_cache_size_in_mb << 20);
+    // render the point clouds again as their chunks come in
+    db_pc->stream->set_on_load([this]()
+      {
+        {
+        std::scoped_lock lock(_request_mut);
+        if (!_request.mc)
+          return;
+        _request.invalidate |= RENDER_STAGE_POINTCLOUDS;
+        ++_request_generation;
+        }
+      _request_cv.notify_one();
+      });
+    }
   if (db_pc->visible)
+    {
+    t.start();
     add_object(id, _scene, _db);
+    db_pc->acceleration_structure_construction_time_in_s = t.time_elapsed();
+    }
   prepare_scene(_scene);
   if (_settings._auto_unzoom) {
-    ::unzoom(_scene);
+    ::unzoom(_camera, _scene);
   }
   _refresh = true;
   return (int64_t)id;
@@ -318,6 +309,7 @@ int64_t view::load_file(const char* filename)
     if (get_triangles(_db, (uint32_t)id)->empty()) // mesh without triangles? -> point cloud
       {
           {
+          _canvas.cancel();
           std::scoped_lock lock(_mut);
           remove_object((uint32_t)id, _scene);
           _db.delete_object_hard((uint32_t)id);
@@ -352,10 +344,22 @@ void view::save_mesh_to_file(int64_t id, const char* filename)
 void view::save_pc_to_file(int64_t id, const char* filename)
   {
   pc* p = _db.get_pc((uint32_t)id);
-  if (p && file_has_known_pc_extension(filename))
+  // a streamed cloud only has the chunks in its cache in memory, so it cannot be written out
+  if (p && !p->stream && file_has_known_pc_extension(filename))
     {
     std::string fn(filename);
-    if (write_to_file(*p, fn))
+    std::string ext = jtk::get_extension(fn);
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](char ch) {return (char)::tolower(ch); });
+    bool res = false;
+    if (ext == "pco")
+      {
+      // the points in the db are already sorted by the octree of the scene, so they are written as they are
+      auto it = std::find_if(_scene.pointclouds.begin(), _scene.pointclouds.end(), [&](const scene_pointcloud& so) { return so.db_id == (uint32_t)id; });
+      res = it != _scene.pointclouds.end() && it->octree && write_pco(*p, it->octree->nodes(), fn);
+      }
+    else
+      res = write_to_file(*p, fn);
+    if (res)
       {
       ::update_current_folder(_settings, filename);
       //std::string window_title = "j3d - " + std::string(filename);
@@ -406,6 +410,7 @@ void view::save_file(const char* filename)
 
 void view::clear_scene()
   {
+  _canvas.cancel();
   std::scoped_lock lock(_mut);
   for (const auto& meshes : _db.get_meshes())
     {
@@ -416,23 +421,108 @@ void view::clear_scene()
     remove_object(pcs.first, _scene);
     }
   _db.clear();
+  // the db hands out the same ids again, so the frame on screen must not be picked from until a new frame is rendered
+  _canvas.clear_frames();
   }
 
 void view::render_scene()
   {
-  // assumes a lock has been set already
-  _canvas.update_settings(_settings._canvas_settings);
-  _canvas.render_scene(&_scene);
-  _pixels = _canvas.get_pixels();
-  _canvas.canvas_to_image(_pixels, _matcap);
-  _canvas.render_pointclouds_on_image(&_scene, _pixels);
+    {
+    std::scoped_lock lock(_request_mut);
+    _request.camera = _camera;
+    _request.settings = _settings._canvas_settings;
+    _request.gradient_top = _settings._gradient_top;
+    _request.gradient_bottom = _settings._gradient_bottom;
+    if (!_request.mc || _request.mc->type != _matcap.type || _request.mc->filename != _matcap.filename || _requested_matcap_pixels != _matcap.im.data())
+      {
+      _request.mc = std::make_shared<const matcap>(_matcap);
+      _requested_matcap_pixels = _matcap.im.data();
+      }
+    ++_request_generation;
+    // Never cancel two frames in a row: while the camera keeps moving, frames that take longer
+    // than the mouse events would otherwise never be shown.
+    if (!_last_frame_cancelled)
+      _canvas.cancel();
+    }
+  _request_cv.notify_one();
   _refresh = false;
   }
 
+void view::_render_loop()
+  {
+  render_request request;
+  uint64_t generation = 0;
+  uint32_t gradient_top = 0, gradient_bottom = 0;
+  bool refine = false;
+  for (;;)
+    {
+      {
+      std::unique_lock<std::mutex> lock(_request_mut);
+      _request_cv.wait(lock, [&] { return _stop_rendering || refine || _request_generation != generation; });
+      if (_stop_rendering)
+        return;
+      if (_request_generation != generation)
+        {
+        request = _request;
+        generation = _request_generation;
+        _request.invalidate = 0;
+        }
+      _canvas.clear_cancel();
+      }
+    std::scoped_lock lock(_mut);
+    set_camera(_scene, request.camera);
+    if (request.gradient_top != gradient_top || request.gradient_bottom != gradient_bottom)
+      {
+      gradient_top = request.gradient_top;
+      gradient_bottom = request.gradient_bottom;
+      _canvas.set_background_color(gradient_top, gradient_bottom);
+      }
+    _canvas.invalidate(request.invalidate);
+    request.invalidate = 0;
+    _canvas.update_settings(request.settings);
+    auto tic = std::chrono::high_resolution_clock::now();
+    const uint32_t stages = _canvas.render(&_scene, *request.mc);
+    auto toc = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> diff = toc - tic;
+    const bool cancelled = _canvas.is_cancelled();
+    if (!cancelled)
+      {
+      _last_render_time_in_seconds = diff.count();
+      _canvas.set_last_frame_time(diff.count());
+      }
+    _last_frame_cancelled = cancelled;
+    if (stages & RENDER_STAGE_COMPOSITE)
+      wake();
+    // the camera stopped moving: refine the warped or coarse frame without waiting for a new request
+    refine = !cancelled && _canvas.needs_refinement();
+    }
+  }
+
+void view::_start_render_thread()
+  {
+  _stop_rendering = false;
+  _render_thread = std::thread(&view::_render_loop, this);
+  }
+
+void view::_stop_render_thread()
+  {
+  if (!_render_thread.joinable())
+    return;
+    {
+    std::scoped_lock lock(_request_mut);
+    _stop_rendering = true;
+    _canvas.cancel();
+    }
+  _request_cv.notify_one();
+  _render_thread.join();
+  }
 
 void view::force_redraw()
   {
-  std::scoped_lock lock(_mut);
+    {
+    std::scoped_lock lock(_request_mut);
+    _request.invalidate |= RENDER_STAGE_ALL;
+    }
   render_scene();
   }
 
@@ -440,14 +530,17 @@ jtk::vec3<float> view::get_world_position(int x, int y)
   {
   std::scoped_lock lock(_mut);
   jtk::vec3<float> invalid_vertex(std::numeric_limits<float>::quiet_NaN(), std::numeric_limits<float>::quiet_NaN(), std::numeric_limits<float>::quiet_NaN());
-  if (x < 0 || y < 0 || x >= (int)_pixels.width() || y >= (int)_pixels.height())
+  const g_buffer& pixels = _canvas.get_pixels();
+  if (x < 0 || y < 0 || x >= (int)pixels.width() || y >= (int)pixels.height())
     return invalid_vertex;
-  const auto& p = _pixels(x, y);
+  const pixel p = pixels(x, y);
   if (p.db_id == 0)
     return invalid_vertex;
   mesh* m = _db.get_mesh((uint32_t)p.db_id);
   if (m)
     {
+    if (p.object_id >= m->triangles.size())
+      return invalid_vertex;
     const uint32_t v0 = m->triangles[p.object_id][0];
     const uint32_t v1 = m->triangles[p.object_id][1];
     const uint32_t v2 = m->triangles[p.object_id][2];
@@ -459,10 +552,11 @@ jtk::vec3<float> view::get_world_position(int x, int y)
     return jtk::vec3<float>(world_pos[0], world_pos[1], world_pos[2]);
     }
   pc* ptcl = _db.get_pc((uint32_t)p.db_id);
-  if (ptcl)
+  jtk::vec3<float> V;
+  if (ptcl && get_vertex(V, _db, (uint32_t)p.db_id, p.object_id))
     {
-    const float4 pos(ptcl->vertices[p.object_id][0], ptcl->vertices[p.object_id][1], ptcl->vertices[p.object_id][2], 1.f);
-    auto world_pos = matrix_vector_multiply(m->cs, pos);
+    const float4 pos(V[0], V[1], V[2], 1.f);
+    auto world_pos = matrix_vector_multiply(ptcl->cs, pos);
     return jtk::vec3<float>(world_pos[0], world_pos[1], world_pos[2]);
     }
   return invalid_vertex;
@@ -471,21 +565,26 @@ jtk::vec3<float> view::get_world_position(int x, int y)
 uint32_t view::get_index(int x, int y)
   {
   std::scoped_lock lock(_mut);
-  if (x < 0 || y < 0 || x >= (int)_pixels.width() || y >= (int)_pixels.height())
+  const g_buffer& pixels = _canvas.get_pixels();
+  if (x < 0 || y < 0 || x >= (int)pixels.width() || y >= (int)pixels.height())
     return (uint32_t)(-1);
-  const auto& p = _pixels(x, y);
+  const pixel p = pixels(x, y);
   if (p.db_id == 0)
     return (uint32_t)(-1);
   uint32_t closest_v = get_closest_vertex(p, get_vertices(_db, p.db_id), get_triangles(_db, p.db_id));
+  pc* ptcl = _db.get_pc((uint32_t)p.db_id);
+  if (ptcl && closest_v < ptcl->original_ids.size())
+    return ptcl->original_ids[closest_v]; // the index in the file, not in the octree order of the db
   return closest_v;
   }
 
 uint32_t view::get_id(int x, int y)
   {
   std::scoped_lock lock(_mut);
-  if (x < 0 || y < 0 || x >= (int)_pixels.width() || y >= (int)_pixels.height())
+  const g_buffer& pixels = _canvas.get_pixels();
+  if (x < 0 || y < 0 || x >= (int)pixels.width() || y >= (int)pixels.height())
     return (uint32_t)0;
-  const auto& p = _pixels(x, y);
+  const pixel p = pixels(x, y);
   if (p.db_id == 0)
     return (uint32_t)0;
   return p.db_id;
@@ -529,8 +628,7 @@ void view::load_previous_file_in_folder()
 
 void view::unzoom()
   {
-  std::scoped_lock lock(_mut);
-  ::unzoom(_scene);
+  ::unzoom(_camera, _scene);
   _refresh = true;
   }
 
@@ -657,8 +755,7 @@ void view::process_keys()
     }
   else if (_key.is_pressed(SDLK_u))
     {
-    ::unzoom(_scene);
-    _refresh = true;
+    unzoom();
     }
   else if (_key.is_pressed(SDLK_v))
     {
@@ -676,15 +773,19 @@ void view::process_keys()
     }
   }
 
-void view::poll_for_events()
+bool view::poll_for_events()
   {
   _m.right_button_down = false;
   _m.left_button_down = false;
   _m.wheel_down = false;
   _key.initialise_for_new_events();
+  bool input = false;
   SDL_Event event;
   while (SDL_PollEvent(&event))
     {
+    if (event.type == _wake_event)
+      continue;
+    input = true;
     ImGui_ImplSDL2_ProcessEvent(&event);
     _key.handle_event(event);
     if (event.type == SDL_QUIT)
@@ -766,8 +867,6 @@ void view::poll_for_events()
         SDL_GetWindowSize(_window, &new_w, &new_h);
         _w = (uint32_t)new_w < _w_max ? (uint32_t)new_w : _w_max;
         _h = (uint32_t)new_h < _h_max ? (uint32_t)new_h : _h_max;
-        _screen = image<uint32_t>(_w, _h);
-        clear_screen(_screen, _settings._background);
         _canvas_pos_x = ((int32_t)_w - (int32_t)_canvas.width()) / 2;
         if (_canvas_pos_x & 3)
           _canvas_pos_x += 4 - (_canvas_pos_x & 3);
@@ -784,78 +883,34 @@ void view::poll_for_events()
       load_file(path.c_str());
       }
     }
+  return input;
   }
 
-void view::blit_screen_to_opengl_texture()
+void view::blit_canvas_to_texture(bool new_frame)
   {
-  if (_canvas_surface == nullptr)
+  if (_canvas_texture)
     {
-    _canvas_surface = create_sdl_surface(_screen);
-    fill_sdl_surface(_canvas_surface, _screen);
-    }
-  else
-    {
-    fill_sdl_surface(_canvas_surface, _screen);
-    SDL_DestroyTexture(_canvas_texture);
-    }
-  _canvas_texture = SDL_CreateTextureFromSurface(_renderer, _canvas_surface);
-  /*
-  glMatrixMode(GL_PROJECTION);
-  glLoadIdentity();
-  glOrtho(0, _w, 0, _h, 0, 1);
-  glMatrixMode(GL_MODELVIEW);
-  glViewport(0, 0, _w, _h);
-  glClear(GL_COLOR_BUFFER_BIT);
-
-  glEnable(GL_TEXTURE_2D);
-  glBindTexture(GL_TEXTURE_2D, _gl_texture);
-
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-
-
-  const uint32_t step_block_x = _w / _gl_texture_w + 1;
-  const uint32_t step_block_y = _h / _gl_texture_h + 1;
-
-  for (uint32_t block_y = 0; block_y < step_block_y; ++block_y)
-    {
-    for (uint32_t block_x = 0; block_x < step_block_x; ++block_x)
+    int texture_w, texture_h;
+    SDL_QueryTexture(_canvas_texture, nullptr, nullptr, &texture_w, &texture_h);
+    if ((uint32_t)texture_w != _canvas.width() || (uint32_t)texture_h != _canvas.height())
       {
-      const uint32_t x_offset = block_x * _gl_texture_w;
-      const uint32_t y_offset = block_y * _gl_texture_h;
-      uint32_t wi = std::min<uint32_t>(_gl_texture_w, _w - x_offset);
-      uint32_t he = std::min<uint32_t>(_gl_texture_h, _h - y_offset);
-
-      uint32_t* p_im_start = (uint32_t*)(_screen.row(y_offset) + x_offset);
-      glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-      glPixelStorei(GL_UNPACK_ROW_LENGTH, _screen.stride());
-      glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, wi, he, GL_RGBA, GL_UNSIGNED_BYTE, (void*)p_im_start);
-      gl_check_error("glTexSubImage2D in view.cpp");
-      const float tex_w = float(wi) / float(_gl_texture_w);
-      const float tex_h = float(he) / float(_gl_texture_h);
-
-      const float x0 = float(x_offset);
-      const float y0 = float(y_offset);
-
-      const float x1 = x0 + float(wi);
-      const float y1 = y0 + float(he);
-      glBegin(GL_TRIANGLE_STRIP);
-      glTexCoord2f(0.0, 0.0);
-      glVertex2f(x0, y0);
-      glTexCoord2f(tex_w, 0.0);
-      glVertex2f(x1, y0);
-      glTexCoord2f(0.0, tex_h);
-      glVertex2f(x0, y1);
-      glTexCoord2f(tex_w, tex_h);
-      glVertex2f(x1, y1);
-      glEnd();
-      gl_check_error("GL_TRIANGLE_STRIP in view.cpp");
+      SDL_DestroyTexture(_canvas_texture);
+      _canvas_texture = nullptr;
       }
     }
-    */
+  if (!_canvas_texture)
+    {
+    _canvas_texture = SDL_CreateTexture(_renderer, SDL_PIXELFORMAT_ABGR8888, SDL_TEXTUREACCESS_STREAMING, _canvas.width(), _canvas.height());
+    new_frame = true;
+    }
+  if (!new_frame)
+    return;
+  void* pixels;
+  int pitch;
+  if (SDL_LockTexture(_canvas_texture, nullptr, &pixels, &pitch) != 0)
+    return;
+  _canvas.blit_onto(pixels, pitch);
+  SDL_UnlockTexture(_canvas_texture);
   }
 
 void view::info()
@@ -877,7 +932,7 @@ void view::info()
     ImGui::End();
     return;
     }
-  uint32_t nr_of_vertices = (uint32_t)(m ? m->vertices.size() : p->vertices.size());
+  uint32_t nr_of_vertices = (uint32_t)(m ? m->vertices.size() : (p->stream ? p->stream->nr_of_points() : p->vertices.size()));
   ImGui::InputScalar("#vertices", ImGuiDataType_U32, &nr_of_vertices, 0, 0, 0, ImGuiInputTextFlags_ReadOnly);
   uint32_t nr_of_triangles = (uint32_t)(m ? m->triangles.size() : 0);
   ImGui::InputScalar("#triangles", ImGuiDataType_U32, &nr_of_triangles, 0, 0, 0, ImGuiInputTextFlags_ReadOnly);
@@ -895,7 +950,74 @@ void view::info()
     {
     float accelt = m->acceleration_structure_construction_time_in_s;
     ImGui::InputFloat("bvh construction (s)", &accelt, 0.f, 0.f, "%.6f", ImGuiInputTextFlags_ReadOnly);
+    float sah = (float)m->bvh_sah_cost;
+    ImGui::InputFloat("bvh SAH cost", &sah, 0.f, 0.f, "%.3f", ImGuiInputTextFlags_ReadOnly);
+    }
+  else
+    {
+    float octreet = (float)p->acceleration_structure_construction_time_in_s;
+    ImGui::InputFloat("octree construction (s)", &octreet, 0.f, 0.f, "%.6f", ImGuiInputTextFlags_ReadOnly);
+    if (p->stream)
+      {
+      uint32_t cache_in_mb = (uint32_t)(p->stream->memory_in_use() >> 20);
+      ImGui::InputScalar("point cache (MB)", ImGuiDataType_U32, &cache_in_mb, 0, 0, 0, ImGuiInputTextFlags_ReadOnly);
+      }
     }
+  ImGui::LabelText("simd", "%s", get_simd_kernels().name);
+  const tile_statistics ts = _canvas.get_frame().tiles;
+  uint32_t nr_of_tiles = ts.nr_of_tiles;
+  ImGui::InputScalar("#tiles", ImGuiDataType_U32, &nr_of_tiles, 0, 0, 0, ImGuiInputTextFlags_ReadOnly);
+  float tile_times[3] = { (float)(ts.min_time_in_s * 1000.0), (float)(ts.average_time_in_s * 1000.0), (float)(ts.max_time_in_s * 1000.0) };
+  ImGui::InputFloat3("tile min/avg/max (ms)", tile_times, "%.3f", ImGuiInputTextFlags_ReadOnly);
+  uint32_t nr_of_steals = ts.nr_of_steals;
+  ImGui::InputScalar("#stolen tiles", ImGuiDataType_U32, &nr_of_steals, 0, 0, 0, ImGuiInputTextFlags_ReadOnly);
+  uint32_t nr_of_traced_pixels = _canvas.get_nr_of_traced_pixels();
+  ImGui::InputScalar("#traced pixels", ImGuiDataType_U32, &nr_of_traced_pixels, 0, 0, 0, ImGuiInputTextFlags_ReadOnly);
+  uint32_t nr_of_splatted_points = _canvas.get_frame().nr_of_splatted_points;
+  ImGui::InputScalar("#splatted points", ImGuiDataType_U32, &nr_of_splatted_points, 0, 0, 0, ImGuiInputTextFlags_ReadOnly);
+  float resolution_scale = _canvas.get_resolution_scale();
+  ImGui::InputFloat("resolution scale", &resolution_scale, 0.f, 0.f, "%.3f", ImGuiInputTextFlags_ReadOnly);
+  ImGui::End();
+  }
+
+void view::clipping_planes()
+  {
+  ImGui::SetNextWindowSize(ImVec2(400, 300), ImGuiCond_FirstUseEver);
+  ImGui::SetNextWindowPos(ImVec2(14, 360), ImGuiCond_FirstUseEver);
+  if (!ImGui::Begin("Clipping planes", &_showClippingPlanes))
+    {
+    ImGui::End();
+    return;
+    }
+  const float center[3] = { (_scene.min_bb[0] + _scene.max_bb[0]) / 2.f, (_scene.min_bb[1] + _scene.max_bb[1]) / 2.f, (_scene.min_bb[2] + _scene.max_bb[2]) / 2.f };
+  bool changed = false;
+  for (uint32_t i = 0; i < max_clipping_planes; ++i)
+    {
+    clipping_plane& p = _settings._canvas_settings.clipping_planes[i];
+    ImGui::PushID((int)i);
+    changed |= ImGui::Checkbox(("Plane " + std::to_string(i + 1)).c_str(), &p.enabled);
+    if (p.enabled)
+      {
+      changed |= ImGui::DragFloat3("normal", p.normal, 0.01f, -1.f, 1.f, "%.3f");
+      changed |= ImGui::DragFloat("offset", &p.offset, _scene.diagonal / 500.f, 0.f, 0.f, "%.3f");
+      if (ImGui::Button("Through center"))
+        {
+        p.offset = p.normal[0] * center[0] + p.normal[1] * center[1] + p.normal[2] * center[2];
+        changed = true;
+        }
+      ImGui::SameLine();
+      if (ImGui::Button("Flip"))
+        {
+        for (int j = 0; j < 3; ++j)
+          p.normal[j] = -p.normal[j];
+        p.offset = -p.offset;
+        changed = true;
+        }
+      }
+    ImGui::PopID();
+    }
+  if (changed)
+    _refresh = true;
   ImGui::End();
   }
 
@@ -908,6 +1030,8 @@ void view::resize_canvas(uint32_t canvas_w, uint32_t canvas_h)
   //  canvas_w = _w;
   //if (canvas_h > _h)
   //  canvas_h = _h;
+  _canvas.cancel();
+  std::scoped_lock lock(_mut);
   _canvas.resize(canvas_w, canvas_h);
   _canvas.set_background_color(_settings._gradient_top, _settings._gradient_bottom);
   _canvas_pos_x = ((int32_t)_w - (int32_t)_canvas.width()) / 2;
@@ -931,27 +1055,21 @@ void view::do_canvas_mouse()
     if (_m.left_button_down || _m.right_button_down || _m.wheel_down)
       return;
     }
-  _canvas.do_mouse(_refresh, _m, _scene, (float)_canvas_pos_x, (float)_canvas_pos_y);
+  _canvas.do_mouse(_refresh, _m, _camera, (float)_canvas_pos_x, (float)_canvas_pos_y);
   }
 
 namespace
   {
-  void _draw_square(int x, int y, int size, jtk::image<uint32_t>& im, uint32_t clr)
+  void _draw_square(int x, int y, int size, SDL_Renderer* renderer, uint32_t clr)
     {
     int hs = (size - 1) / 2;
-    if (x >= hs && y >= hs && x < ((int)im.width() - hs) && y < ((int)im.height() - hs))
-      {
-      for (int a = x - hs; a <= x + hs; ++a)
-        {
-        im(a, y - hs) = clr;
-        im(a, y + hs) = clr;
-        }
-      for (int a = y - hs; a <= y + hs; ++a)
-        {
-        im(x - hs, a) = clr;
-        im(x + hs, a) = clr;
-        }
-      }
+    SDL_Rect rect;
+    rect.x = x - hs;
+    rect.y = y - hs;
+    rect.w = size;
+    rect.h = size;
+    SDL_SetRenderDrawColor(renderer, clr & 0xff, (clr >> 8) & 0xff, (clr >> 16) & 0xff, clr >> 24);
+    SDL_RenderDrawRect(renderer, &rect);
     }
   }
 
@@ -968,15 +1086,17 @@ void view::render_mouse()
   if (p_actual.db_id)
     {
     uint32_t closest_v = get_closest_vertex(p_actual, get_vertices(_db, p_actual.db_id), get_triangles(_db, p_actual.db_id));
-    auto V = (*get_vertices(_db, p_actual.db_id))[closest_v];
+    jtk::vec3<float> V;
+    if (!get_vertex(V, _db, p_actual.db_id, closest_v))
+      return;
     jtk::float4 V4(V[0], V[1], V[2], 1.f);
     V4 = jtk::matrix_vector_multiply(*get_cs(_db, p_actual.db_id), V4);
-    V4 = jtk::matrix_vector_multiply(_scene.coordinate_system_inv, V4);
+    V4 = jtk::matrix_vector_multiply(invert_orthonormal(_canvas.get_frame().coordinate_system), V4);
     V4 = jtk::matrix_vector_multiply(_canvas.get_projection_matrix(), V4);
     int x = (int)(((V4[0] / V4[3] + 1.f) / 2.f) * _canvas.width() - 0.5f);
     int y = (int)(((V4[1] / V4[3] + 1.f) / 2.f) * _canvas.height() - 0.5f);
-    _draw_square(x + _canvas_pos_x, _screen.height() - 1 - (y + _canvas_pos_y), 3, _screen, clr);
-    _draw_square(x + _canvas_pos_x, _screen.height() - 1 - (y + _canvas_pos_y), 5, _screen, 0xff000000);
+    _draw_square(x + _canvas_pos_x, y + _canvas_pos_y, 3, _renderer, clr);
+    _draw_square(x + _canvas_pos_x, y + _canvas_pos_y, 5, _renderer, 0xff000000);
     }
   }
 
@@ -1082,10 +1202,69 @@ void view::imgui_ui()
           _refresh = true;
         if (ImGui::MenuItem("Shadow", "s", &_settings._canvas_settings.shadow))
           _refresh = true;
+        if (ImGui::MenuItem("Ambient occlusion", nullptr, &_settings._canvas_settings.ambient_occlusion))
+          _refresh = true;
         if (ImGui::MenuItem("Edges", "e", &_settings._canvas_settings.edges))
           _refresh = true;
         if (ImGui::MenuItem("Vertex colors", "v", &_settings._canvas_settings.vertexcolors))
           _refresh = true;
+        if (ImGui::MenuItem("Reproject while moving", nullptr, &_settings._canvas_settings.reprojection))
+          _refresh = true;
+        if (ImGui::BeginMenu("Progressive"))
+          {
+          ImGui::MenuItem("Enabled", nullptr, &_settings._canvas_settings.progressive);
+          ImGui::SliderFloat("above frame time (ms)", &_settings._canvas_settings.progressive_threshold_in_ms, 0.f, 500.f, "%.0f");
+          bool density_4 = _settings._canvas_settings.progressive_density == 4;
+          bool density_16 = _settings._canvas_settings.progressive_density == 16;
+          if (ImGui::MenuItem("1/4 density while moving", nullptr, &density_4))
+            _settings._canvas_settings.progressive_density = 4;
+          if (ImGui::MenuItem("1/16 density while moving", nullptr, &density_16))
+            _settings._canvas_settings.progressive_density = 16;
+          ImGui::EndMenu();
+          }
+        if (ImGui::BeginMenu("Dynamic resolution"))
+          {
+          ImGui::MenuItem("Enabled", nullptr, &_settings._canvas_settings.dynamic_resolution);
+          ImGui::SliderFloat("frame budget (ms)", &_settings._canvas_settings.frame_budget_in_ms, 5.f, 200.f, "%.0f");
+          ImGui::EndMenu();
+          }
+        if (ImGui::BeginMenu("Anti-aliasing"))
+          {
+          int samples = (int)_settings._canvas_settings.antialiasing_samples;
+          if (ImGui::SliderInt("samples per pixel", &samples, 1, 256))
+            {
+            _settings._canvas_settings.antialiasing_samples = (uint32_t)samples;
+            _refresh = true;
+            }
+          ImGui::EndMenu();
+          }
+        if (ImGui::BeginMenu("Point clouds"))
+          {
+          int budget = (int)(_settings._canvas_settings.point_budget / 1000000);
+          if (ImGui::SliderInt("point budget (millions)", &budget, 1, 200))
+            {
+            _settings._canvas_settings.point_budget = (uint32_t)budget * 1000000;
+            _refresh = true;
+            }
+          if (ImGui::MenuItem("Eye-dome lighting", nullptr, &_settings._canvas_settings.eye_dome_lighting))
+            _refresh = true;
+          if (ImGui::SliderFloat("eye-dome lighting strength", &_settings._canvas_settings.eye_dome_lighting_strength, 0.1f, 10.f, "%.1f"))
+            _refresh = true;
+          int cache_size = (int)_settings._point_cache_size_in_mb;
+          if (ImGui::SliderInt("streaming cache (MB)", &cache_size, 64, 16384))
+            {
+            _settings._point_cache_size_in_mb = (uint32_t)cache_size;
+            for (const auto& pcs : _db.get_pcs())
+              {
+              if (pcs.second->stream)
+                pcs.second->stream->set_memory_budget((uint64_t)_settings._point_cache_size_in_mb << 20);
+              }
+            _refresh = true;
+            }
+          ImGui::EndMenu();
+          }
+        if (ImGui::MenuItem("Clipping planes"))
+          _showClippingPlanes = true;
         ImGui::Separator();
         if (ImGui::MenuItem("Unzoom", "u"))
           {
@@ -1147,7 +1326,6 @@ void view::imgui_ui()
           uint32_t b = (uint32_t)(coltop[2] * 255.f);
           uint32_t clr = 0xff000000 | (b << 16) | (g << 8) | r;
           _settings._gradient_top = clr;
-          _canvas.set_background_color(_settings._gradient_top, _settings._gradient_bottom);
           _refresh = true;
           }
         if (ImGui::ColorEdit3("Gradient bottom", colbottom))
@@ -1157,7 +1335,6 @@ void view::imgui_ui()
           uint32_t b = (uint32_t)(colbottom[2] * 255.f);
           uint32_t clr = 0xff000000 | (b << 16) | (g << 8) | r;
           _settings._gradient_bottom = clr;
-          _canvas.set_background_color(_settings._gradient_top, _settings._gradient_bottom);
           _refresh = true;
           }
         if (ImGui::ColorEdit3("Background", colback))
@@ -1174,7 +1351,6 @@ void view::imgui_ui()
           _settings._gradient_top = 0xff000000;
           _settings._gradient_bottom = 0xff404040;
           _settings._background = 0xff000000 | (uint32_t(49) << 16) | (uint32_t(49) << 8) | uint32_t(49);
-          _canvas.set_background_color(_settings._gradient_top, _settings._gradient_bottom);
           _refresh = true;
           }
         ImGui::EndMenu();
@@ -1194,7 +1370,7 @@ void view::imgui_ui()
     }
 
   static ImGuiFs::Dialog open_file_dlg(false, true, false);
-  const char* openFileChosenPath = open_file_dlg.chooseFileDialog(_openFileDialog, _settings._current_folder.c_str(), ".ply;.stl;.obj;.trc;.xyz;.pts;.gltf;.glb;.vox;.off", "Open file", ImVec2(-1, -1), ImVec2(50, 50));
+  const char* openFileChosenPath = open_file_dlg.chooseFileDialog(_openFileDialog, _settings._current_folder.c_str(), ".ply;.stl;.obj;.trc;.xyz;.pts;.pco;.gltf;.glb;.vox;.off", "Open file", ImVec2(-1, -1), ImVec2(50, 50));
   _openFileDialog = false;
   if (strlen(openFileChosenPath) > 0)
     {
@@ -1214,7 +1390,7 @@ void view::imgui_ui()
     }
 
   static ImGuiFs::Dialog save_file_dlg(false, false, false);
-  const char* saveFileChosenPath = save_file_dlg.saveFileDialog(_saveFileDialog, _settings._current_folder.c_str(), nullptr, ".ply;.stl;.obj;.trc;.xyz;.pts;.glb;.gltf;.vox;.off", "Save file as", ImVec2(-1, -1), ImVec2(50, 50));
+  const char* saveFileChosenPath = save_file_dlg.saveFileDialog(_saveFileDialog, _settings._current_folder.c_str(), nullptr, ".ply;.stl;.obj;.trc;.xyz;.pts;.pco;.glb;.gltf;.vox;.off", "Save file as", ImVec2(-1, -1), ImVec2(50, 50));
   _saveFileDialog = false;
   if (strlen(saveFileChosenPath) > 0)
     {
@@ -1232,6 +1408,9 @@ void view::imgui_ui()
   if (_showInfo)
     info();
 
+  if (_showClippingPlanes)
+    clipping_planes();
+
   //ImGui::ShowDemoWindow();
   ImGui::Render();
   }
@@ -1239,57 +1418,72 @@ void view::imgui_ui()
 void view::quit()
   {
   _quit = true;
+  wake();
+  }
+
+void view::wake()
+  {
+  if (_wake_event == (uint32_t)-1)
+    return;
+  SDL_Event event;
+  SDL_zero(event);
+  event.type = _wake_event;
+  SDL_PushEvent(&event);
   }
 
 void view::loop()
   {
   ImGuiIO& io = ImGui::GetIO();
+  _start_render_thread();
   while (!_quit)
     {
-
     if (_window)
       {
-      poll_for_events();
-      imgui_ui();
-      do_canvas_mouse();
-      process_keys();
+      // Nothing changed: sleep until input, a new frame of the render thread or a wake up comes in.
+      // The time out keeps the flags that are set from other threads, such as _suspend, responsive.
+      if (_active_frames == 0 && !_refresh)
+        SDL_WaitEventTimeout(nullptr, 250);
+      if (poll_for_events())
+        _active_frames = 3;
       }
 
+    const bool new_frame = _canvas.acquire_frame();
 
-    if (_refresh)
+    // skip the imgui frame, compositing and presenting when the screen would stay the same
+    const bool idle = _window && _active_frames == 0 && !_refresh && !new_frame;
+
+    if (_window && !idle)
       {
-          {
-          std::scoped_lock lock(_mut);
-          auto tic = std::chrono::high_resolution_clock::now();
-          render_scene();
-          auto toc = std::chrono::high_resolution_clock::now();
-          std::chrono::duration<double> diff = toc - tic;
-          _last_render_time_in_seconds = diff.count();
-          }
+      imgui_ui();
+      do_canvas_mouse();
+      process_keys();
       }
 
-    SDL_RenderSetScale(_renderer, io.DisplayFramebufferScale.x, io.DisplayFramebufferScale.y);
-    SDL_SetRenderDrawColor(_renderer, 10, 40, 80, 255);
-    SDL_RenderClear(_renderer);
-    
-    clear_screen(_screen, _settings._background);
-    _canvas.blit_onto(_screen, _canvas_pos_x, _canvas_pos_y);
+    if (_refresh)
+      render_scene();
 
-    if (_window)
+    if (_window && !idle)
       {
-      render_mouse();
-      blit_screen_to_opengl_texture();
+      SDL_RenderSetScale(_renderer, io.DisplayFramebufferScale.x, io.DisplayFramebufferScale.y);
+      const uint32_t bg = _settings._background;
+      SDL_SetRenderDrawColor(_renderer, bg & 0xff, (bg >> 8) & 0xff, (bg >> 16) & 0xff, 255);
+      SDL_RenderClear(_renderer);
+
+      blit_canvas_to_texture(new_frame);
       SDL_Rect destination;
-      destination.x = 0;
-      destination.y = 0;
-      destination.w = _screen.width();
-      destination.h = _screen.height();
+      destination.x = _canvas_pos_x;
+      destination.y = _canvas_pos_y;
+      destination.w = _canvas.width();
+      destination.h = _canvas.height();
       SDL_RenderCopy(_renderer, _canvas_texture, NULL, &destination);
+      render_mouse();
     
       ImGui_ImplSDLRenderer_RenderDrawData(ImGui::GetDrawData());
       SDL_RenderPresent(_renderer);
+      if (_active_frames)
+        --_active_frames;
       }
-    else
+    else if (!_window)
       std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(16.0));
 
     if (_suspend)
@@ -1304,6 +1498,8 @@ void view::loop()
       std::scoped_lock lock(_mut);
       _resume = false;
       prepare_window();
+      _active_frames = 3;
       }
     }
+  _stop_render_thread();
   }
@@ -13,8 +13,11 @@
 
 #include <jtk/qbvh.h>
 
+#include <atomic>
+#include <condition_variable>
 #include <mutex>
 #include <memory>
+#include <thread>
 
 class ear_detector;
 class face_detector;
@@ -61,6 +64,9 @@ class view
 
     void quit();
 
+    // Wakes up the ui thread if it is idle, e.g. because a new frame or a loaded file is waiting. Can be called from any thread.
+    void wake();
+
     void update_current_folder(const std::string& folder);
 
     void load_next_file_in_folder();
@@ -68,13 +74,17 @@ class view
 
     void info();
 
+    void clipping_planes();
+
   private:
 
     void imgui_ui();    
 
-    void poll_for_events();
+    // Returns true if an event other than a wake up came in.
+    bool poll_for_events();
 
-    void blit_screen_to_opengl_texture();
+    // Uploads the acquired frame of the canvas into _canvas_texture, if it is new or the texture had to be recreated.
+    void blit_canvas_to_texture(bool new_frame);
 
     void resize_canvas(uint32_t canvas_w, uint32_t canvas_h);
 
@@ -92,41 +102,66 @@ class view
 
     void clear_scene();
 
+    void _render_loop();
+
+    void _start_render_thread();
+
+    void _stop_render_thread();
+
     void _load_next_file_in_folder(int32_t step_size);
 
   private:
 
+    // The state that the ui thread hands over to the render thread for a frame
+    struct render_request
+      {
+      scene_camera camera;
+      canvas::canvas_settings settings;
+      uint32_t gradient_top, gradient_bottom;
+      std::shared_ptr<const matcap> mc;
+      uint32_t invalidate; // render_stage flags
+      };
+
     SDL_Window* _window;
     uint32_t _w, _h;
     uint32_t _w_max, _h_max;
     mouse_data _m;
     bool _quit;
     bool _refresh;
+    uint32_t _wake_event;
+    uint32_t _active_frames = 0; // the ui keeps drawing for a few frames after input, so that imgui can settle
     bool _suspend;
     bool _resume;
     scene _scene;
+    scene_camera _camera; // the camera of the ui, the camera of _scene belongs to the render thread
     db _db;
 
     SDL_Renderer* _renderer;
-    SDL_Surface* _canvas_surface;
-    SDL_Texture* _canvas_texture;
-
-    jtk::image<uint32_t> _screen;
+    SDL_Texture* _canvas_texture; // streaming texture of the size of the canvas
     canvas _canvas;
     settings _settings;
     int32_t _canvas_pos_x, _canvas_pos_y;
 
-    jtk::image<pixel> _pixels;
     matcap _matcap;
     keyboard_handler _key;
 
     std::mutex _mut;
 
+    std::thread _render_thread;
+    std::mutex _request_mut;
+    std::condition_variable _request_cv;
+    render_request _request;
+    uint64_t _request_generation = 0;
+    bool _stop_rendering = false;
+    const uint32_t* _requested_matcap_pixels = nullptr;
+    std::atomic<bool> _last_frame_cancelled{ false };
+
     bool _openFileDialog = false;
     bool _openMatCapFileDialog = false;
     bool _saveFileDialog = false;
     bool _screenshotDialog = false;
     bool _showInfo = false;
+    bool _showClippingPlanes = false;
 
-    double _last_render_time_in_seconds = 0.0;
+    std::atomic<double> _last_render_time_in_seconds{ 0.0 };
   };
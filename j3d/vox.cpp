@@ -5,6 +5,7 @@
 #include "ogt/ogt_voxel_meshify.h"
 
 #include "mesh.h"
+#include "wbvh.h"
 #include "jtk/concurrency.h"
 #include "jtk/qbvh.h"
 #include "jtk/file_utils.h"
@@ -304,7 +305,7 @@ namespace
     if (use_texture)
       use_vertex_colors = false;
 
-    std::unique_ptr<jtk::qbvh> bvh = std::unique_ptr<jtk::qbvh>(new jtk::qbvh(triangles, vertices.data()));
+    std::unique_ptr<wbvh> bvh = std::unique_ptr<wbvh>(new wbvh(triangles, vertices.data()));
 
     for (int direction_dim = 0; direction_dim < 3; ++direction_dim)
       {
@@ -0,0 +1,1457 @@
+#include "wbvh.h"
+#include "cpu.h"
+
+#include <jtk/concurrency.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <thread>
+
+using namespace jtk;
+
+static_assert(sizeof(vec3<float>) == 3 * sizeof(float), "the traversal kernels expect packed vertices");
+static_assert(sizeof(vec3<uint32_t>) == 3 * sizeof(uint32_t), "the traversal kernels expect packed triangles");
+
+namespace
+  {
+  const uint32_t wbvh_max_leaf_size = 4;
+  const uint32_t wbvh_number_of_bins = 16;
+  const uint32_t wbvh_max_build_depth = 40;
+  const uint32_t wbvh_stack_size = 256;
+  const uint32_t wbvh_parallel_build_size = 1 << 16; // smaller nodes are binned and partitioned on one thread, and smaller bvhs are built on one thread
+
+  struct build_node
+    {
+    float bbox_min[3];
+    float bbox_max[3];
+    uint32_t left, right;
+    uint32_t first, count; // count > 0 for leaves
+    };
+
+  inline float half_area(const float* bbox_min, const float* bbox_max)
+    {
+    const float dx = bbox_max[0] - bbox_min[0];
+    const float dy = bbox_max[1] - bbox_min[1];
+    const float dz = bbox_max[2] - bbox_min[2];
+    return dx * dy + dy * dz + dz * dx;
+    }
+
+  inline void init_bounds(float* bbox_min, float* bbox_max)
+    {
+    for (int j = 0; j < 3; ++j)
+      {
+      bbox_min[j] = std::numeric_limits<float>::infinity();
+      bbox_max[j] = -std::numeric_limits<float>::infinity();
+      }
+    }
+
+  inline void grow_bounds(float* bbox_min, float* bbox_max, const float* other_min, const float* other_max)
+    {
+    for (int j = 0; j < 3; ++j)
+      {
+      bbox_min[j] = std::min(bbox_min[j], other_min[j]);
+      bbox_max[j] = std::max(bbox_max[j], other_max[j]);
+      }
+    }
+
+  struct bin
+    {
+    float bbox_min[3];
+    float bbox_max[3];
+    uint32_t count;
+    };
+
+  // Bounds of the primitives and of their centroids.
+  struct range_bounds
+    {
+    float bbox_min[3], bbox_max[3];
+    float centroid_min[3], centroid_max[3];
+    };
+
+  struct deferred_subtree
+    {
+    uint32_t node_index;
+    uint32_t first, count;
+    uint32_t depth;
+    };
+
+  /*
+  Top down binned SAH builder. Nodes with at least wbvh_parallel_build_size primitives compute their bounds, bin and partition
+  their primitives in chunks on all threads. If a defer size is set, subtrees with at most that many primitives are not built,
+  but recorded in deferred with a placeholder node, so that they can be built independently on all threads afterwards.
+  */
+  class builder
+    {
+    public:
+      builder(const float* primitive_bounds, std::vector<uint32_t>& ids, uint32_t nr_of_threads = 1, uint32_t defer_size = 0) :
+        _bounds(primitive_bounds), _ids(ids), _nr_of_threads(nr_of_threads), _defer_size(defer_size)
+        {
+        }
+
+      uint32_t build(uint32_t first, uint32_t count, uint32_t depth)
+        {
+        const uint32_t node_index = (uint32_t)nodes.size();
+        nodes.emplace_back();
+        if (count <= _defer_size)
+          {
+          deferred_subtree d;
+          d.node_index = node_index;
+          d.first = first;
+          d.count = count;
+          d.depth = depth;
+          deferred.push_back(d);
+          return node_index;
+          }
+        build_node bn;
+        bn.first = first;
+        bn.count = count;
+        bn.left = bn.right = 0;
+        range_bounds rb = _compute_bounds(first, count);
+        for (int j = 0; j < 3; ++j)
+          {
+          bn.bbox_min[j] = rb.bbox_min[j];
+          bn.bbox_max[j] = rb.bbox_max[j];
+          }
+        nodes[node_index] = bn;
+        if (count <= 1)
+          return node_index;
+
+        uint32_t mid = first;
+        if (depth >= wbvh_max_build_depth)
+          mid = _median_split(first, count, rb.centroid_min, rb.centroid_max);
+        else
+          {
+          bool make_leaf = false;
+          mid = _sah_split(make_leaf, first, count, bn, rb.centroid_min, rb.centroid_max);
+          if (make_leaf)
+            return node_index;
+          }
+        if (mid == first || mid == first + count)
+          mid = first + count / 2;
+
+        const uint32_t left = build(first, mid - first, depth + 1);
+        const uint32_t right = build(mid, first + count - mid, depth + 1);
+        nodes[node_index].left = left;
+        nodes[node_index].right = right;
+        nodes[node_index].count = 0;
+        return node_index;
+        }
+
+      std::vector<build_node> nodes;
+      std::vector<deferred_subtree> deferred;
+
+    private:
+      uint32_t _nr_of_chunks(uint32_t count) const
+        {
+        return count >= wbvh_parallel_build_size ? _nr_of_threads : 1;
+        }
+
+      // Calls fun(chunk, begin, end) for nr_of_chunks consecutive parts of [first, first + count), in parallel if there is more than one.
+      template <class TFunctor>
+      void _for_each_chunk(uint32_t first, uint32_t count, uint32_t nr_of_chunks, TFunctor fun)
+        {
+        auto chunk = [&](uint32_t c)
+          {
+          fun(c, first + (uint32_t)((uint64_t)count * c / nr_of_chunks), first + (uint32_t)((uint64_t)count * (c + 1) / nr_of_chunks));
+          };
+        if (nr_of_chunks == 1)
+          chunk(0);
+        else
+          parallel_for(uint32_t(0), nr_of_chunks, chunk);
+        }
+
+      range_bounds _compute_bounds(uint32_t first, uint32_t count)
+        {
+        const uint32_t nr_of_chunks = _nr_of_chunks(count);
+        std::vector<range_bounds> chunk_bounds(nr_of_chunks);
+        _for_each_chunk(first, count, nr_of_chunks, [&](uint32_t c, uint32_t begin, uint32_t end)
+          {
+          range_bounds& rb = chunk_bounds[c];
+          init_bounds(rb.bbox_min, rb.bbox_max);
+          init_bounds(rb.centroid_min, rb.centroid_max);
+          for (uint32_t i = begin; i < end; ++i)
+            {
+            const float* b = _bounds + 6 * _ids[i];
+            grow_bounds(rb.bbox_min, rb.bbox_max, b, b + 3);
+            for (int j = 0; j < 3; ++j)
+              {
+              const float centroid = (b[j] + b[j + 3]) * 0.5f;
+              rb.centroid_min[j] = std::min(rb.centroid_min[j], centroid);
+              rb.centroid_max[j] = std::max(rb.centroid_max[j], centroid);
+              }
+            }
+          });
+        range_bounds rb = chunk_bounds[0];
+        for (uint32_t c = 1; c < nr_of_chunks; ++c)
+          {
+          grow_bounds(rb.bbox_min, rb.bbox_max, chunk_bounds[c].bbox_min, chunk_bounds[c].bbox_max);
+          grow_bounds(rb.centroid_min, rb.centroid_max, chunk_bounds[c].centroid_min, chunk_bounds[c].centroid_max);
+          }
+        return rb;
+        }
+
+      uint32_t _median_split(uint32_t first, uint32_t count, const float* centroid_min, const float* centroid_max)
+        {
+        int axis = 0;
+        for (int j = 1; j < 3; ++j)
+          if (centroid_max[j] - centroid_min[j] > centroid_max[axis] - centroid_min[axis])
+            axis = j;
+        const float* bounds = _bounds;
+        std::nth_element(_ids.begin() + first, _ids.begin() + first + count / 2, _ids.begin() + first + count, [&](uint32_t a, uint32_t b)
+          {
+          return bounds[6 * a + axis] + bounds[6 * a + axis + 3] < bounds[6 * b + axis] + bounds[6 * b + axis + 3];
+          });
+        return first + count / 2;
+        }
+
+      uint32_t _sah_split(bool& make_leaf, uint32_t first, uint32_t count, const build_node& bn, const float* centroid_min, const float* centroid_max)
+        {
+        float k[3];
+        for (int axis = 0; axis < 3; ++axis)
+          {
+          const float extent = centroid_max[axis] - centroid_min[axis];
+          k[axis] = extent > 0.f ? (float)wbvh_number_of_bins * (1.f - 1e-6f) / extent : 0.f;
+          }
+
+        // all three axes are binned in one pass over the primitives, per chunk
+        const uint32_t nr_of_chunks = _nr_of_chunks(count);
+        std::vector<bin> chunk_bins(nr_of_chunks * 3 * wbvh_number_of_bins);
+        _for_each_chunk(first, count, nr_of_chunks, [&](uint32_t c, uint32_t begin, uint32_t end)
+          {
+          bin* bins = chunk_bins.data() + c * 3 * wbvh_number_of_bins;
+          for (uint32_t i = 0; i < 3 * wbvh_number_of_bins; ++i)
+            {
+            init_bounds(bins[i].bbox_min, bins[i].bbox_max);
+            bins[i].count = 0;
+            }
+          for (uint32_t i = begin; i < end; ++i)
+            {
+            const float* b = _bounds + 6 * _ids[i];
+            for (int axis = 0; axis < 3; ++axis)
+              {
+              uint32_t bin_id = (uint32_t)(((b[axis] + b[axis + 3]) * 0.5f - centroid_min[axis]) * k[axis]);
+              if (bin_id >= wbvh_number_of_bins)
+                bin_id = wbvh_number_of_bins - 1;
+              bin& target = bins[axis * wbvh_number_of_bins + bin_id];
+              grow_bounds(target.bbox_min, target.bbox_max, b, b + 3);
+              ++target.count;
+              }
+            }
+          });
+        for (uint32_t c = 1; c < nr_of_chunks; ++c)
+          {
+          for (uint32_t i = 0; i < 3 * wbvh_number_of_bins; ++i)
+            {
+            const bin& other = chunk_bins[c * 3 * wbvh_number_of_bins + i];
+            grow_bounds(chunk_bins[i].bbox_min, chunk_bins[i].bbox_max, other.bbox_min, other.bbox_max);
+            chunk_bins[i].count += other.count;
+            }
+          }
+
+        float best_cost = std::numeric_limits<float>::max();
+        int best_axis = -1;
+        uint32_t best_bin = 0;
+        for (int axis = 0; axis < 3; ++axis)
+          {
+          if (k[axis] == 0.f)
+            continue;
+          const bin* bins = chunk_bins.data() + axis * wbvh_number_of_bins;
+          float right_area[wbvh_number_of_bins];
+          uint32_t right_count[wbvh_number_of_bins];
+          float bbox_min[3], bbox_max[3];
+          init_bounds(bbox_min, bbox_max);
+          uint32_t c = 0;
+          for (uint32_t i = wbvh_number_of_bins - 1; i > 0; --i)
+            {
+            grow_bounds(bbox_min, bbox_max, bins[i].bbox_min, bins[i].bbox_max);
+            c += bins[i].count;
+            right_area[i] = c ? half_area(bbox_min, bbox_max) : 0.f;
+            right_count[i] = c;
+            }
+          init_bounds(bbox_min, bbox_max);
+          c = 0;
+          for (uint32_t i = 0; i < wbvh_number_of_bins - 1; ++i)
+            {
+            grow_bounds(bbox_min, bbox_max, bins[i].bbox_min, bins[i].bbox_max);
+            c += bins[i].count;
+            if (c == 0 || right_count[i + 1] == 0)
+              continue;
+            const float cost = half_area(bbox_min, bbox_max) * c + right_area[i + 1] * right_count[i + 1];
+            if (cost < best_cost)
+              {
+              best_cost = cost;
+              best_axis = axis;
+              best_bin = i;
+              }
+            }
+          }
+
+        if (best_axis < 0) // all centroids coincide
+          {
+          make_leaf = count <= wbvh_max_leaf_size;
+          return first + count / 2;
+          }
+
+        const float node_area = half_area(bn.bbox_min, bn.bbox_max);
+        const float split_cost = 1.f + (node_area > 0.f ? best_cost / node_area : (float)count);
+        if (count <= wbvh_max_leaf_size && (float)count <= split_cost)
+          {
+          make_leaf = true;
+          return first;
+          }
+
+        const float kb = k[best_axis];
+        const float cmin = centroid_min[best_axis];
+        const float* bounds = _bounds;
+        auto goes_left = [&](uint32_t id)
+          {
+          const float* b = bounds + 6 * id;
+          uint32_t bin_id = (uint32_t)(((b[best_axis] + b[best_axis + 3]) * 0.5f - cmin) * kb);
+          if (bin_id >= wbvh_number_of_bins)
+            bin_id = wbvh_number_of_bins - 1;
+          return bin_id <= best_bin;
+          };
+        if (_nr_of_chunks(count) == 1)
+          {
+          auto it = std::partition(_ids.begin() + first, _ids.begin() + first + count, goes_left);
+          return (uint32_t)(it - _ids.begin());
+          }
+        return _parallel_partition(first, count, goes_left);
+        }
+
+      // Stable partition of [first, first + count) through a scratch buffer: every chunk counts its left primitives, and then scatters.
+      template <class TPredicate>
+      uint32_t _parallel_partition(uint32_t first, uint32_t count, TPredicate goes_left)
+        {
+        const uint32_t nr_of_chunks = _nr_of_chunks(count);
+        std::vector<uint32_t> left_count(nr_of_chunks, 0);
+        _for_each_chunk(first, count, nr_of_chunks, [&](uint32_t c, uint32_t begin, uint32_t end)
+          {
+          uint32_t n = 0;
+          for (uint32_t i = begin; i < end; ++i)
+            n += goes_left(_ids[i]) ? 1 : 0;
+          left_count[c] = n;
+          });
+        uint32_t total_left = 0;
+        for (uint32_t n : left_count)
+          total_left += n;
+        std::vector<uint32_t> scratch(count);
+        _for_each_chunk(first, count, nr_of_chunks, [&](uint32_t c, uint32_t begin, uint32_t end)
+          {
+          uint32_t left = 0;
+          for (uint32_t i = 0; i < c; ++i)
+            left += left_count[i];
+          uint32_t right = total_left + (begin - first) - left;
+          for (uint32_t i = begin; i < end; ++i)
+            {
+            const uint32_t id = _ids[i];
+            if (goes_left(id))
+              scratch[left++] = id;
+            else
+              scratch[right++] = id;
+            }
+          });
+        _for_each_chunk(first, count, nr_of_chunks, [&](uint32_t, uint32_t begin, uint32_t end)
+          {
+          std::copy(scratch.begin() + (begin - first), scratch.begin() + (end - first), _ids.begin() + begin);
+          });
+        return first + total_left;
+        }
+
+    private:
+      const float* _bounds;
+      std::vector<uint32_t>& _ids;
+      uint32_t _nr_of_threads;
+      uint32_t _defer_size;
+    };
+
+  /*
+  Builds the binary bvh over all primitives. Large inputs are split on all threads until there are a few subtrees per thread,
+  which are then built independently by the threads, and appended to the nodes in the order of the deferred list.
+  */
+  std::vector<build_node> build_binary_bvh(const float* primitive_bounds, std::vector<uint32_t>& ids)
+    {
+    const uint32_t nr_of_primitives = (uint32_t)ids.size();
+    uint32_t nr_of_threads = std::thread::hardware_concurrency();
+    if (nr_of_threads == 0)
+      nr_of_threads = 1;
+    if (nr_of_primitives < wbvh_parallel_build_size || nr_of_threads == 1)
+      {
+      builder b(primitive_bounds, ids);
+      b.build(0, nr_of_primitives, 0);
+      return std::move(b.nodes);
+      }
+
+    const uint32_t defer_size = std::max(nr_of_primitives / (8 * nr_of_threads), wbvh_parallel_build_size / 16);
+    builder top(primitive_bounds, ids, nr_of_threads, defer_size);
+    top.build(0, nr_of_primitives, 0);
+
+    // largest subtrees first, so that no thread is left with a big one at the end
+    std::vector<deferred_subtree>& deferred = top.deferred;
+    std::sort(deferred.begin(), deferred.end(), [](const deferred_subtree& a, const deferred_subtree& b) { return a.count > b.count; });
+    std::vector<std::vector<build_node>> subtrees(deferred.size());
+    std::atomic<uint32_t> next(0);
+    parallel_for(uint32_t(0), nr_of_threads, [&](uint32_t)
+      {
+      uint32_t d;
+      while ((d = next.fetch_add(1, std::memory_order_relaxed)) < (uint32_t)deferred.size())
+        {
+        builder b(primitive_bounds, ids);
+        b.build(deferred[d].first, deferred[d].count, deferred[d].depth);
+        subtrees[d].swap(b.nodes);
+        }
+      });
+
+    // the root of a subtree replaces its placeholder, its other nodes are appended
+    std::vector<build_node> nodes;
+    nodes.swap(top.nodes);
+    size_t total = nodes.size();
+    for (const auto& st : subtrees)
+      total += st.size() - 1;
+    nodes.reserve(total);
+    for (size_t d = 0; d < subtrees.size(); ++d)
+      {
+      const uint32_t offset = (uint32_t)nodes.size() - 1;
+      auto relocate = [&](build_node n)
+        {
+        if (n.count == 0)
+          {
+          n.left += offset;
+          n.right += offset;
+          }
+        return n;
+        };
+      nodes[deferred[d].node_index] = relocate(subtrees[d][0]);
+      for (size_t i = 1; i < subtrees[d].size(); ++i)
+        nodes.push_back(relocate(subtrees[d][i]));
+      subtrees[d].clear();
+      subtrees[d].shrink_to_fit();
+      }
+    return nodes;
+    }
+
+  template <int N, class TNode>
+  void collapse(std::vector<TNode>& out, uint32_t wide_index, const std::vector<build_node>& bn, uint32_t binary_index)
+    {
+    uint32_t children[N];
+    int nr_of_children = 0;
+    if (bn[binary_index].count > 0)
+      children[nr_of_children++] = binary_index;
+    else
+      {
+      children[nr_of_children++] = bn[binary_index].left;
+      children[nr_of_children++] = bn[binary_index].right;
+      }
+    while (nr_of_children < N)
+      {
+      int largest = -1;
+      float largest_area = -1.f;
+      for (int i = 0; i < nr_of_children; ++i)
+        {
+        const build_node& c = bn[children[i]];
+        if (c.count > 0)
+          continue;
+        const float a = half_area(c.bbox_min, c.bbox_max);
+        if (a > largest_area)
+          {
+          largest_area = a;
+          largest = i;
+          }
+        }
+      if (largest < 0)
+        break;
+      const uint32_t opened = children[largest];
+      children[largest] = bn[opened].left;
+      children[nr_of_children++] = bn[opened].right;
+      }
+
+    TNode node;
+    uint32_t inner[N];
+    int nr_of_inner = 0;
+    for (int i = 0; i < N; ++i)
+      {
+      if (i >= nr_of_children)
+        {
+        for (int j = 0; j < 3; ++j)
+          {
+          node.bbox_min[j][i] = std::numeric_limits<float>::infinity();
+          node.bbox_max[j][i] = -std::numeric_limits<float>::infinity();
+          }
+        node.child[i] = 0;
+        node.count[i] = 0;
+        continue;
+        }
+      const build_node& c = bn[children[i]];
+      for (int j = 0; j < 3; ++j)
+        {
+        node.bbox_min[j][i] = c.bbox_min[j];
+        node.bbox_max[j][i] = c.bbox_max[j];
+        }
+      if (c.count > 0)
+        {
+        node.child[i] = c.first;
+        node.count[i] = c.count;
+        }
+      else
+        {
+        node.child[i] = (uint32_t)out.size();
+        node.count[i] = 0;
+        out.emplace_back();
+        inner[nr_of_inner++] = i;
+        }
+      }
+    out[wide_index] = node;
+    for (int i = 0; i < nr_of_inner; ++i)
+      collapse<N>(out, node.child[inner[i]], bn, children[inner[i]]);
+    }
+
+  /*
+  Expected cost of a random ray through the wide bvh: every child box that is entered costs one node visit if it is
+  an inner node, and one triangle test per primitive if it is a leaf, weighted by the area of the box relative to the root.
+  The root itself costs one visit.
+  */
+  template <class TNode>
+  float compute_sah_cost(const std::vector<TNode>& nodes, const vec3<float>& min_bb, const vec3<float>& max_bb)
+    {
+    const float bbox_min[3] = { min_bb[0], min_bb[1], min_bb[2] };
+    const float bbox_max[3] = { max_bb[0], max_bb[1], max_bb[2] };
+    const float root_area = half_area(bbox_min, bbox_max);
+    if (!(root_area > 0.f))
+      return 0.f;
+    double cost = 0.0;
+    for (const auto& node : nodes)
+      {
+      const int width = (int)(sizeof(node.child) / sizeof(node.child[0]));
+      for (int i = 0; i < width; ++i)
+        {
+        if (node.bbox_min[0][i] > node.bbox_max[0][i])
+          continue;
+        const float child_min[3] = { node.bbox_min[0][i], node.bbox_min[1][i], node.bbox_min[2][i] };
+        const float child_max[3] = { node.bbox_max[0][i], node.bbox_max[1][i], node.bbox_max[2][i] };
+        cost += (double)half_area(child_min, child_max) * (node.count[i] > 0 ? (double)node.count[i] : 1.0);
+        }
+      }
+    return (float)(1.0 + cost / root_area);
+    }
+
+  struct single_ray
+    {
+    float orig[3];
+    float dir[3];
+    float inv_dir[3];
+    int sign[3];
+    float t_near;
+    float t_far;
+    };
+
+  inline float safe_inverse(float d)
+    {
+    if (std::abs(d) < 1e-20f)
+      d = std::signbit(d) ? -1e-20f : 1e-20f;
+    return 1.f / d;
+    }
+
+  inline void init_single_ray(single_ray& sr, const float* orig, const float* dir, float t_near, float t_far)
+    {
+    for (int j = 0; j < 3; ++j)
+      {
+      sr.orig[j] = orig[j];
+      sr.dir[j] = dir[j];
+      sr.inv_dir[j] = safe_inverse(dir[j]);
+      sr.sign[j] = sr.inv_dir[j] < 0.f ? 1 : 0;
+      }
+    sr.t_near = t_near;
+    sr.t_far = t_far;
+    }
+
+  inline void init_single_ray(single_ray& sr, const ray& r)
+    {
+    const float orig[3] = { r.orig[0], r.orig[1], r.orig[2] };
+    const float dir[3] = { r.dir[0], r.dir[1], r.dir[2] };
+    init_single_ray(sr, orig, dir, r.t_near, r.t_far);
+    }
+
+  inline void init_single_ray(single_ray& sr, const wbvh_ray_packet& rp, int lane)
+    {
+    float orig[3], dir[3];
+    for (int j = 0; j < 3; ++j)
+      {
+      orig[j] = ((const float*)&rp.orig[j])[lane];
+      dir[j] = ((const float*)&rp.dir[j])[lane];
+      }
+    init_single_ray(sr, orig, dir, ((const float*)&rp.t_near)[lane], ((const float*)&rp.t_far)[lane]);
+    }
+
+  /*
+  Closest hit traversal for a single ray, starting at the entry (start_child, start_count).
+  The leaf functor intersects the primitives [first, first + count) and lowers sr.t_far on a hit.
+  A leaf that lowers sr.t_far below sr.t_near ends the traversal, which is how the any hit queries stop.
+  */
+  template <class TLeaf>
+  void traverse(const wbvh_node4* nodes, uint32_t start_child, uint32_t start_count, single_ray& sr, TLeaf&& leaf)
+    {
+    struct entry
+      {
+      uint32_t child;
+      uint32_t count;
+      float t;
+      };
+    entry stack[wbvh_stack_size];
+    uint32_t stack_size = 0;
+    stack[stack_size++] = { start_child, start_count, sr.t_near };
+
+    const __m128 ox = _mm_set1_ps(sr.orig[0]);
+    const __m128 oy = _mm_set1_ps(sr.orig[1]);
+    const __m128 oz = _mm_set1_ps(sr.orig[2]);
+    const __m128 ix = _mm_set1_ps(sr.inv_dir[0]);
+    const __m128 iy = _mm_set1_ps(sr.inv_dir[1]);
+    const __m128 iz = _mm_set1_ps(sr.inv_dir[2]);
+    const __m128 t_near = _mm_set1_ps(sr.t_near);
+
+    while (stack_size)
+      {
+      const entry e = stack[--stack_size];
+      if (e.t > sr.t_far)
+        continue;
+      if (e.count)
+        {
+        leaf(e.child, e.count, sr);
+        if (sr.t_far < sr.t_near)
+          return;
+        continue;
+        }
+      const wbvh_node4& node = nodes[e.child];
+      const float* near_x = sr.sign[0] ? node.bbox_max[0] : node.bbox_min[0];
+      const float* near_y = sr.sign[1] ? node.bbox_max[1] : node.bbox_min[1];
+      const float* near_z = sr.sign[2] ? node.bbox_max[2] : node.bbox_min[2];
+      const float* far_x = sr.sign[0] ? node.bbox_min[0] : node.bbox_max[0];
+      const float* far_y = sr.sign[1] ? node.bbox_min[1] : node.bbox_max[1];
+      const float* far_z = sr.sign[2] ? node.bbox_min[2] : node.bbox_max[2];
+      __m128 tn = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(near_x), ox), ix), t_near);
+      tn = _mm_max_ps(tn, _mm_mul_ps(_mm_sub_ps(_mm_load_ps(near_y), oy), iy));
+      tn = _mm_max_ps(tn, _mm_mul_ps(_mm_sub_ps(_mm_load_ps(near_z), oz), iz));
+      __m128 tf = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(far_x), ox), ix), _mm_set1_ps(sr.t_far));
+      tf = _mm_min_ps(tf, _mm_mul_ps(_mm_sub_ps(_mm_load_ps(far_y), oy), iy));
+      tf = _mm_min_ps(tf, _mm_mul_ps(_mm_sub_ps(_mm_load_ps(far_z), oz), iz));
+      int mask = _mm_movemask_ps(_mm_cmple_ps(tn, tf));
+      if (!mask)
+        continue;
+      alignas(16) float t[4];
+      _mm_store_ps(t, tn);
+      uint32_t order[4];
+      int nr_of_hits = 0;
+      for (int i = 0; i < 4; ++i)
+        {
+        if (!(mask & (1 << i)))
+          continue;
+        int j = nr_of_hits++;
+        while (j > 0 && t[order[j - 1]] < t[i]) // farthest child first, so that the nearest is popped first
+          {
+          order[j] = order[j - 1];
+          --j;
+          }
+        order[j] = i;
+        }
+      for (int i = 0; i < nr_of_hits; ++i)
+        stack[stack_size++] = { node.child[order[i]], node.count[order[i]], t[order[i]] };
+      }
+    }
+
+  inline bool intersect_triangle(float& t, float& u, float& v, const single_ray& sr, const vec3<float>& V0, const vec3<float>& V1, const vec3<float>& V2)
+    {
+    const float e1[3] = { V1[0] - V0[0], V1[1] - V0[1], V1[2] - V0[2] };
+    const float e2[3] = { V2[0] - V0[0], V2[1] - V0[1], V2[2] - V0[2] };
+    const float p[3] = { sr.dir[1] * e2[2] - sr.dir[2] * e2[1], sr.dir[2] * e2[0] - sr.dir[0] * e2[2], sr.dir[0] * e2[1] - sr.dir[1] * e2[0] };
+    const float det = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+    if (det == 0.f)
+      return false;
+    const float inv_det = 1.f / det;
+    const float s[3] = { sr.orig[0] - V0[0], sr.orig[1] - V0[1], sr.orig[2] - V0[2] };
+    u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * inv_det;
+    if (u < 0.f || u > 1.f)
+      return false;
+    const float q[3] = { s[1] * e1[2] - s[2] * e1[1], s[2] * e1[0] - s[0] * e1[2], s[0] * e1[1] - s[1] * e1[0] };
+    v = (sr.dir[0] * q[0] + sr.dir[1] * q[1] + sr.dir[2] * q[2]) * inv_det;
+    if (v < 0.f || u + v > 1.f)
+      return false;
+    t = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) * inv_det;
+    return t > sr.t_near && t < sr.t_far;
+    }
+
+  inline void stop_traversal(single_ray& sr)
+    {
+    sr.t_far = -std::numeric_limits<float>::infinity();
+    }
+
+  struct single_hit
+    {
+    float u, v;
+    uint32_t triangle_id;
+    bool found;
+    };
+
+  inline void intersect_triangles(single_hit& h, const uint32_t* ids, uint32_t first, uint32_t count, single_ray& sr, const vec3<uint32_t>* triangles, const vec3<float>* vertices)
+    {
+    for (uint32_t i = first; i < first + count; ++i)
+      {
+      const uint32_t id = ids[i];
+      const vec3<uint32_t>& tria = triangles[id];
+      float t, u, v;
+      if (intersect_triangle(t, u, v, sr, vertices[tria[0]], vertices[tria[1]], vertices[tria[2]]))
+        {
+        sr.t_far = t;
+        h.u = u;
+        h.v = v;
+        h.triangle_id = id;
+        h.found = true;
+        }
+      }
+    }
+
+  inline __m128 lane_mask(int mask)
+    {
+    const __m128i bits = _mm_setr_epi32(1, 2, 4, 8);
+    return _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(mask), bits), bits));
+    }
+
+  inline float horizontal_min(__m128 v)
+    {
+    v = _mm_min_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+    v = _mm_min_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+    return _mm_cvtss_f32(v);
+    }
+
+  inline int first_lane(int mask)
+    {
+    int lane = 0;
+    while (!(mask & (1 << lane)))
+      ++lane;
+    return lane;
+    }
+
+  inline bool single_lane(int mask)
+    {
+    return (mask & (mask - 1)) == 0;
+    }
+
+  /*
+  Returns false if the lanes in mask do not share their direction signs. Packet traversal picks the near
+  and far slab per packet, so such a packet has diverged and is traced ray by ray instead.
+  */
+  inline bool packet_signs(int* sign, const wbvh_ray_packet& rp, int mask)
+    {
+    for (int j = 0; j < 3; ++j)
+      {
+      const int s = _mm_movemask_ps(rp.dir[j]) & mask;
+      if (s != 0 && s != mask)
+        return false;
+      sign[j] = s ? 1 : 0;
+      }
+    return true;
+    }
+
+  inline __m128 packet_inverse(__m128 d)
+    {
+    const __m128 sign_bit = _mm_set1_ps(-0.f);
+    const __m128 tiny = _mm_set1_ps(1e-20f);
+    const __m128 abs_d = _mm_andnot_ps(sign_bit, d);
+    const __m128 clamped = _mm_or_ps(_mm_max_ps(abs_d, tiny), _mm_and_ps(d, sign_bit));
+    return _mm_div_ps(_mm_set1_ps(1.f), clamped);
+    }
+
+  /*
+  Closest hit traversal for a packet of four rays that share their direction signs, through a hierarchy
+  with N children per node. The children are tested one at a time against all four rays.
+  leaf4(first, count, active) intersects the active lanes with a leaf and lowers rp.t_far on hits.
+  single(lane, child, count) traces one lane on its own from the given entry. It is used as soon as
+  only one ray of the packet is still active in a subtree.
+  */
+  template <int N, class TNode, class TLeaf4, class TSingle>
+  void traverse_packet(const TNode* nodes, wbvh_ray_packet& rp, const int* sign, int mask, TLeaf4&& leaf4, TSingle&& single)
+    {
+    struct alignas(16) entry
+      {
+      __m128 t;
+      uint32_t child;
+      uint32_t count;
+      };
+    entry stack[wbvh_stack_size * (N / 4)];
+    uint32_t stack_size = 0;
+    stack[stack_size].t = _mm_or_ps(_mm_and_ps(lane_mask(mask), rp.t_near), _mm_andnot_ps(lane_mask(mask), _mm_set1_ps(std::numeric_limits<float>::infinity())));
+    stack[stack_size].child = 0;
+    stack[stack_size].count = 0;
+    ++stack_size;
+
+    const __m128 inv_dir[3] = { packet_inverse(rp.dir[0]), packet_inverse(rp.dir[1]), packet_inverse(rp.dir[2]) };
+    const __m128 inf = _mm_set1_ps(std::numeric_limits<float>::infinity());
+
+    while (stack_size)
+      {
+      const entry e = stack[--stack_size];
+      const int active = _mm_movemask_ps(_mm_cmple_ps(e.t, rp.t_far)) & mask;
+      if (!active)
+        continue;
+      if (single_lane(active))
+        {
+        single(first_lane(active), e.child, e.count);
+        continue;
+        }
+      if (e.count)
+        {
+        leaf4(e.child, e.count, active);
+        continue;
+        }
+      const TNode& node = nodes[e.child];
+      const float* near_x = sign[0] ? node.bbox_max[0] : node.bbox_min[0];
+      const float* near_y = sign[1] ? node.bbox_max[1] : node.bbox_min[1];
+      const float* near_z = sign[2] ? node.bbox_max[2] : node.bbox_min[2];
+      const float* far_x = sign[0] ? node.bbox_min[0] : node.bbox_max[0];
+      const float* far_y = sign[1] ? node.bbox_min[1] : node.bbox_max[1];
+      const float* far_z = sign[2] ? node.bbox_min[2] : node.bbox_max[2];
+      const __m128 active_lanes = lane_mask(active);
+      __m128 child_t[N];
+      float key[N];
+      uint32_t order[N];
+      int nr_of_hits = 0;
+      for (int i = 0; i < N; ++i)
+        {
+        __m128 tn = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_set1_ps(near_x[i]), rp.orig[0]), inv_dir[0]), rp.t_near);
+        tn = _mm_max_ps(tn, _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(near_y[i]), rp.orig[1]), inv_dir[1]));
+        tn = _mm_max_ps(tn, _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(near_z[i]), rp.orig[2]), inv_dir[2]));
+        __m128 tf = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_set1_ps(far_x[i]), rp.orig[0]), inv_dir[0]), rp.t_far);
+        tf = _mm_min_ps(tf, _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(far_y[i]), rp.orig[1]), inv_dir[1]));
+        tf = _mm_min_ps(tf, _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(far_z[i]), rp.orig[2]), inv_dir[2]));
+        const __m128 hit = _mm_and_ps(_mm_cmple_ps(tn, tf), active_lanes);
+        if (!_mm_movemask_ps(hit))
+          continue;
+        child_t[i] = _mm_or_ps(_mm_and_ps(hit, tn), _mm_andnot_ps(hit, inf));
+        key[i] = horizontal_min(child_t[i]);
+        int j = nr_of_hits++;
+        while (j > 0 && key[order[j - 1]] < key[i])
+          {
+          order[j] = order[j - 1];
+          --j;
+          }
+        order[j] = i;
+        }
+      for (int i = 0; i < nr_of_hits; ++i)
+        {
+        stack[stack_size].t = child_t[order[i]];
+        stack[stack_size].child = node.child[order[i]];
+        stack[stack_size].count = node.count[order[i]];
+        ++stack_size;
+        }
+      }
+    }
+
+  inline void store_lanes(float* dest, __m128 value, __m128 m)
+    {
+    const __m128 old = _mm_loadu_ps(dest);
+    _mm_storeu_ps(dest, _mm_or_ps(_mm_and_ps(m, value), _mm_andnot_ps(m, old)));
+    }
+
+  inline int intersect_triangles_packet(wbvh_packet_hit& h, const uint32_t* ids, uint32_t first, uint32_t count, int active, wbvh_ray_packet& rp, const vec3<uint32_t>* triangles, const vec3<float>* vertices)
+    {
+    int updated = 0;
+    const __m128 active_lanes = lane_mask(active);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.f);
+    for (uint32_t i = first; i < first + count; ++i)
+      {
+      const uint32_t id = ids[i];
+      const vec3<uint32_t>& tria = triangles[id];
+      const vec3<float>& V0 = vertices[tria[0]];
+      const vec3<float>& V1 = vertices[tria[1]];
+      const vec3<float>& V2 = vertices[tria[2]];
+      const __m128 e1x = _mm_set1_ps(V1[0] - V0[0]);
+      const __m128 e1y = _mm_set1_ps(V1[1] - V0[1]);
+      const __m128 e1z = _mm_set1_ps(V1[2] - V0[2]);
+      const __m128 e2x = _mm_set1_ps(V2[0] - V0[0]);
+      const __m128 e2y = _mm_set1_ps(V2[1] - V0[1]);
+      const __m128 e2z = _mm_set1_ps(V2[2] - V0[2]);
+      const __m128 px = _mm_sub_ps(_mm_mul_ps(rp.dir[1], e2z), _mm_mul_ps(rp.dir[2], e2y));
+      const __m128 py = _mm_sub_ps(_mm_mul_ps(rp.dir[2], e2x), _mm_mul_ps(rp.dir[0], e2z));
+      const __m128 pz = _mm_sub_ps(_mm_mul_ps(rp.dir[0], e2y), _mm_mul_ps(rp.dir[1], e2x));
+      const __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+      const __m128 inv_det = _mm_div_ps(one, det);
+      const __m128 sx = _mm_sub_ps(rp.orig[0], _mm_set1_ps(V0[0]));
+      const __m128 sy = _mm_sub_ps(rp.orig[1], _mm_set1_ps(V0[1]));
+      const __m128 sz = _mm_sub_ps(rp.orig[2], _mm_set1_ps(V0[2]));
+      const __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), inv_det);
+      const __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+      const __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+      const __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+      const __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(rp.dir[0], qx), _mm_mul_ps(rp.dir[1], qy)), _mm_mul_ps(rp.dir[2], qz)), inv_det);
+      const __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv_det);
+      __m128 ok = _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmpge_ps(v, zero));
+      ok = _mm_and_ps(ok, _mm_cmple_ps(_mm_add_ps(u, v), one));
+      ok = _mm_and_ps(ok, _mm_cmpgt_ps(t, rp.t_near));
+      ok = _mm_and_ps(ok, _mm_cmplt_ps(t, rp.t_far));
+      ok = _mm_and_ps(ok, active_lanes);
+      const int hit_mask = _mm_movemask_ps(ok);
+      if (!hit_mask)
+        continue;
+      rp.t_far = _mm_or_ps(_mm_and_ps(ok, t), _mm_andnot_ps(ok, rp.t_far));
+      store_lanes(h.u, u, ok);
+      store_lanes(h.v, v, ok);
+      store_lanes(h.distance, t, ok);
+      for (int lane = 0; lane < 4; ++lane)
+        if (hit_mask & (1 << lane))
+          h.triangle_id[lane] = id;
+      updated |= hit_mask;
+      }
+    return updated;
+    }
+
+  inline void set_lane(__m128& v, int lane, float value)
+    {
+    alignas(16) float f[4];
+    _mm_store_ps(f, v);
+    f[lane] = value;
+    v = _mm_load_ps(f);
+    }
+
+  inline void transform_packet(wbvh_ray_packet& out, const wbvh_ray_packet& in, const float4x4& m)
+    {
+    for (int j = 0; j < 3; ++j)
+      {
+      const __m128 m0 = _mm_set1_ps(m[j]);
+      const __m128 m1 = _mm_set1_ps(m[j + 4]);
+      const __m128 m2 = _mm_set1_ps(m[j + 8]);
+      const __m128 m3 = _mm_set1_ps(m[j + 12]);
+      out.orig[j] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m0, in.orig[0]), _mm_mul_ps(m1, in.orig[1])), _mm_add_ps(_mm_mul_ps(m2, in.orig[2]), m3));
+      out.dir[j] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m0, in.dir[0]), _mm_mul_ps(m1, in.dir[1])), _mm_mul_ps(m2, in.dir[2]));
+      }
+    out.t_near = in.t_near;
+    out.t_far = in.t_far;
+    }
+
+  inline ray transform_ray(const ray& r, const float4x4& m, float t_far)
+    {
+    ray out;
+    float4 o(r.orig[0], r.orig[1], r.orig[2], 1.f);
+    float4 d(r.dir[0], r.dir[1], r.dir[2], 0.f);
+    out.orig = matrix_vector_multiply(m, o);
+    out.dir = matrix_vector_multiply(m, d);
+    out.t_near = r.t_near;
+    out.t_far = t_far;
+    return out;
+    }
+
+  inline void init_kernel_ray(wbvh_kernel_ray& kr, const ray& r)
+    {
+    for (int j = 0; j < 3; ++j)
+      {
+      kr.orig[j] = r.orig[j];
+      kr.dir[j] = r.dir[j];
+      }
+    kr.t_near = r.t_near;
+    kr.t_far = r.t_far;
+    }
+
+  inline void init_kernel_ray(wbvh_kernel_ray& kr, const single_ray& sr)
+    {
+    for (int j = 0; j < 3; ++j)
+      {
+      kr.orig[j] = sr.orig[j];
+      kr.dir[j] = sr.dir[j];
+      }
+    kr.t_near = sr.t_near;
+    kr.t_far = sr.t_far;
+    }
+
+  struct all_hits_collector
+    {
+    std::vector<hit>* hits;
+    std::vector<uint32_t>* triangle_ids;
+
+    static void add(void* context, uint32_t triangle_id, float distance, float u, float v)
+      {
+      all_hits_collector* c = (all_hits_collector*)context;
+      hit h;
+      h.u = u;
+      h.v = v;
+      h.distance = distance;
+      h.found = true;
+      c->hits->push_back(h);
+      c->triangle_ids->push_back(triangle_id);
+      }
+    };
+
+  }
+
+void make_ray_packet(wbvh_ray_packet& rp, const ray* rays, int mask)
+  {
+  alignas(16) float orig[3][4], dir[3][4], t_near[4], t_far[4];
+  for (int lane = 0; lane < 4; ++lane)
+    {
+    const bool valid = (mask & (1 << lane)) != 0;
+    for (int j = 0; j < 3; ++j)
+      {
+      orig[j][lane] = valid ? rays[lane].orig[j] : 0.f;
+      dir[j][lane] = valid ? rays[lane].dir[j] : 1.f;
+      }
+    t_near[lane] = valid ? rays[lane].t_near : 0.f;
+    t_far[lane] = valid ? rays[lane].t_far : 0.f;
+    }
+  for (int j = 0; j < 3; ++j)
+    {
+    rp.orig[j] = _mm_load_ps(orig[j]);
+    rp.dir[j] = _mm_load_ps(dir[j]);
+    }
+  rp.t_near = _mm_load_ps(t_near);
+  rp.t_far = _mm_load_ps(t_far);
+  }
+
+void init_packet_hit(wbvh_packet_hit& h)
+  {
+  for (int lane = 0; lane < 4; ++lane)
+    {
+    h.u[lane] = 0.f;
+    h.v[lane] = 0.f;
+    h.distance[lane] = std::numeric_limits<float>::max();
+    h.triangle_id[lane] = (uint32_t)-1;
+    h.two_level_index[lane] = (uint32_t)-1;
+    }
+  h.found = 0;
+  }
+
+uint32_t wbvh_default_width()
+  {
+  return get_cpu_isa() == cpu_isa::CPU_ISA_SSE41 ? 4 : 8;
+  }
+
+wbvh::wbvh(const std::vector<vec3<uint32_t>>& triangles, const vec3<float>* vertices, uint32_t width) : _width(width == 8 ? 8 : 4)
+  {
+  const uint32_t nr_of_triangles = (uint32_t)triangles.size();
+  std::vector<float> bounds(6 * (size_t)nr_of_triangles);
+  auto triangle_bounds = [&](uint32_t t)
+    {
+    const vec3<float>& V0 = vertices[triangles[t][0]];
+    const vec3<float>& V1 = vertices[triangles[t][1]];
+    const vec3<float>& V2 = vertices[triangles[t][2]];
+    float* b = bounds.data() + 6 * (size_t)t;
+    for (int j = 0; j < 3; ++j)
+      {
+      b[j] = std::min(std::min(V0[j], V1[j]), V2[j]);
+      b[j + 3] = std::max(std::max(V0[j], V1[j]), V2[j]);
+      }
+    };
+  if (nr_of_triangles >= wbvh_parallel_build_size)
+    parallel_for(uint32_t(0), nr_of_triangles, triangle_bounds);
+  else
+    {
+    for (uint32_t t = 0; t < nr_of_triangles; ++t)
+      triangle_bounds(t);
+    }
+  _build(bounds.data(), nr_of_triangles);
+  }
+
+wbvh::wbvh(const vec3<float>* primitive_min_bb, const vec3<float>* primitive_max_bb, uint32_t nr_of_primitives, uint32_t width) : _width(width == 8 ? 8 : 4)
+  {
+  std::vector<float> bounds(6 * (size_t)nr_of_primitives);
+  for (uint32_t i = 0; i < nr_of_primitives; ++i)
+    {
+    float* b = bounds.data() + 6 * (size_t)i;
+    for (int j = 0; j < 3; ++j)
+      {
+      b[j] = primitive_min_bb[i][j];
+      b[j + 3] = primitive_max_bb[i][j];
+      }
+    }
+  _build(bounds.data(), nr_of_primitives);
+  }
+
+void wbvh::_build(const float* primitive_bounds, uint32_t nr_of_primitives)
+  {
+  _min_bb = vec3<float>(0.f, 0.f, 0.f);
+  _max_bb = vec3<float>(0.f, 0.f, 0.f);
+  _sah_cost = 0.f;
+  _nodes.clear();
+  _nodes8.clear();
+  _primitive_ids.resize(nr_of_primitives);
+  if (nr_of_primitives == 0)
+    return;
+  for (uint32_t i = 0; i < nr_of_primitives; ++i)
+    _primitive_ids[i] = i;
+  std::vector<build_node> binary_nodes = build_binary_bvh(primitive_bounds, _primitive_ids);
+  for (int j = 0; j < 3; ++j)
+    {
+    _min_bb[j] = binary_nodes[0].bbox_min[j];
+    _max_bb[j] = binary_nodes[0].bbox_max[j];
+    }
+  if (_width == 8)
+    {
+    _nodes8.reserve(binary_nodes.size() / 4 + 1);
+    _nodes8.emplace_back();
+    collapse<8>(_nodes8, 0, binary_nodes, 0);
+    _sah_cost = compute_sah_cost(_nodes8, _min_bb, _max_bb);
+    }
+  else
+    {
+    _nodes.reserve(binary_nodes.size() / 2 + 1);
+    _nodes.emplace_back();
+    collapse<4>(_nodes, 0, binary_nodes, 0);
+    _sah_cost = compute_sah_cost(_nodes, _min_bb, _max_bb);
+    }
+  }
+
+hit wbvh::find_closest_triangle(uint32_t& triangle_id, const ray& r, const vec3<uint32_t>* triangles, const vec3<float>* vertices) const
+  {
+  hit h;
+  h.found = false;
+  h.u = 0.f;
+  h.v = 0.f;
+  h.distance = r.t_far;
+  if (empty())
+    return h;
+  if (_width == 8)
+    {
+    wbvh_kernel_ray kr;
+    init_kernel_ray(kr, r);
+    wbvh_kernel_hit kh;
+    kh.found = 0;
+    get_simd_kernels().wbvh8_closest_hit(kh, kr, _nodes8.data(), 0, 0, _primitive_ids.data(), (const uint32_t*)triangles, (const float*)vertices);
+    if (kh.found)
+      {
+      h.found = true;
+      h.u = kh.u;
+      h.v = kh.v;
+      h.distance = kr.t_far;
+      triangle_id = kh.triangle_id;
+      }
+    return h;
+    }
+  single_ray sr;
+  init_single_ray(sr, r);
+  single_hit sh;
+  sh.found = false;
+  const uint32_t* ids = _primitive_ids.data();
+  traverse(_nodes.data(), 0, 0, sr, [&](uint32_t first, uint32_t count, single_ray& s)
+    {
+    intersect_triangles(sh, ids, first, count, s, triangles, vertices);
+    });
+  if (sh.found)
+    {
+    h.found = true;
+    h.u = sh.u;
+    h.v = sh.v;
+    h.distance = sr.t_far;
+    triangle_id = sh.triangle_id;
+    }
+  return h;
+  }
+
+int wbvh::find_closest_triangles(wbvh_packet_hit& h, wbvh_ray_packet& rp, int mask, const vec3<uint32_t>* triangles, const vec3<float>* vertices) const
+  {
+  if (empty() || !mask)
+    return 0;
+  int updated = 0;
+  const uint32_t* ids = _primitive_ids.data();
+  auto single = [&](int lane, uint32_t child, uint32_t count)
+    {
+    single_ray sr;
+    init_single_ray(sr, rp, lane);
+    single_hit sh;
+    sh.found = false;
+    if (_width == 8)
+      {
+      wbvh_kernel_ray kr;
+      init_kernel_ray(kr, sr);
+      wbvh_kernel_hit kh;
+      kh.found = 0;
+      get_simd_kernels().wbvh8_closest_hit(kh, kr, _nodes8.data(), child, count, ids, (const uint32_t*)triangles, (const float*)vertices);
+      sh.found = kh.found != 0;
+      sh.u = kh.u;
+      sh.v = kh.v;
+      sh.triangle_id = kh.triangle_id;
+      sr.t_far = kr.t_far;
+      }
+    else
+      {
+      traverse(_nodes.data(), child, count, sr, [&](uint32_t first, uint32_t cnt, single_ray& s)
+        {
+        intersect_triangles(sh, ids, first, cnt, s, triangles, vertices);
+        });
+      }
+    if (sh.found)
+      {
+      h.u[lane] = sh.u;
+      h.v[lane] = sh.v;
+      h.distance[lane] = sr.t_far;
+      h.triangle_id[lane] = sh.triangle_id;
+      set_lane(rp.t_far, lane, sr.t_far);
+      updated |= 1 << lane;
+      }
+    };
+  auto leaf4 = [&](uint32_t first, uint32_t count, int active)
+    {
+    updated |= intersect_triangles_packet(h, ids, first, count, active, rp, triangles, vertices);
+    };
+  int sign[3];
+  if (!packet_signs(sign, rp, mask))
+    {
+    for (int lane = 0; lane < 4; ++lane)
+      if (mask & (1 << lane))
+        single(lane, 0, 0);
+    }
+  else if (_width == 8)
+    traverse_packet<8>(_nodes8.data(), rp, sign, mask, leaf4, single);
+  else
+    traverse_packet<4>(_nodes.data(), rp, sign, mask, leaf4, single);
+  h.found |= updated;
+  return updated;
+  }
+
+bool wbvh::is_occluded(const ray& r, const vec3<uint32_t>* triangles, const vec3<float>* vertices) const
+  {
+  if (empty())
+    return false;
+  if (_width == 8)
+    {
+    wbvh_kernel_ray kr;
+    init_kernel_ray(kr, r);
+    return get_simd_kernels().wbvh8_any_hit(kr, _nodes8.data(), _primitive_ids.data(), (const uint32_t*)triangles, (const float*)vertices) != 0;
+    }
+  single_ray sr;
+  init_single_ray(sr, r);
+  bool occluded = false;
+  const uint32_t* ids = _primitive_ids.data();
+  traverse(_nodes.data(), 0, 0, sr, [&](uint32_t first, uint32_t count, single_ray& s)
+    {
+    for (uint32_t i = first; i < first + count; ++i)
+      {
+      const uint32_t id = ids[i];
+      const vec3<uint32_t>& tria = triangles[id];
+      float t, u, v;
+      if (intersect_triangle(t, u, v, s, vertices[tria[0]], vertices[tria[1]], vertices[tria[2]]))
+        {
+        occluded = true;
+        stop_traversal(s);
+        return;
+        }
+      }
+    });
+  return occluded;
+  }
+
+std::vector<hit> wbvh::find_all_triangles(std::vector<uint32_t>& triangle_ids, const ray& r, const vec3<uint32_t>* triangles, const vec3<float>* vertices) const
+  {
+  std::vector<hit> hits;
+  triangle_ids.clear();
+  if (empty())
+    return hits;
+  all_hits_collector collector;
+  collector.hits = &hits;
+  collector.triangle_ids = &triangle_ids;
+  if (_width == 8)
+    {
+    wbvh_kernel_ray kr;
+    init_kernel_ray(kr, r);
+    get_simd_kernels().wbvh8_all_hits(kr, _nodes8.data(), _primitive_ids.data(), (const uint32_t*)triangles, (const float*)vertices, &all_hits_collector::add, &collector);
+    return hits;
+    }
+  single_ray sr;
+  init_single_ray(sr, r);
+  const uint32_t* ids = _primitive_ids.data();
+  traverse(_nodes.data(), 0, 0, sr, [&](uint32_t first, uint32_t count, single_ray& s)
+    {
+    for (uint32_t i = first; i < first + count; ++i)
+      {
+      const uint32_t id = ids[i];
+      const vec3<uint32_t>& tria = triangles[id];
+      float t, u, v;
+      if (intersect_triangle(t, u, v, s, vertices[tria[0]], vertices[tria[1]], vertices[tria[2]]))
+        all_hits_collector::add(&collector, id, t, u, v);
+      }
+    });
+  return hits;
+  }
+
+wbvh_two_level_with_transformations::wbvh_two_level_with_transformations(const wbvh* const* objects, const float4x4* transformations, uint32_t nr_of_objects)
+  {
+  std::vector<uint32_t> subset(nr_of_objects);
+  for (uint32_t i = 0; i < nr_of_objects; ++i)
+    subset[i] = i;
+  _build(objects, transformations, subset.data(), nr_of_objects);
+  }
+
+wbvh_two_level_with_transformations::wbvh_two_level_with_transformations(const wbvh* const* objects, const float4x4* transformations, const uint32_t* subset, uint32_t subset_size)
+  {
+  _build(objects, transformations, subset, subset_size);
+  }
+
+void wbvh_two_level_with_transformations::_build(const wbvh* const* objects, const float4x4* transformations, const uint32_t* subset, uint32_t subset_size)
+  {
+  std::vector<vec3<float>> min_bb, max_bb;
+  min_bb.reserve(subset_size);
+  max_bb.reserve(subset_size);
+  for (uint32_t j = 0; j < subset_size; ++j)
+    {
+    const uint32_t i = subset[j];
+    vec3<float> bmin(std::numeric_limits<float>::infinity(), std::numeric_limits<float>::infinity(), std::numeric_limits<float>::infinity());
+    vec3<float> bmax(-std::numeric_limits<float>::infinity(), -std::numeric_limits<float>::infinity(), -std::numeric_limits<float>::infinity());
+    if (!objects[i]->empty())
+      {
+      const vec3<float>& omin = objects[i]->min_bb();
+      const vec3<float>& omax = objects[i]->max_bb();
+      for (int corner = 0; corner < 8; ++corner)
+        {
+        vec3<float> c((corner & 1) ? omax[0] : omin[0], (corner & 2) ? omax[1] : omin[1], (corner & 4) ? omax[2] : omin[2]);
+        vec3<float> tc = transform(transformations[i], c);
+        bmin = min(bmin, tc);
+        bmax = max(bmax, tc);
+        }
+      }
+    else
+      {
+      // empty objects keep a degenerate box at the origin; the leaves skip them
+      bmin = vec3<float>(0.f, 0.f, 0.f);
+      bmax = vec3<float>(0.f, 0.f, 0.f);
+      }
+    min_bb.push_back(bmin);
+    max_bb.push_back(bmax);
+    }
+  // the top level is always 4 wide: it holds few objects, and its leaves call back into the object hierarchies
+  _top.reset(new wbvh(min_bb.data(), max_bb.data(), subset_size, 4));
+  // the leaves refer to positions in subset: map them to the indices of the objects
+  _ids.resize(_top->primitive_ids().size());
+  for (size_t k = 0; k < _ids.size(); ++k)
+    _ids[k] = subset[_top->primitive_ids()[k]];
+  }
+
+hit wbvh_two_level_with_transformations::find_closest_triangle(uint32_t& triangle_id, uint32_t& two_level_index, const ray& r, const wbvh* const* objects, const float4x4* inverted_transformations, const vec3<uint32_t>* const* triangles, const vec3<float>* const* vertices) const
+  {
+  hit h;
+  h.found = false;
+  h.u = 0.f;
+  h.v = 0.f;
+  h.distance = r.t_far;
+  if (_top->empty())
+    return h;
+  single_ray sr;
+  init_single_ray(sr, r);
+  const uint32_t* ids = _ids.data();
+  traverse(_top->nodes().data(), 0, 0, sr, [&](uint32_t first, uint32_t count, single_ray& s)
+    {
+    for (uint32_t i = first; i < first + count; ++i)
+      {
+      const uint32_t obj = ids[i];
+      if (objects[obj]->empty())
+        continue;
+      const ray local = transform_ray(r, inverted_transformations[obj], s.t_far);
+      uint32_t id;
+      hit local_hit = objects[obj]->find_closest_triangle(id, local, triangles[obj], vertices[obj]);
+      if (local_hit.found && local_hit.distance < s.t_far)
+        {
+        s.t_far = local_hit.distance;
+        h = local_hit;
+        triangle_id = id;
+        two_level_index = obj;
+        }
+      }
+    });
+  return h;
+  }
+
+bool wbvh_two_level_with_transformations::is_occluded(const ray& r, const wbvh* const* objects, const float4x4* inverted_transformations, const vec3<uint32_t>* const* triangles, const vec3<float>* const* vertices) const
+  {
+  if (_top->empty())
+    return false;
+  single_ray sr;
+  init_single_ray(sr, r);
+  bool occluded = false;
+  const uint32_t* ids = _ids.data();
+  traverse(_top->nodes().data(), 0, 0, sr, [&](uint32_t first, uint32_t count, single_ray& s)
+    {
+    for (uint32_t i = first; i < first + count; ++i)
+      {
+      const uint32_t obj = ids[i];
+      if (objects[obj]->empty())
+        continue;
+      const ray local = transform_ray(r, inverted_transformations[obj], r.t_far);
+      if (objects[obj]->is_occluded(local, triangles[obj], vertices[obj]))
+        {
+        occluded = true;
+        stop_traversal(s);
+        return;
+        }
+      }
+    });
+  return occluded;
+  }
+
+void wbvh_two_level_with_transformations::find_closest_triangles(wbvh_packet_hit& h, const wbvh_ray_packet& rp_in, int mask, const wbvh* const* objects, const float4x4* inverted_transformations, const vec3<uint32_t>* const* triangles, const vec3<float>* const* vertices) const
+  {
+  if (_top->empty() || !mask)
+    return;
+  wbvh_ray_packet rp = rp_in;
+  const uint32_t* ids = _ids.data();
+  const wbvh_node4* nodes = _top->nodes().data();
+
+  auto single = [&](int lane, uint32_t child, uint32_t count)
+    {
+    single_ray sr;
+    init_single_ray(sr, rp, lane);
+    ray r;
+    r.orig = float4(sr.orig[0], sr.orig[1], sr.orig[2], 1.f);
+    r.dir = float4(sr.dir[0], sr.dir[1], sr.dir[2], 0.f);
+    r.t_near = sr.t_near;
+    r.t_far = sr.t_far;
+    traverse(nodes, child, count, sr, [&](uint32_t first, uint32_t cnt, single_ray& s)
+      {
+      for (uint32_t i = first; i < first + cnt; ++i)
+        {
+        const uint32_t obj = ids[i];
+        if (objects[obj]->empty())
+          continue;
+        const ray local = transform_ray(r, inverted_transformations[obj], s.t_far);
+        uint32_t id;
+        hit local_hit = objects[obj]->find_closest_triangle(id, local, triangles[obj], vertices[obj]);
+        if (local_hit.found && local_hit.distance < s.t_far)
+          {
+          s.t_far = local_hit.distance;
+          h.u[lane] = local_hit.u;
+          h.v[lane] = local_hit.v;
+          h.distance[lane] = local_hit.distance;
+          h.triangle_id[lane] = id;
+          h.two_level_index[lane] = obj;
+          h.found |= 1 << lane;
+          }
+        }
+      });
+    set_lane(rp.t_far, lane, sr.t_far);
+    };
+
+  auto leaf4 = [&](uint32_t first, uint32_t count, int active)
+    {
+    for (uint32_t i = first; i < first + count; ++i)
+      {
+      const uint32_t obj = ids[i];
+      if (objects[obj]->empty())
+        continue;
+      wbvh_ray_packet local;
+      transform_packet(local, rp, inverted_transformations[obj]);
+      const int updated = objects[obj]->find_closest_triangles(h, local, active, triangles[obj], vertices[obj]);
+      if (updated)
+        {
+        rp.t_far = local.t_far;
+        for (int lane = 0; lane < 4; ++lane)
+          if (updated & (1 << lane))
+            h.two_level_index[lane] = obj;
+        }
+      }
+    };
+
+  int sign[3];
+  if (!packet_signs(sign, rp, mask))
+    {
+    for (int lane = 0; lane < 4; ++lane)
+      if (mask & (1 << lane))
+        single(lane, 0, 0);
+    }
+  else
+    traverse_packet<4>(nodes, rp, sign, mask, leaf4, single);
+  }
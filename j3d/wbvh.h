@@ -0,0 +1,120 @@
+#pragma once
+
+#include <jtk/qbvh.h>
+#include <jtk/vec.h>
+
+#include "wbvh_kernels.h"
+
+#include <immintrin.h>
+#include <stdint.h>
+#include <memory>
+#include <vector>
+
+/*
+wbvh is a wide bounding volume hierarchy with four (SSE) or eight (AVX) children per node.
+Contrary to jtk::qbvh, j3d owns the node layout, so that the canvas can trace coherent ray packets
+through the hierarchy instead of one ray at a time.
+*/
+
+struct alignas(16) wbvh_node4
+  {
+  float bbox_min[3][4];
+  float bbox_max[3][4];
+  uint32_t child[4]; // node index for inner nodes, first index in the primitive ids for leaves
+  uint32_t count[4]; // 0 for inner nodes, number of primitives for leaves
+  };
+
+/*
+Four rays in structure-of-arrays layout. Lanes that are not set in the mask passed to the
+packet queries are ignored.
+*/
+struct wbvh_ray_packet
+  {
+  __m128 orig[3];
+  __m128 dir[3];
+  __m128 t_near;
+  __m128 t_far;
+  };
+
+struct wbvh_packet_hit
+  {
+  float u[4];
+  float v[4];
+  float distance[4];
+  uint32_t triangle_id[4];
+  uint32_t two_level_index[4];
+  int found; // bit i is set if lane i found a hit
+  };
+
+void make_ray_packet(wbvh_ray_packet& rp, const jtk::ray* rays, int mask);
+
+void init_packet_hit(wbvh_packet_hit& h);
+
+// Returns 8 if the cpu supports AVX2 or AVX-512, 4 otherwise.
+uint32_t wbvh_default_width();
+
+class wbvh
+  {
+  public:
+    wbvh(const std::vector<jtk::vec3<uint32_t>>& triangles, const jtk::vec3<float>* vertices, uint32_t width = wbvh_default_width());
+
+    wbvh(const jtk::vec3<float>* primitive_min_bb, const jtk::vec3<float>* primitive_max_bb, uint32_t nr_of_primitives, uint32_t width = wbvh_default_width());
+
+    jtk::hit find_closest_triangle(uint32_t& triangle_id, const jtk::ray& r, const jtk::vec3<uint32_t>* triangles, const jtk::vec3<float>* vertices) const;
+
+    // Updates the lanes of h and rp.t_far for which a closer hit is found, and returns the mask of those lanes.
+    int find_closest_triangles(wbvh_packet_hit& h, wbvh_ray_packet& rp, int mask, const jtk::vec3<uint32_t>* triangles, const jtk::vec3<float>* vertices) const;
+
+    // Returns true as soon as any triangle is hit between r.t_near and r.t_far. Use this for shadow and other visibility rays.
+    bool is_occluded(const jtk::ray& r, const jtk::vec3<uint32_t>* triangles, const jtk::vec3<float>* vertices) const;
+
+    std::vector<jtk::hit> find_all_triangles(std::vector<uint32_t>& triangle_ids, const jtk::ray& r, const jtk::vec3<uint32_t>* triangles, const jtk::vec3<float>* vertices) const;
+
+    uint32_t width() const { return _width; }
+
+    const std::vector<wbvh_node4>& nodes() const { return _nodes; }
+    const std::vector<wbvh_node8>& nodes8() const { return _nodes8; }
+    const std::vector<uint32_t>& primitive_ids() const { return _primitive_ids; }
+
+    const jtk::vec3<float>& min_bb() const { return _min_bb; }
+    const jtk::vec3<float>& max_bb() const { return _max_bb; }
+
+    bool empty() const { return _primitive_ids.empty(); }
+
+    // Surface area heuristic cost of the hierarchy, see compute_sah_cost in wbvh.cpp. Lower is better.
+    float sah_cost() const { return _sah_cost; }
+
+  private:
+    void _build(const float* primitive_bounds, uint32_t nr_of_primitives);
+
+  private:
+    uint32_t _width;
+    std::vector<wbvh_node4> _nodes;
+    std::vector<wbvh_node8> _nodes8;
+    std::vector<uint32_t> _primitive_ids;
+    jtk::vec3<float> _min_bb, _max_bb;
+    float _sah_cost;
+  };
+
+class wbvh_two_level_with_transformations
+  {
+  public:
+    wbvh_two_level_with_transformations(const wbvh* const* objects, const jtk::float4x4* transformations, uint32_t nr_of_objects);
+
+    // Top level over the objects in subset only. The queries still take the full arrays and report indices into them.
+    wbvh_two_level_with_transformations(const wbvh* const* objects, const jtk::float4x4* transformations, const uint32_t* subset, uint32_t subset_size);
+
+    jtk::hit find_closest_triangle(uint32_t& triangle_id, uint32_t& two_level_index, const jtk::ray& r, const wbvh* const* objects, const jtk::float4x4* inverted_transformations, const jtk::vec3<uint32_t>* const* triangles, const jtk::vec3<float>* const* vertices) const;
+
+    void find_closest_triangles(wbvh_packet_hit& h, const wbvh_ray_packet& rp, int mask, const wbvh* const* objects, const jtk::float4x4* inverted_transformations, const jtk::vec3<uint32_t>* const* triangles, const jtk::vec3<float>* const* vertices) const;
+
+    // Returns true as soon as any object is hit between r.t_near and r.t_far.
+    bool is_occluded(const jtk::ray& r, const wbvh* const* objects, const jtk::float4x4* inverted_transformations, const jtk::vec3<uint32_t>* const* triangles, const jtk::vec3<float>* const* vertices) const;
+
+  private:
+    void _build(const wbvh* const* objects, const jtk::float4x4* transformations, const uint32_t* subset, uint32_t subset_size);
+
+  private:
+    std::unique_ptr<wbvh> _top;
+    std::vector<uint32_t> _ids; // object index of each primitive id of _top
+  };
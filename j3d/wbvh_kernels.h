@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+Plain data interface between wbvh and the traversal kernels that are compiled with a wider instruction set
+than the rest of j3d. The kernel translation units only include this header, so that no inline code from
+jtk or the standard library gets compiled with instructions that the cpu might not support.
+*/
+
+struct wbvh_node8
+  {
+  float bbox_min[3][8];
+  float bbox_max[3][8];
+  uint32_t child[8]; // node index for inner nodes, first index in the primitive ids for leaves
+  uint32_t count[8]; // 0 for inner nodes, number of primitives for leaves
+  };
+
+struct wbvh_kernel_ray
+  {
+  float orig[3];
+  float dir[3];
+  float t_near;
+  float t_far;
+  };
+
+struct wbvh_kernel_hit
+  {
+  float u, v;
+  uint32_t triangle_id;
+  int found;
+  };
+
+typedef void(*wbvh_hit_callback)(void* context, uint32_t triangle_id, float distance, float u, float v);